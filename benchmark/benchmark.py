@@ -7,20 +7,28 @@ import qbuf
 
 
 def main():
-    _, data_file, chunk_size, cls, iterations = sys.argv
+    _, data_file, chunk_size, cls, iterations, coalesce_below = sys.argv
     chunk_size = int(chunk_size)
     iterations = int(iterations)
+    coalesce_below = int(coalesce_below)
 
     def new_buf():
         if not cls:
             return None
+        if coalesce_below:
+            return getattr(qbuf, cls)(b'\n', coalesce_below=coalesce_below)
         return getattr(qbuf, cls)(b'\n')
 
     for x in xrange(iterations):
         buf = new_buf()
         with open(data_file, 'rb') as infile:
             start = time.time()
-            while True:
+            if not chunk_size and buf is not None:
+                # A chunk size of 0 maps the whole file in instead.
+                buf.push_file(infile)
+                for _ in buf:
+                    pass
+            while chunk_size:
                 chunk = infile.read(chunk_size)
                 if not chunk:
                     break
@@ -13,7 +13,7 @@ import qbuf
 def show(item):
     if item is None:
         return None
-    return '{0[lines]}/{0[length]}  {1}kB  {2!r}'.format(*item)
+    return '{0[lines]}/{0[length]}  {1}B  {2!r}  {3}'.format(*item)
 
 
 def main():
@@ -29,28 +29,42 @@ def main():
         outfile.write(item.pop('data').encode())
         item['data_file'] = outfile
 
-    prod = list(itertools.product(
-        data,
-        [2, 4, 8, 32, 1024],
-        [cls for cls in ('BufferQueue', 'PythonBufferQueue', '')
-         if not cls or hasattr(qbuf, cls)]))
+    # Tiny chunks are only run against the smaller data sets; at two bytes
+    # a chunk, the 10m ones would take far too long.
+    configs = [
+        (cls, coalesce_below)
+        for cls, coalesce_below in [
+            ('BufferQueue', 0),
+            ('BufferQueue', 64),
+            ('PythonBufferQueue', 0),
+            ('', 0),
+        ]
+        if not cls or hasattr(qbuf, cls)]
+    prod = [
+        (item, chunk_size, cls, coalesce_below)
+        for item, chunk_size, (cls, coalesce_below) in itertools.product(
+            data,
+            [2, 16, 2 * 1024, 4 * 1024, 8 * 1024, 32 * 1024, 1024 * 1024],
+            configs)
+        if chunk_size >= 1024 or item['length'] in ('1k', '10k')]
 
     times = []
     with click.progressbar(prod, show_eta=False, item_show_func=show,
                            bar_template='[%(bar)s] %(info)s') as bar:
-        for item, chunk_kb, cls in bar:
+        for item, chunk_size, cls, coalesce_below in bar:
             item = item.copy()
             args = [sys.executable,
                     # '-mvmprof', '--web', '--config', config_path,
                     os.path.join(here, 'benchmark.py'),
-                    item.pop('data_file').name, str(chunk_kb * 1024), cls,
-                    iterations]
+                    item.pop('data_file').name, str(chunk_size), cls,
+                    iterations, str(coalesce_below)]
             proc = subprocess.Popen(args, stdout=subprocess.PIPE)
             stdout, _ = proc.communicate()
             item.update({
                 'benchmarks': [float(line) for line in stdout.splitlines()],
-                'chunk_kb': chunk_kb,
+                'chunk_size': chunk_size,
                 'cls': cls or None,
+                'coalesce_below': coalesce_below,
             })
             times.append(item)
 
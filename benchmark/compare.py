@@ -0,0 +1,51 @@
+"""Compare two benchmark results files written by suite.py or ring_bench.
+
+    python compare.py baseline.json current.json [--tolerance 0.1]
+
+Exits with status 1 if any benchmark got slower by more than the tolerance.
+"""
+
+import argparse
+import json
+import sys
+
+
+def compare(baseline, current, tolerance):
+    """Return (name, baseline time, current time, ratio, regressed) for each
+    benchmark in both sets of results."""
+    ret = []
+    old, new = baseline['benchmarks'], current['benchmarks']
+    for name in sorted(set(old) & set(new)):
+        ratio = new[name] / old[name]
+        ret.append((name, old[name], new[name], ratio, ratio > 1 + tolerance))
+    return ret
+
+
+def report(comparison):
+    """Print a comparison out, returning whether anything regressed."""
+    regressed = False
+    for name, old, new, ratio, slower in comparison:
+        sys.stdout.write('%-36s %10.1f -> %10.1f ns/op  %+6.1f%%%s\n' % (
+            name, old * 1e9, new * 1e9, (ratio - 1) * 100,
+            '  REGRESSION' if slower else ''))
+        regressed = regressed or slower
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('baseline')
+    parser.add_argument('current')
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help='how much slower is a regression (a fraction)')
+    args = parser.parse_args()
+    with open(args.baseline) as infile:
+        baseline = json.load(infile)
+    with open(args.current) as infile:
+        current = json.load(infile)
+    if report(compare(baseline, current, args.tolerance)):
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
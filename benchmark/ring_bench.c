@@ -0,0 +1,298 @@
+/* Microbenchmarks for the BufferQueue ring, run without going through the
+ * interpreter. qbufmodule.c is compiled straight in and its functions are
+ * called from C, so the timings cover only the buffer's own work (and the
+ * bytes objects it makes). Results go to stdout as JSON in the same format
+ * as suite.py's, so compare.py can check them against a baseline:
+ *
+ *     make ring_bench
+ *     ./ring_bench > baseline.json
+ *     ./ring_bench > current.json && python compare.py baseline.json current.json
+ */
+
+#include "../qbufmodule.c"
+
+#include <time.h>
+
+#define REPEAT 5
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+die(const char *what)
+{
+    if (PyErr_Occurred())
+        PyErr_Print();
+    fprintf(stderr, "ring_bench: %s failed\n", what);
+    exit(1);
+}
+
+static BufferQueue *
+new_queue(const char *delimiter, Py_ssize_t coalesce_below)
+{
+    PyObject *ret = PyObject_CallFunction((PyObject *)&BufferQueueType,
+        "yn", delimiter, coalesce_below);
+    if (!ret)
+        die("BufferQueue()");
+    return (BufferQueue *)ret;
+}
+
+/* Fill a new bytes object of length bytes from a fixed-seed generator. */
+static PyObject *
+random_bytes(unsigned int *seed, Py_ssize_t length)
+{
+    PyObject *ret;
+    Py_ssize_t i;
+    char *data;
+    if (!(ret = PyBytes_FromStringAndSize(NULL, length)))
+        die("bytes");
+    data = PyBytes_AS_STRING(ret);
+    for (i = 0; i < length; ++i) {
+        *seed = *seed * 1103515245 + 12345;
+        data[i] = 32 + (*seed >> 16) % 95;
+    }
+    return ret;
+}
+
+/* Push data in pieces of chunk_size bytes. */
+static void
+push_chunked(BufferQueue *queue, PyObject *data, Py_ssize_t chunk_size)
+{
+    PyObject *chunk;
+    Py_ssize_t i, size = PyBytes_GET_SIZE(data);
+    for (i = 0; i < size; i += chunk_size) {
+        if (!(chunk = PyBytes_FromStringAndSize(PyBytes_AS_STRING(data) + i,
+                (size - i < chunk_size)? size - i : chunk_size)))
+            die("bytes");
+        if (BufferQueue_push(queue, chunk) == -1)
+            die("push");
+        Py_DECREF(chunk);
+    }
+}
+
+static void
+push_copies(BufferQueue *queue, Py_ssize_t size, Py_ssize_t count)
+{
+    unsigned int seed = 1234;
+    PyObject *chunk = random_bytes(&seed, size);
+    Py_ssize_t i;
+    for (i = 0; i < count; ++i)
+        if (BufferQueue_push(queue, chunk) == -1)
+            die("push");
+    Py_DECREF(chunk);
+}
+
+static void
+pop_n(BufferQueue *queue, Py_ssize_t length, int as_buffer)
+{
+    PyObject *ret;
+    if (!(ret = BufferQueue_pop(queue, length, as_buffer)))
+        die("pop");
+    Py_DECREF(ret);
+}
+
+/* Each benchmark fills a queue, then runs and times its operations,
+ * returning seconds per operation. */
+
+static double
+bench_pop_whole_chunk(void)
+{
+    BufferQueue *queue = new_queue("", 0);
+    double start;
+    int i;
+    push_copies(queue, 256, 10000);
+    start = now();
+    for (i = 0; i < 10000; ++i)
+        pop_n(queue, 256, 0);
+    start = (now() - start) / 10000;
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_pop_view_in_chunk(void)
+{
+    BufferQueue *queue = new_queue("", 0);
+    double start;
+    int i;
+    push_copies(queue, 65536, 16);
+    start = now();
+    for (i = 0; i < 16 * 1024; ++i)
+        pop_n(queue, 64, 1);
+    start = (now() - start) / (16 * 1024);
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_pop_chunk_remainder(void)
+{
+    BufferQueue *queue = new_queue("", 0);
+    double start;
+    int i;
+    push_copies(queue, 256, 10000);
+    start = now();
+    for (i = 0; i < 10000; ++i) {
+        pop_n(queue, 16, 1);
+        pop_n(queue, 240, 0);
+    }
+    start = (now() - start) / 10000;
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_pop_spanning(void)
+{
+    BufferQueue *queue = new_queue("", 0);
+    double start;
+    int i;
+    push_copies(queue, 64, 10000);
+    start = now();
+    for (i = 0; i < 640; ++i)
+        pop_n(queue, 1000, 0);
+    start = (now() - start) / 640;
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_pop_struct(void)
+{
+    BufferQueue *queue = new_queue("", 0);
+    StructCacheEntry *entry;
+    PyObject *format, *ret;
+    double start;
+    int i;
+    push_copies(queue, 14 * 256, 40);
+    if (!(format = PyUnicode_FromString("!HIQ"))
+            || !(entry = qbuf_struct_lookup(format)))
+        die("struct lookup");
+    start = now();
+    for (i = 0; i < 10000; ++i) {
+        if (!(ret = BufferQueue_pop_struct(queue, entry)))
+            die("pop_struct");
+        Py_DECREF(ret);
+    }
+    start = (now() - start) / 10000;
+    Py_DECREF(entry);
+    Py_DECREF(format);
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_popline_straddling_delimiter(void)
+{
+    static const char delimiter[] = "\r\n--boundary--\r\n";
+    BufferQueue *queue = new_queue(delimiter, 0);
+    PyObject *data, *line, *matched, *parts, *sep;
+    unsigned int seed = 1234;
+    double start;
+    int i;
+    if (!(parts = PyList_New(2000)))
+        die("list");
+    for (i = 0; i < 2000; ++i)
+        PyList_SET_ITEM(parts, i, random_bytes(&seed, 100 + seed % 200));
+    if (!(sep = PyBytes_FromString(delimiter))
+            || !(data = _PyBytes_Join(sep, parts)))
+        die("join");
+    /* A prime chunk size moves the delimiters around the chunk ends. */
+    push_chunked(queue, data, 61);
+    start = now();
+    for (i = 0; i < 1999; ++i) {
+        if (BufferQueue_popline(queue, &line, NULL, &matched) != 1)
+            die("popline");
+        Py_DECREF(line);
+        Py_DECREF(matched);
+    }
+    start = (now() - start) / 1999;
+    Py_DECREF(data);
+    Py_DECREF(sep);
+    Py_DECREF(parts);
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_tiny_chunk_flood(Py_ssize_t coalesce_below)
+{
+    BufferQueue *queue = new_queue("\n", coalesce_below);
+    PyObject *chunk, *ret, *args;
+    double start;
+    int i;
+    if (!(chunk = PyBytes_FromString("a\n")) || !(args = PyTuple_New(0)))
+        die("bytes");
+    start = now();
+    for (i = 0; i < 100000; ++i)
+        if (BufferQueue_push(queue, chunk) == -1)
+            die("push");
+    if (!(ret = BufferQueue_dopoplines(queue, args, NULL)))
+        die("poplines");
+    start = (now() - start) / 100000;
+    Py_DECREF(ret);
+    Py_DECREF(args);
+    Py_DECREF(chunk);
+    Py_DECREF(queue);
+    return start;
+}
+
+static double
+bench_tiny_chunk_flood_plain(void)
+{
+    return bench_tiny_chunk_flood(0);
+}
+
+static double
+bench_tiny_chunk_flood_coalesced(void)
+{
+    return bench_tiny_chunk_flood(64);
+}
+
+static const struct {
+    const char *name;
+    double (*func)(void);
+} benchmarks[] = {
+    {"pop_chunk_remainder", bench_pop_chunk_remainder},
+    {"pop_spanning", bench_pop_spanning},
+    {"pop_struct", bench_pop_struct},
+    {"pop_view_in_chunk", bench_pop_view_in_chunk},
+    {"pop_whole_chunk", bench_pop_whole_chunk},
+    {"popline_straddling_delimiter", bench_popline_straddling_delimiter},
+    {"tiny_chunk_flood", bench_tiny_chunk_flood_plain},
+    {"tiny_chunk_flood_coalesced", bench_tiny_chunk_flood_coalesced},
+};
+
+int
+main(int argc, char **argv)
+{
+    PyObject *module;
+    double best, elapsed;
+    size_t i;
+    int run;
+    Py_Initialize();
+    if (!(module = PyModule_New("_qbuf")) || qbuf_exec(module) == -1)
+        die("module setup");
+
+    printf("{\n  \"meta\": {\"cls\": \"ring_bench\"},\n  \"benchmarks\": {\n");
+    for (i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); ++i) {
+        best = -1;
+        for (run = 0; run < REPEAT; ++run) {
+            elapsed = benchmarks[i].func();
+            if (best < 0 || elapsed < best)
+                best = elapsed;
+        }
+        printf("    \"%s\": %.6g%s\n", benchmarks[i].name, best,
+            (i + 1 < sizeof(benchmarks) / sizeof(*benchmarks))? "," : "");
+    }
+    printf("  }\n}\n");
+
+    Py_DECREF(module);
+    Py_Finalize();
+    return 0;
+}
@@ -0,0 +1,226 @@
+"""A deterministic benchmark suite covering each of the BufferQueue pop paths.
+
+Every benchmark runs in this process against data generated from a fixed
+seed, and reports the best time per operation out of several runs. Only the
+operations themselves are timed; the buffer is filled beforehand. Results
+can be saved as JSON and checked against an earlier run:
+
+    python suite.py --json baseline.json
+    python suite.py --json current.json --compare baseline.json
+
+ring_bench.c writes the same JSON format for the C-level benchmarks, and
+compare.py compares any two such files.
+"""
+
+import argparse
+import json
+import random
+import struct
+import sys
+import timeit
+
+import qbuf
+
+from compare import compare, report
+
+
+SEED = 1234
+
+
+def rng():
+    return random.Random(SEED)
+
+
+def random_bytes(r, n):
+    return bytes(bytearray(r.randrange(32, 127) for _ in range(n)))
+
+
+def chunked(data, size):
+    return [data[i:i + size] for i in range(0, len(data), size)]
+
+
+def bench_pop_whole_chunk(cls):
+    """pop(n) of exactly one pushed bytes chunk, returned without a copy."""
+    buf = cls()
+    buf.push_many([random_bytes(rng(), 256)] * 10000)
+
+    def run():
+        for _ in range(10000):
+            buf.pop(256)
+        return 10000
+    return run
+
+
+def bench_pop_view_in_chunk(cls):
+    """pop_view(n) from within a single chunk, returning a view of it."""
+    buf = cls()
+    buf.push_many([random_bytes(rng(), 65536)] * 16)
+
+    def run():
+        for _ in range(16 * 1024):
+            buf.pop_view(64)
+        return 16 * 1024
+    return run
+
+
+def bench_pop_chunk_remainder(cls):
+    """pop(n) of the rest of a chunk which was partly popped already."""
+    buf = cls()
+    buf.push_many([random_bytes(rng(), 256)] * 10000)
+
+    def run():
+        for _ in range(10000):
+            buf.pop_view(16)
+            buf.pop(240)
+        return 10000
+    return run
+
+
+def bench_pop_spanning(cls):
+    """pop(n) spanning many small chunks, which has to copy them together."""
+    buf = cls()
+    buf.push_many(chunked(random_bytes(rng(), 64 * 10000), 64))
+
+    def run():
+        for _ in range(640):
+            buf.pop(1000)
+        return 640
+    return run
+
+
+def bench_pop_view_spanning(cls):
+    """pop_view(n) spanning chunks, which also has to copy."""
+    buf = cls()
+    buf.push_many(chunked(random_bytes(rng(), 64 * 10000), 64))
+
+    def run():
+        for _ in range(640):
+            buf.pop_view(1000)
+        return 640
+    return run
+
+
+def bench_pop_struct(cls):
+    """pop_struct of a small all-integer format."""
+    r = rng()
+    s = struct.Struct('!HIQ')
+    data = b''.join(
+        s.pack(r.randrange(1 << 16), r.randrange(1 << 32), r.randrange(1 << 64))
+        for _ in range(10000))
+    buf = cls()
+    buf.push_many(chunked(data, 4096))
+
+    def run():
+        for _ in range(10000):
+            buf.pop_struct('!HIQ')
+        return 10000
+    return run
+
+
+def bench_poplines(cls):
+    """poplines over 128-byte lines arriving in 4KiB chunks."""
+    r = rng()
+    data = b''.join(random_bytes(r, 126) + b'\r\n' for _ in range(10000))
+    buf = cls(b'\r\n')
+    buf.push_many(chunked(data, 4096))
+
+    def run():
+        return len(buf.poplines())
+    return run
+
+
+def bench_popline_straddling_delimiter(cls):
+    """popline with a long delimiter that keeps straddling chunk ends."""
+    delimiter = b'\r\n--boundary--\r\n'
+    r = rng()
+    data = b''.join(
+        random_bytes(r, r.randrange(100, 300)) + delimiter
+        for _ in range(2000))
+    buf = cls(delimiter)
+    # A prime chunk size moves the delimiters around the chunk ends.
+    buf.push_many(chunked(data, 61))
+
+    def run():
+        for _ in range(2000):
+            buf.popline()
+        return 2000
+    return run
+
+
+def bench_tiny_chunk_flood(cls, coalesce_below=0):
+    """pushes of a byte or two at a time, then popping lines out."""
+    r = rng()
+    data = b''.join(random_bytes(r, 30) + b'\n' for _ in range(3000))
+    pieces = chunked(data, 2)
+    buf = cls(b'\n', coalesce_below=coalesce_below)
+
+    def run():
+        for piece in pieces:
+            buf.push(piece)
+        buf.poplines()
+        return len(pieces)
+    return run
+
+
+def bench_tiny_chunk_flood_coalesced(cls):
+    """the same tiny pushes, coalesced into larger chunks."""
+    return bench_tiny_chunk_flood(cls, coalesce_below=64)
+
+
+BENCHMARKS = [
+    (name[len('bench_'):], func)
+    for name, func in sorted(globals().items())
+    if name.startswith('bench_')]
+
+
+def run_benchmark(cls, func, repeat):
+    best = None
+    for _ in range(repeat):
+        run = func(cls)
+        start = timeit.default_timer()
+        n_ops = run()
+        elapsed = (timeit.default_timer() - start) / n_ops
+        if best is None or elapsed < best:
+            best = elapsed
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--cls', default='BufferQueue',
+                        help='the qbuf class to benchmark')
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='how many times to run each benchmark')
+    parser.add_argument('--filter', default='',
+                        help='only run benchmarks with this in their name')
+    parser.add_argument('--json', help='write the results here')
+    parser.add_argument('--compare', metavar='BASELINE',
+                        help='compare the results against an earlier run')
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help='how much slower is a regression (a fraction)')
+    args = parser.parse_args()
+
+    cls = getattr(qbuf, args.cls)
+    results = {}
+    for name, func in BENCHMARKS:
+        if args.filter not in name:
+            continue
+        results[name] = run_benchmark(cls, func, args.repeat)
+        sys.stdout.write('%-36s %10.1f ns/op\n' % (name, results[name] * 1e9))
+
+    output = {
+        'meta': {'cls': args.cls, 'python': sys.version.split()[0]},
+        'benchmarks': results,
+    }
+    if args.json:
+        with open(args.json, 'w') as outfile:
+            json.dump(output, outfile, indent=2, sort_keys=True)
+    if args.compare:
+        with open(args.compare) as infile:
+            baseline = json.load(infile)
+        if report(compare(baseline, output, args.tolerance)):
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,10 +1,23 @@
-from qbuf._python import PythonBufferQueue
+from qbuf._python import (
+    MODE_RAW, MODE_DELIMITED, MODE_STATEFUL, PythonBufferQueue,
+    PythonDispatcher, PythonPoller)
 
 try:
-    from qbuf._qbuf import BufferQueue, BufferUnderflow
+    from qbuf._qbuf import (
+        BufferOverflow, BufferQueue, BufferUnderflow, Dispatcher, FrameTooLong,
+        SharedRing)
 except ImportError:
-    from qbuf._python import BufferUnderflow
+    from qbuf._python import BufferUnderflow, FrameTooLong
+
+try:
+    # Only where there's epoll.
+    from qbuf._qbuf import Poller
+except ImportError:
+    pass
 
 
 __version__ = '0.9.4'
-__all__ = 'BufferQueue', 'BufferUnderflow', 'PythonBufferQueue'
+__all__ = ('BufferOverflow', 'BufferQueue', 'BufferUnderflow', 'Dispatcher',
+           'FrameTooLong', 'MODE_RAW', 'MODE_DELIMITED', 'MODE_STATEFUL',
+           'Poller', 'PythonBufferQueue', 'PythonDispatcher', 'PythonPoller',
+           'SharedRing')
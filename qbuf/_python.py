@@ -1,19 +1,120 @@
 import collections
+import errno
+import mmap
+import os
+import select
 import struct
+import sys
+import threading
+import time
 
 try:
-    from qbuf._qbuf import BufferUnderflow
+    from qbuf._qbuf import BufferUnderflow, FrameTooLong
 except ImportError:
     class BufferUnderflow(Exception):
         pass
 
+    class FrameTooLong(ValueError):
+        pass
+
+MODE_RAW, MODE_DELIMITED, MODE_STATEFUL = range(3)
+
+_STRUCT_CACHE_SIZE = 100
+_MAP_SEGMENT_SIZE = 64 * 1024 * 1024
+_SCAN_STEP = 4096
+_WAIT_SLICE = 0.1
+_struct_cache = {}
+
+
+def _writable_bytes(buffer):
+    view = memoryview(buffer)
+    if view.readonly:
+        raise TypeError('expected a writable buffer')
+    if view.ndim != 1 or view.itemsize != 1:
+        view = view.cast('B')
+    return view
+
+
+def _chunk_bytes(chunk, start, end):
+    return memoryview(chunk)[start:end].tobytes()
+
+
+def _chunk_find(chunk, sub, start, end):
+    try:
+        return chunk.find(sub, start, end)
+    except AttributeError:
+        # memoryviews, from push_file, have no find.
+        i = _chunk_bytes(chunk, start, end).find(sub)
+        return i if i == -1 else start + i
+
+
+def _earlier_match(best_pos, best, pos, delimiter):
+    if best is None or pos < best_pos or (
+            pos == best_pos and len(delimiter) > len(best)):
+        return pos, delimiter
+    return best_pos, best
+
+
+def _compile_struct(format):
+    s = _struct_cache.get(format)
+    if s is None:
+        if len(_struct_cache) >= _STRUCT_CACHE_SIZE:
+            _struct_cache.clear()
+        s = _struct_cache[format] = struct.Struct(format)
+    return s
+
 
 class PythonBufferQueue(object):
-    def __init__(self, delimiter=b''):
+    def __init__(self, delimiter=b'', coalesce_below=0, initial_capacity=8,
+                 delimiters=None, release_gil_above=0, stats=False):
+        # coalesce_below, initial_capacity and release_gil_above are accepted
+        # for compatibility with the C implementation; the deque manages its
+        # own memory.
+        if delimiter and delimiters is not None:
+            raise TypeError('only one of delimiter and delimiters may be given')
         self.delimiter = delimiter
+        if delimiters is not None:
+            self.delimiters = delimiters
         self._buffer = collections.deque()
         self._offset = 0
         self._tot_length = 0
+        self._generation = 0
+        self._cond = threading.Condition()
+        self._n_waiters = 0
+        self._reserved = None
+        self._stats = None
+        if stats:
+            self._reset_stats()
+
+    def _get_delimiter(self):
+        return self._delimiter
+
+    def _set_delimiter(self, delimiter):
+        if delimiter is not None and not isinstance(delimiter, bytes):
+            raise TypeError('delimiter must be bytes or None')
+        self._delimiter = delimiter or b''
+        self._delimiters = None
+
+    delimiter = property(_get_delimiter, _set_delimiter)
+
+    def _get_delimiters(self):
+        return self._delimiters
+
+    def _set_delimiters(self, delimiters):
+        if delimiters is None:
+            self._delimiters = None
+            return
+        if isinstance(delimiters, bytes):
+            raise TypeError(
+                'delimiters must be an iterable of bytes, not bytes')
+        delimiters = tuple(delimiters)
+        if not all(isinstance(d, bytes) and d for d in delimiters):
+            raise TypeError('delimiters must all be non-empty bytes')
+        self._delimiter = b''
+        self._delimiters = tuple(
+            sorted(delimiters, key=len, reverse=True)) or None
+
+    delimiters = property(_get_delimiters, _set_delimiters)
 
     def __repr__(self):
         return '<BufferQueue of %s bytes>' % (self._tot_length,)
@@ -21,20 +122,164 @@ class PythonBufferQueue(object):
     def __len__(self):
         return self._tot_length
 
+    def _stat(self, name, n=1):
+        if self._stats is not None:
+            self._stats[name] += n
+
+    def _stat_pop(self):
+        if self._stats is not None:
+            histogram = self._stats['buffered_histogram']
+            bucket = self._tot_length.bit_length()
+            histogram.extend([0] * (bucket + 1 - len(histogram)))
+            histogram[bucket] += 1
+
+    def _pushed(self, length):
+        if self._stats is not None:
+            self._stats['bytes_pushed'] += length
+            self._stats['chunks_high_water'] = max(
+                self._stats['chunks_high_water'], len(self._buffer))
+        if self._n_waiters:
+            with self._cond:
+                self._cond.notify_all()
+
     def push(self, string):
+        if not len(string):
+            return
         self._tot_length += len(string)
         self._buffer.append(string)
+        self._pushed(len(string))
+
+    def push_front(self, string):
+        if not len(string):
+            return
+        if self._offset:
+            self._buffer[0] = self._buffer[0][self._offset:]
+            self._offset = 0
+        self._generation += 1
+        self._tot_length += len(string)
+        self._buffer.appendleft(string)
+        self._pushed(len(string))
+
+    def push_struct(self, format, *values):
+        self.push(_compile_struct(format).pack(*values))
+
+    def push_file(self, file, offset=0, length=None):
+        fd = file if isinstance(file, int) else file.fileno()
+        file_size = os.fstat(fd).st_size
+        if not 0 <= offset <= file_size:
+            raise ValueError('offset is outside the file')
+        if length is None:
+            length = file_size - offset
+        elif not 0 <= length <= file_size - offset:
+            raise ValueError('length runs past the end of the file')
+        # Map everything before pushing any of it, so that a failure leaves
+        # the buffer as it was.
+        segments = []
+        while length:
+            base = offset - offset % mmap.ALLOCATIONGRANULARITY
+            lead = offset - base
+            segment = min(_MAP_SEGMENT_SIZE - lead, length)
+            m = mmap.mmap(fd, lead + segment, access=mmap.ACCESS_READ,
+                          offset=base)
+            try:
+                segments.append(memoryview(m)[lead:])
+            except TypeError:
+                # python 2's mmap only has the old buffer interface.
+                segments.append(m[lead:])
+            offset += segment
+            length -= segment
+        for segment in segments:
+            self.push(segment)
 
     def push_many(self, iterable):
         for x in iterable:
             self.push(x)
 
+    def recv_from(self, fd, max_bytes=4096):
+        if not isinstance(fd, int):
+            fd = fd.fileno()
+        try:
+            data = os.read(fd, max_bytes)
+        except OSError as e:
+            if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                return None
+            raise
+        self.push(data)
+        return len(data)
+
+    def reserve(self, sizehint=-1):
+        self._reserved = bytearray(sizehint if sizehint > 0 else 65536)
+        return memoryview(self._reserved)
+
+    def commit(self, length):
+        if self._reserved is None:
+            raise ValueError('nothing is reserved')
+        if not 0 <= length <= len(self._reserved):
+            raise ValueError('length must be within the reservation')
+        reserved, self._reserved = self._reserved, None
+        self.push(bytes(reserved[:length]))
+
+    def send_to(self, fd, max_bytes=None):
+        if not isinstance(fd, int):
+            fd = fd.fileno()
+        if max_bytes is not None and max_bytes <= 0:
+            raise ValueError('max_bytes must be positive')
+        total = 0
+        while self._tot_length and (max_bytes is None or total < max_bytes):
+            left = self._tot_length if max_bytes is None else max_bytes - total
+            iov = self.peek_iov(min(left, self._tot_length))
+            generation = self._generation
+            try:
+                if hasattr(os, 'writev'):
+                    written = os.writev(fd, iov[:1024])
+                    batch = sum(len(v) for v in iov[:1024])
+                else:
+                    written = os.write(fd, iov[0])
+                    batch = len(iov[0])
+            except OSError as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    break
+                raise
+            if generation != self._generation:
+                raise RuntimeError(
+                    'data was taken off the buffer during send_to',
+                    total + written)
+            self._skip(written)
+            total += written
+            if written < batch:
+                break
+        return total
+
     def _advance_buffer(self):
         self._offset = 0
         return self._buffer.popleft()
 
-    def pop(self, length=None, underflow=True, as_view=False):
+    def _wait(self, length, timeout):
+        if timeout is not None:
+            deadline = time.time() + timeout
+        with self._cond:
+            self._n_waiters += 1
+            try:
+                while self._tot_length < length:
+                    if timeout is None:
+                        # In slices, so that signals get handled.
+                        self._cond.wait(_WAIT_SLICE)
+                        continue
+                    remaining = deadline - time.time()
+                    if remaining <= 0:
+                        break
+                    self._cond.wait(remaining)
+            finally:
+                self._n_waiters -= 1
+
+    def pop(self, length=None, timeout=0, underflow=True, as_view=False):
+        if timeout is None or timeout > 0:
+            self._wait(1 if length is None else length, timeout)
+        elif timeout < 0:
+            raise ValueError('timeout must be non-negative')
         if length is None:
+            if timeout != 0 and not self._tot_length:
+                raise BufferUnderflow()
             length = self._tot_length
         elif length < 0:
             raise ValueError()
@@ -47,11 +292,13 @@ class PythonBufferQueue(object):
         if length == 0:
             return b''
 
-        self._tot_length -= length
+        self._stat_pop()
+        self._consumed(length)
         offset = self._offset
         cur_string = self._buffer[0]
         cur_len = len(cur_string)
         if offset == 0 and length == cur_len:
+            self._stat('zero_copy_pops')
             return self._advance_buffer()
         elif offset + length <= cur_len:
             if offset + length == cur_len:
@@ -59,9 +306,14 @@ class PythonBufferQueue(object):
             else:
                 self._offset += length
             if as_view:
+                self._stat('zero_copy_pops')
                 cur_string = memoryview(cur_string)
+            else:
+                self._stat('copied_bytes', length)
             return cur_string[offset:offset + length]
 
+        self._stat('copied_bytes', length)
+
         ret = bytearray(length)
         copied = 0
         while copied < length:
@@ -85,74 +337,267 @@ class PythonBufferQueue(object):
 
         return bytes(ret)
 
+    def try_pop(self, length):
+        if 0 <= length <= self._tot_length:
+            return self.pop(length)
+        elif length < 0:
+            raise ValueError()
+        return None
+
+    def pop_into(self, buffer, length=None):
+        view = _writable_bytes(buffer)
+        if length is None:
+            length = min(len(view), self._tot_length)
+        elif length < 0:
+            raise ValueError()
+        elif length > len(view):
+            raise ValueError('length is larger than the buffer given')
+        elif length > self._tot_length:
+            raise BufferUnderflow()
+        self._pop_into(view, length)
+        return length
+
+    def _pop_into(self, view, length, drop=0):
+        if length:
+            self._stat_pop()
+            self._stat('copied_bytes', length)
+        pos = 0
+        for chunk in self._iov(length, False):
+            view[pos:pos + len(chunk)] = chunk
+            pos += len(chunk)
+        self._skip(length + drop)
+
     def pop_atmost(self, length):
         return self.pop(length, underflow=False)
 
     def pop_view(self, length=None):
         return self.pop(length, as_view=True)
 
+    def _consumed(self, length):
+        if length:
+            self._generation += 1
+            self._stat('bytes_popped', length)
+        self._tot_length -= length
+
+    def _skip(self, length):
+        self._consumed(length)
+        while length:
+            delta = len(self._buffer[0]) - self._offset
+            if length >= delta:
+                self._advance_buffer()
+                length -= delta
+            else:
+                self._offset += length
+                length = 0
+
+    def _iov(self, length, consume):
+        if length is None:
+            length = self._tot_length
+        elif length < 0:
+            raise ValueError()
+        elif length > self._tot_length:
+            raise BufferUnderflow()
+
+        ret = []
+        offset = self._offset
+        left = length
+        for cur_string in self._buffer:
+            if not left:
+                break
+            delta = min(len(cur_string) - offset, left)
+            ret.append(memoryview(cur_string)[offset:offset + delta])
+            left -= delta
+            offset = 0
+        if consume:
+            self._skip(length)
+        return tuple(ret)
+
+    def pop_iov(self, length=None):
+        return self._iov(length, True)
+
+    def peek_iov(self, length=None):
+        return self._iov(length, False)
+
     def pop_struct(self, format):
-        s = struct.Struct(format)
+        s = _compile_struct(format)
         return s.unpack(self.pop(s.size))
 
+    def try_pop_struct(self, format):
+        s = _compile_struct(format)
+        if s.size > self._tot_length:
+            return None
+        return s.unpack(self.pop(s.size))
+
+    def pop_frames(self, prefix_format, max_frames=None, max_length=None,
+                   as_bytes=False):
+        s = _compile_struct(prefix_format)
+        ret = []
+        while max_frames is None or len(ret) < max_frames:
+            if self._tot_length < s.size:
+                break
+            fields = s.unpack(b''.join(
+                [v.tobytes() for v in self.peek_iov(s.size)]))
+            if len(fields) != 1:
+                raise ValueError(
+                    'prefix_format must describe exactly one integer')
+            length, = fields
+            if length < 0:
+                raise ValueError('got a negative frame length: %d' % length)
+            if max_length is not None and length > max_length:
+                if ret:
+                    break
+                raise FrameTooLong(
+                    'frame of %d bytes is longer than the maximum of %d bytes'
+                    % (length, max_length))
+            if self._tot_length - s.size < length:
+                break
+            self._skip(s.size)
+            ret.append(self.pop(length, as_view=not as_bytes))
+        return ret
+
+    def _scan_delimiters(self, delimiters, exc):
+        # Search chunk by chunk, in windows which double in size, so that
+        # finding a line costs about its length rather than everything
+        # buffered. 'carry' holds the bytes just before the current chunk,
+        # for delimiters which straddle two chunks.
+        overlap = len(max(delimiters, key=len)) - 1
+        best_pos, best = None, None
+        carry = b''
+        pos = 0
+        offset = self._offset
+        for chunk in self._buffer:
+            if best is not None and pos - len(carry) > best_pos:
+                break
+            end = len(chunk)
+            if carry:
+                window = carry + _chunk_bytes(chunk, offset, offset + overlap)
+                for delimiter in delimiters:
+                    i = window.find(delimiter)
+                    if i != -1 and i < len(carry):
+                        best_pos, best = _earlier_match(
+                            best_pos, best, pos - len(carry) + i, delimiter)
+            start, step = offset, _SCAN_STEP
+            while best is None and start < end:
+                stop = min(end, start + step)
+                for delimiter in delimiters:
+                    i = _chunk_find(chunk, delimiter, start,
+                                    min(end, stop + len(delimiter) - 1))
+                    if i != -1:
+                        best_pos, best = _earlier_match(
+                            best_pos, best, pos + i - offset, delimiter)
+                start, step = stop, step * 2
+            if overlap:
+                carry = (carry + _chunk_bytes(
+                    chunk, max(offset, end - overlap), end))[-overlap:]
+            pos += end - offset
+            offset = 0
+        else:
+            if best is not None:
+                # A longer delimiter starting no later might still be
+                # completed by data which hasn't arrived yet.
+                for delimiter in delimiters:
+                    for start in range(
+                            max(0, len(carry) - len(delimiter) + 1),
+                            len(carry)):
+                        at = pos - len(carry) + start
+                        if at > best_pos or (at == best_pos and
+                                             len(delimiter) <= len(best)):
+                            break
+                        if delimiter.startswith(carry[start:]):
+                            self._stat('scanned_bytes', pos)
+                            raise exc()
+        self._stat('scanned_bytes', pos if best is None else best_pos)
+        if best is None:
+            raise exc()
+        return best_pos, best
+
     def _find_delimiter(self, delimiter, exc):
         if delimiter is None:
+            if self._delimiters:
+                return self._scan_delimiters(self._delimiters, exc)
             delimiter = self.delimiter
         if not delimiter:
             raise ValueError()
-        delim_len = len(delimiter)
-        if self._tot_length < delim_len:
+        if self._tot_length < len(delimiter):
             raise exc()
-
-        offset = self._offset
-        split_trial = None
-        pos = 0
-        for cur_string in self._buffer:
-            cur_len = len(cur_string)
-            if split_trial is not None:
-                to_test = cur_string[:split_trial]
-                test_len = len(to_test)
-                delim_chunk = delimiter[
-                    -split_trial:delim_len - split_trial + test_len]
-                if to_test == delim_chunk:
-                    split_trial -= test_len
-                    pos += test_len - offset
-                    if split_trial == 0:
-                        return pos - delim_len, delim_len
-                    continue
-            delim_pos = cur_string.find(delimiter, offset)
-            if delim_pos != -1:
-                return pos + delim_pos - offset, delim_len
-            if delim_len > 1:
-                split_trial = next(
-                    (delim_len + i
-                     for i in range(-delim_len + 1, 0)
-                     if delimiter.startswith(cur_string[i:])),
-                    None)
-            pos += cur_len - offset
-            offset = 0
-
-        raise exc()
+        return self._scan_delimiters((delimiter,), exc)
 
     def popline(self, delimiter=None, keepends=False, _exc=ValueError):
-        to_delim, delim_len = self._find_delimiter(delimiter, _exc)
+        return self.popline_match(delimiter, keepends, _exc)[0]
+
+    def popline_match(self, delimiter=None, keepends=False, _exc=ValueError):
+        to_delim, delimiter = self._find_delimiter(delimiter, _exc)
         if keepends:
-            return self.pop(to_delim + delim_len)
+            return self.pop(to_delim + len(delimiter)), delimiter
         else:
             ret = self.pop(to_delim)
-            self.pop(delim_len)
-            return ret
+            self._skip(len(delimiter))
+            return ret, delimiter
+
+    def popline_into(self, buffer, delimiter=None):
+        view = _writable_bytes(buffer)
+        to_delim, delimiter = self._find_delimiter(delimiter, ValueError)
+        if to_delim > len(view):
+            raise ValueError('line is longer than the buffer given')
+        self._pop_into(view, to_delim, len(delimiter))
+        return to_delim
+
+    def try_popline(self, delimiter=None):
+        try:
+            return self.popline(delimiter, _exc=BufferUnderflow)
+        except BufferUnderflow:
+            return None
 
-    def poplines(self, delimiter=None):
+    def poplines(self, delimiter=None, max_lines=None, max_bytes=None,
+                 keepends=False):
+        if max_lines is not None and max_lines < 0:
+            raise ValueError()
+        if max_bytes is not None and max_bytes < 0:
+            raise ValueError()
         ret = []
-        while True:
+        popped = 0
+        while max_lines is None or len(ret) < max_lines:
+            if max_bytes is not None and ret and popped >= max_bytes:
+                break
+            before = self._tot_length
             try:
-                ret.append(self.popline(delimiter, _exc=BufferUnderflow))
+                ret.append(self.popline(
+                    delimiter, keepends=keepends, _exc=BufferUnderflow))
             except BufferUnderflow:
                 break
+            popped += before - self._tot_length
+        return ret
+
+    def memory_usage(self):
+        return {
+            'slots': len(self._buffer),
+            'chunks': len(self._buffer),
+            'buffered': self._tot_length,
+            'held': sum(len(x) for x in self._buffer),
+            'overhead': sys.getsizeof(self) + sys.getsizeof(self._buffer),
+        }
+
+    def _reset_stats(self):
+        self._stats = dict.fromkeys([
+            'bytes_pushed', 'bytes_popped', 'chunks_high_water', 'ring_grows',
+            'copied_bytes', 'zero_copy_pops', 'scanned_bytes'], 0)
+        self._stats['buffered_histogram'] = []
+
+    def stats(self, reset=False):
+        if self._stats is None:
+            return None
+        ret = self._stats
+        if reset:
+            self._reset_stats()
+        else:
+            ret = dict(ret, buffered_histogram=list(ret['buffered_histogram']))
         return ret
 
+    def cursor(self):
+        return PythonBufferCursor(self)
+
     def clear(self):
+        self._generation += 1
         self._buffer.clear()
         self._offset = 0
         self._tot_length = 0
@@ -164,3 +609,235 @@ class PythonBufferQueue(object):
         return self.popline(keepends=True, _exc=StopIteration)
 
     next = __next__
+
+
+class PythonDispatcher(object):
+    mode = MODE_RAW
+    current_state = None
+
+    def __init__(self, delimiter=b''):
+        self._buffer = PythonBufferQueue(delimiter)
+        self._closed = False
+        self._reads = collections.deque()
+
+    @property
+    def buffer(self):
+        return self._buffer
+
+    @property
+    def closed(self):
+        return self._closed
+
+    @property
+    def pending_reads(self):
+        return len(self._reads)
+
+    def feed(self, data):
+        if self._closed:
+            return
+        buffer = self._buffer
+        buffer.push(data)
+        while buffer and not self._closed:
+            if self._reads:
+                mode, extra = self._reads[0][:2]
+            else:
+                mode, extra = self.mode, None
+            if mode == MODE_RAW:
+                payload = buffer.pop()
+            elif mode == MODE_DELIMITED:
+                payload = buffer.try_popline(extra or None)
+                if payload is None:
+                    break
+            else:
+                if not self._reads:
+                    if self.current_state is None:
+                        self.current_state = self.getInitialState()
+                        if self.current_state is None:
+                            raise TypeError('getInitialState returned None')
+                        continue
+                    extra = self.current_state[1]
+                payload = buffer.try_pop(extra)
+                if payload is None:
+                    break
+            self._deliver(mode, payload)
+
+    def _deliver(self, mode, payload):
+        if self._reads:
+            self._reads.popleft()[2](payload)
+        elif mode == MODE_RAW:
+            self.rawDataReceived(payload)
+        elif mode == MODE_DELIMITED:
+            self.lineReceived(payload)
+        else:
+            result = self.current_state[0](payload)
+            if result:
+                self.current_state = result
+
+    def add_read(self, callback, mode=MODE_RAW, extra=None, errback=None):
+        if mode not in (MODE_RAW, MODE_DELIMITED, MODE_STATEFUL):
+            raise ValueError('unknown buffering mode')
+        if mode == MODE_STATEFUL and extra < 0:
+            raise ValueError('tried to read a negative number of bytes')
+        self._reads.append((mode, extra, callback, errback))
+
+    def fail_reads(self, reason):
+        reads, self._reads = self._reads, collections.deque()
+        for _, _, _, errback in reads:
+            if errback is not None:
+                errback(reason)
+
+    def close(self):
+        self._closed = True
+        self._buffer.clear()
+
+
+class PythonPoller(object):
+    def __init__(self):
+        self._epoll = select.epoll()
+        self._entries = {}
+
+    @property
+    def closed(self):
+        return self._epoll.closed
+
+    def __len__(self):
+        return len(self._entries)
+
+    def _check(self):
+        if self._epoll.closed:
+            raise ValueError('operation on a closed Poller')
+
+    def register(self, fd, buffer, max_bytes=4096):
+        self._check()
+        if not isinstance(fd, int):
+            fd = fd.fileno()
+        if max_bytes <= 0:
+            raise ValueError('max_bytes must be positive')
+        if fd not in self._entries:
+            self._epoll.register(fd, select.EPOLLIN)
+        self._entries[fd] = buffer, max_bytes
+
+    def unregister(self, fd):
+        self._check()
+        if not isinstance(fd, int):
+            fd = fd.fileno()
+        if fd not in self._entries:
+            raise KeyError(fd)
+        self._remove(fd)
+
+    def _remove(self, fd):
+        del self._entries[fd]
+        try:
+            self._epoll.unregister(fd)
+        except (IOError, OSError):
+            pass
+
+    def poll(self, timeout=None, max_events=1024):
+        self._check()
+        if max_events <= 0:
+            raise ValueError('max_events must be positive')
+        if timeout is None:
+            timeout = -1
+        elif timeout < 0:
+            raise ValueError('timeout must be non-negative')
+        ret = []
+        for fd, _ in self._epoll.poll(timeout, max_events):
+            entry = self._entries.get(fd)
+            if entry is None:
+                continue
+            buffer, max_bytes = entry
+            try:
+                n_read = buffer.recv_from(fd, max_bytes)
+            except (IOError, OSError):
+                n_read = 0
+            if n_read is None:
+                continue
+            elif not n_read:
+                if self._entries.get(fd) is entry:
+                    self._remove(fd)
+                ret.append((buffer, None))
+            elif buffer.delimiter or buffer.delimiters:
+                lines = buffer.poplines()
+                if lines:
+                    ret.append((buffer, lines))
+            else:
+                ret.append((buffer, []))
+        return ret
+
+    def fileno(self):
+        self._check()
+        return self._epoll.fileno()
+
+    def close(self):
+        self._entries.clear()
+        self._epoll.close()
+
+
+class PythonBufferCursor(object):
+    def __init__(self, queue):
+        self._queue = queue
+        self._reset()
+
+    def _reset(self):
+        self._generation = self._queue._generation
+        self._pos = 0
+
+    def _check(self):
+        if self._generation != self._queue._generation:
+            raise RuntimeError(
+                'data was taken off the buffer after the cursor was made')
+
+    def _data(self):
+        return b''.join([v.tobytes() for v in self._queue.peek_iov()])
+
+    @property
+    def position(self):
+        return self._pos
+
+    def __repr__(self):
+        return '<BufferCursor at %s of %s bytes>' % (
+            self._pos, len(self._queue))
+
+    def __len__(self):
+        self._check()
+        return len(self._queue) - self._pos
+
+    def peek(self, length):
+        self._check()
+        if length < 0:
+            raise ValueError()
+        elif length > len(self):
+            raise BufferUnderflow()
+        return self._data()[self._pos:self._pos + length]
+
+    def peek_byte(self, index=0):
+        self._check()
+        if not 0 <= index < len(self):
+            raise IndexError('peek_byte index out of range')
+        return bytearray(self.peek(index + 1))[-1]
+
+    def find(self, delimiter, start=0):
+        self._check()
+        if not isinstance(delimiter, bytes) or not delimiter:
+            raise TypeError('delimiter must be non-empty bytes')
+        if start < 0:
+            raise ValueError()
+        if start > len(self):
+            return -1
+        pos = self._data().find(delimiter, self._pos + start)
+        return pos - self._pos if pos != -1 else -1
+
+    def skip(self, length):
+        self._check()
+        if length < 0:
+            raise ValueError()
+        elif length > len(self):
+            raise BufferUnderflow()
+        self._pos += length
+
+    def commit(self):
+        self._check()
+        length = self._pos
+        self._queue._skip(length)
+        self._reset()
+        return length
@@ -0,0 +1,142 @@
+"""asyncio support for qbuf.
+
+BufferedProtocol has the event loop read incoming data straight into memory
+owned by a BufferQueue, and provides coroutines to read it back out, like
+twisted_support.MultiBufferer's Deferred-returning methods.
+"""
+
+import asyncio
+import struct
+
+from qbuf import BufferQueue
+
+
+class BufferedProtocol(asyncio.BufferedProtocol):
+    """An asyncio protocol that buffers what it receives in a BufferQueue.
+
+    get_buffer hands the event loop free memory belonging to the queue, and
+    buffer_updated adds what was read into it to the queue, so no bytes
+    object is made for incoming data until it is read back out with read,
+    readexactly, readline, readuntil or unpack. Only one coroutine may be
+    waiting on these at a time. Once the connection is closed, one that
+    can't be satisfied raises asyncio.IncompleteReadError with whatever was
+    left in the buffer, or the exception the connection was lost with.
+
+    The buffer's delimiter starts out as initial_delimiter. If more than
+    limit bytes are buffered, reading from the transport is paused until
+    they are read out, or until a read needs more than that.
+    """
+    initial_delimiter = b'\r\n'
+    limit = 2 ** 20
+
+    def __init__(self):
+        self.buffer = BufferQueue(self.initial_delimiter)
+        self.transport = None
+        self._waiter = None
+        self._paused = False
+        self._eof = False
+        self._exc = None
+
+    def connection_made(self, transport):
+        self.transport = transport
+
+    def get_buffer(self, sizehint):
+        return self.buffer.reserve(sizehint)
+
+    def buffer_updated(self, nbytes):
+        self.buffer.commit(nbytes)
+        if not self._paused and len(self.buffer) > self.limit:
+            self._paused = True
+            self.transport.pause_reading()
+        self._wake()
+
+    def eof_received(self):
+        self._eof = True
+        self._wake()
+
+    def connection_lost(self, exc):
+        self._eof = True
+        self._exc = exc
+        self._wake()
+
+    def _wake(self):
+        if self._waiter is not None and not self._waiter.done():
+            self._waiter.set_result(None)
+
+    async def _wait(self, expected):
+        if self._exc is not None:
+            raise self._exc
+        if self._eof:
+            raise asyncio.IncompleteReadError(self.buffer.pop(), expected)
+        if self._waiter is not None:
+            raise RuntimeError('another coroutine is already waiting for data')
+        if self._paused:
+            self._paused = False
+            self.transport.resume_reading()
+        self._waiter = asyncio.get_running_loop().create_future()
+        try:
+            await self._waiter
+        finally:
+            self._waiter = None
+
+    def _popped(self, data):
+        if self._paused and len(self.buffer) <= self.limit:
+            self._paused = False
+            self.transport.resume_reading()
+        return data
+
+    async def read(self, size=None):
+        """Wait for some data to be received.
+
+        If 'size' is provided, wait for that many bytes to be received.
+        Otherwise, wait for any data at all, and return everything buffered.
+        """
+        if size is not None:
+            return await self.readexactly(size)
+        while not self.buffer:
+            await self._wait(None)
+        return self._popped(self.buffer.pop())
+
+    async def readexactly(self, n):
+        """Wait for n bytes to be received, and return them."""
+        while len(self.buffer) < n:
+            await self._wait(n)
+        return self._popped(self.buffer.pop(n))
+
+    async def readline(self, delimiter=None):
+        """Wait for a line to be received, and return it without the
+        delimiter. If 'delimiter' isn't provided, the buffer's delimiter is
+        used.
+        """
+        while True:
+            line = self.buffer.try_popline(delimiter)
+            if line is not None:
+                return self._popped(line)
+            await self._wait(None)
+
+    async def readuntil(self, separator=b'\n'):
+        """Wait for the separator to be received, and return everything up to
+        and including it, like asyncio.StreamReader.readuntil.
+        """
+        while True:
+            lines = self.buffer.poplines(separator, max_lines=1, keepends=True)
+            if lines:
+                return self._popped(lines[0])
+            await self._wait(None)
+
+    async def unpack(self, fmt):
+        """Wait for enough data to be received to unpack the struct format
+        'fmt', and return the unpacked values.
+        """
+        size = struct.calcsize(fmt)
+        while len(self.buffer) < size:
+            await self._wait(size)
+        return self._popped(self.buffer.pop_struct(fmt))
+
+    def write(self, data):
+        """Send some data over the wire.
+
+        This merely forwards the data to the transport, to parallel the read
+        methods.
+        """
+        self.transport.write(data)
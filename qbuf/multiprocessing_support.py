@@ -0,0 +1,75 @@
+"""multiprocessing support for qbuf.
+
+SharedRingHandle puts a SharedRing in a block of shared memory, so that one
+process can push data through it to another without pickling anything.
+The handle is passed to the other process, like any argument to a
+multiprocessing.Process, and each side calls open() on it to get its end.
+"""
+
+import os
+from multiprocessing import reduction, shared_memory
+
+from qbuf import SharedRing
+
+
+class SharedRingHandle(object):
+    """A SharedRing of 'capacity' bytes, which must be a power of two, in a
+    new block of shared memory.
+
+    Where os.eventfd exists, the ring gets eventfds for wakeups, so a side
+    waiting on the other sleeps until it's woken instead of polling. The
+    delimiter is the one the rings returned by open() start out with.
+
+    Each process should close() the handle once it has released the rings
+    it opened from it; the one which made the handle frees the memory then,
+    so it should be the last. A process started by fork inherits every ring
+    open at the time, so open rings in the parent after starting children.
+    """
+
+    def __init__(self, capacity, delimiter=b''):
+        if capacity < 1 or capacity & (capacity - 1):
+            raise ValueError('capacity must be a power of two')
+        self.capacity = capacity
+        self.delimiter = delimiter
+        self._shm = shared_memory.SharedMemory(
+            create=True, size=SharedRing.header_size + capacity)
+        self._owner = os.getpid()
+        if hasattr(os, 'eventfd'):
+            self._fds = os.eventfd(0), os.eventfd(0)
+        else:
+            self._fds = -1, -1
+        SharedRing(self._shm.buf, create=True).release()
+
+    def open(self):
+        """Return a SharedRing over the shared memory."""
+        data_fd, space_fd = self._fds
+        return SharedRing(self._shm.buf, self.delimiter,
+                          data_fd=data_fd, space_fd=space_fd)
+
+    def close(self):
+        """Close the wakeup fds and the shared memory, freeing the memory if
+        this is the process which made the handle."""
+        for fd in self._fds:
+            if fd != -1:
+                os.close(fd)
+        self._fds = -1, -1
+        self._shm.close()
+        if self._owner == os.getpid():
+            self._shm.unlink()
+
+    def __getstate__(self):
+        return {
+            'capacity': self.capacity,
+            'delimiter': self.delimiter,
+            'name': self._shm.name,
+            'fds': [None if fd == -1 else reduction.DupFd(fd)
+                    for fd in self._fds],
+        }
+
+    def __setstate__(self, state):
+        self.capacity = state['capacity']
+        self.delimiter = state['delimiter']
+        self._shm = shared_memory.SharedMemory(state['name'])
+        self._owner = None
+        self._fds = tuple(-1 if fd is None else fd.detach()
+                          for fd in state['fds'])
@@ -2,7 +2,7 @@
 """
 
 #from __future__ import absolute_import
-from qbuf import BufferQueue, BufferUnderflow
+from qbuf import BufferQueue
 import socket, errno
 
 class SocketClosedError(Exception):
@@ -11,8 +11,12 @@ class SocketClosedError(Exception):
 class _SocketWrapper(object):
     def __init__(self, sock, buffer_size=4096):
         self.buffer = BufferQueue()
+        self.out_buffer = BufferQueue(coalesce_below=512)
         self.sock = sock
         self.buffer_size = buffer_size
+        # Plain sockets can be read straight into the buffer; anything else
+        # (e.g. an SSL socket) has to go through its recv method.
+        self._direct = type(sock) is socket.socket
 
     def fileno(self):
         """Returns the wrapped socket's fileno.
@@ -29,28 +33,73 @@ class _SocketWrapper(object):
         """
         self.sock.sendall(data)
 
+    def write(self, data):
+        """Queue data to be sent on the wrapped socket by flush.
+
+        Small writes are batched together in the queue, so that many of them
+        can go out in a single system call.
+        """
+        self.out_buffer.push(data)
+
+    def flush(self):
+        """Send as much queued data as the wrapped socket will take.
+
+        Returns True if everything queued has been sent, and False otherwise.
+        """
+        if self._direct:
+            self.out_buffer.send_to(self.sock)
+        else:
+            while self.out_buffer:
+                view = self.out_buffer.peek_iov(
+                    min(len(self.out_buffer), self.buffer_size))[0]
+                try:
+                    n_sent = self.sock.send(view)
+                except socket.error as e:
+                    if e.args[0] == errno.EAGAIN:
+                        break
+                    else:
+                        raise
+                self.out_buffer.pop_iov(n_sent)
+        return not self.out_buffer
+
     def close(self):
         """Closes the wrapped socket.
         """
         self.closed = True
         self.sock.close()
 
+    def register(self, poller):
+        """Have a qbuf.Poller read from the wrapped socket into the buffer,
+        instead of calling pump_buffer.
+
+        Only plain, non-blocking sockets can be read by a Poller.
+        """
+        if not self._direct:
+            raise TypeError('a Poller can only read from plain sockets')
+        poller.register(self.sock, self.buffer, self.buffer_size)
+
     def pump_buffer(self):
         """Try to read from the wrapped socket into the buffer.
 
         Returns True if the socket is still open, and False otherwise.
         """
-        try:
-            data = self.sock.recv(self.buffer_size)
-        except socket.error, e:
-            if e[0] == errno.EGAIN:
+        if self._direct:
+            n_read = self.buffer.recv_from(self.sock, self.buffer_size)
+            if n_read is None:
                 return True
-            else:
-                raise
-        if not data:
+        else:
+            try:
+                data = self.sock.recv(self.buffer_size)
+            except socket.error as e:
+                if e.args[0] == errno.EAGAIN:
+                    return True
+                else:
+                    raise
+            self.buffer.push(data)
+            n_read = len(data)
+        if not n_read:
             self.closed = True
             return False
-        self.buffer.push(data)
         return True
 
 class LineReceiver(_SocketWrapper):
@@ -62,7 +111,7 @@ class LineReceiver(_SocketWrapper):
     """
 
     def __init__(self, sock, buffer_size=4096,
-            delimiter="\r\n", auto_pump=True):
+            delimiter=b"\r\n", auto_pump=True):
         """Wrap a socket for easier line buffering of incoming data.
 
         The buffer_size parameter indicates how much should be read from the
@@ -83,17 +132,17 @@ class LineReceiver(_SocketWrapper):
     def readline(self):
         """Read a line out of the buffer.
 
-        If the socket is closed, this function returns an empty string. If no
+        If the socket is closed, this function returns empty bytes. If no
         line is available, socket.error is raised with an errno of EAGAIN.
         Otherwise, return the next line available in the buffer.
         """
         if self.auto_pump:
             if not self.pump_buffer():
-                return ''
-        try:
-            return self.buffer.popline()
-        except ValueError:
+                return b''
+        line = self.buffer.try_popline()
+        if line is None:
             raise socket.error(errno.EAGAIN, 'no full line available')
+        return line
 
 class StatefulProtocol(_SocketWrapper):
     """A socket wrapper similar to Twisted's StatefulProtocol.
@@ -115,14 +164,12 @@ class StatefulProtocol(_SocketWrapper):
         if not self.pump_buffer():
             raise SocketClosedError
         while self.buffer:
-            try:
-                data = self.buffer.pop(self.waiting_on)
-            except BufferUnderflow:
+            data = self.buffer.try_pop(self.waiting_on)
+            if data is None:
                 break
-            else:
-                result = self.next_func(data)
-                if result:
-                    self.next_func, self.waiting_on = result
+            result = self.next_func(data)
+            if result:
+                self.next_func, self.waiting_on = result
 
     def get_initial_state(self):
         """Get the initial state for the StatefulProtocol.
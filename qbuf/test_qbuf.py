@@ -2,12 +2,17 @@
 """
 
 import io
+import os
 import random
+import select
+import signal
+import socket
 import struct
+import threading
+import time
 
 from six.moves import xrange
 import pytest
-import six
 
 import qbuf
 
@@ -68,11 +73,53 @@ def buf_factory(request):
     if request.param == 'python':
         return qbuf.PythonBufferQueue
     elif request.param == 'c':
-        if six.PY3:
-            pytest.skip('no C impl for py3')
         return qbuf.BufferQueue
 
 
+@pytest.fixture(params=('python', 'c'))
+def dispatcher_factory(request):
+    base = {'python': qbuf.PythonDispatcher, 'c': qbuf.Dispatcher}[
+        request.param]
+
+    class Recorder(base):
+        mode = qbuf.MODE_STATEFUL
+
+        def __init__(self, delimiter=b'\n'):
+            base.__init__(self, delimiter)
+            self.got = []
+
+        def rawDataReceived(self, data):
+            self.got.append(('raw', data))
+
+        def lineReceived(self, line):
+            self.got.append(('line', line))
+
+        def getInitialState(self):
+            return self.header, 2
+
+        def header(self, data):
+            self.got.append(('header', data))
+            return self.body, int(data)
+
+        def body(self, data):
+            self.got.append(('body', data))
+            if data == b'line':
+                self.mode = qbuf.MODE_DELIMITED
+            return self.header, 2
+
+    return Recorder
+
+
+@pytest.fixture(params=('python', 'c'))
+def poller_factory(request):
+    if not hasattr(select, 'epoll'):
+        pytest.skip('Poller needs epoll')
+    if request.param == 'python':
+        return qbuf.PythonPoller, qbuf.PythonBufferQueue
+    elif request.param == 'c':
+        return qbuf.Poller, qbuf.BufferQueue
+
+
 @pytest.fixture
 def pair_factory(request, buf_factory):
     rng = random.Random(str(request))
@@ -153,7 +200,7 @@ def test_passed_delimiter(pair_factory):
 def test_repr(buf_factory):
     buf = buf_factory()
     assert '<BufferQueue of 0 bytes>' == repr(buf)
-    buf.push('foobar')
+    buf.push(b'foobar')
     assert '<BufferQueue of 6 bytes>' == repr(buf)
 
 
@@ -166,9 +213,9 @@ def test_iter(buf_factory):
 
 def test_exceptions(buf_factory):
     buf = buf_factory()
-    pytest.raises(ValueError, buf.next)
+    pytest.raises(ValueError, next, buf)
     pytest.raises(ValueError, buf.popline)
-    pytest.raises(ValueError, buf.popline, '')
+    pytest.raises(ValueError, buf.popline, b'')
     pytest.raises(ValueError, buf.poplines)
     pytest.raises(ValueError, buf.pop, -1)
     pytest.raises(ValueError, buf.pop_atmost, -1)
@@ -176,7 +223,7 @@ def test_exceptions(buf_factory):
     pytest.raises(TypeError, buf.push, None)
     pytest.raises(TypeError, buf.push_many, None)
     pytest.raises(TypeError, buf.push_many, [None])
-    buf.delimiter = '***'
+    buf.delimiter = b'***'
     pytest.raises(ValueError, buf.popline)
 
 
@@ -227,6 +274,65 @@ def test_pop_view(buf_factory):
     assert b'foobarbaz' == memoryview(b).tobytes()
 
 
+def test_pop_iov(buf_factory):
+    buf = buf_factory()
+    buf.push_many([b'foo', b'bar', b'bazqux'])
+    buf.pop(1)
+    assert () == buf.pop_iov(0)
+    iov = buf.peek_iov(7)
+    assert [b'oo', b'bar', b'ba'] == [memoryview(b).tobytes() for b in iov]
+    assert 11 == len(buf)
+    iov = buf.pop_iov(4)
+    assert [b'oo', b'ba'] == [memoryview(b).tobytes() for b in iov]
+    assert b'r' == buf.pop(1)
+    pytest.raises(qbuf.BufferUnderflow, buf.pop_iov, 7)
+    pytest.raises(ValueError, buf.peek_iov, -1)
+    iov = buf.pop_iov()
+    assert [b'bazqux'] == [memoryview(b).tobytes() for b in iov]
+    assert 0 == len(buf)
+
+
+def test_coalesce(buf_factory):
+    buf = buf_factory(b'\r\n', coalesce_below=16)
+    for x in xrange(1000):
+        buf.push(b'%02d' % (x % 100,))
+        if x % 10 == 9:
+            buf.push(b'\r\n')
+    buf.push(b'x' * 16)
+    buf.push(bytearray(b'yz'))
+    assert 2218 == len(buf)
+    assert b''.join(b'%02d' % (x,) for x in xrange(10)) == buf.popline()
+    assert 99 == len(buf.poplines())
+    iov = buf.peek_iov()
+    assert [b'x' * 16, b'yz'] == [memoryview(b).tobytes() for b in iov]
+    assert b'x' * 16 + b'yz' == buf.pop()
+    if buf_factory is qbuf.BufferQueue:
+        buf.push_many([b'a', b'b', b'c'])
+        assert 1 == len(buf.peek_iov())
+
+
+def test_memory_usage(buf_factory):
+    buf = buf_factory(initial_capacity=4)
+    usage = buf.memory_usage()
+    assert 0 == usage['chunks'] == usage['buffered'] == usage['held']
+    for x in xrange(1000):
+        buf.push(b'foo')
+    usage = buf.memory_usage()
+    assert 1000 == usage['chunks']
+    assert 3000 == usage['buffered'] == usage['held']
+    assert usage['slots'] >= 1000
+    buf.pop(2990)
+    usage = buf.memory_usage()
+    assert 4 == usage['chunks']
+    assert 10 == usage['buffered']
+    assert 12 == usage['held']
+    assert usage['slots'] < 100
+    buf.clear()
+    if buf_factory is qbuf.BufferQueue:
+        assert 4 == buf.memory_usage()['slots']
+    pytest.raises(ValueError, qbuf.BufferQueue, initial_capacity=0)
+
+
 def test_pop_struct(buf_factory):
     buf = buf_factory()
     buf.push(b'\x01\x02\x03\x04\x05\x06')
@@ -237,3 +343,826 @@ def test_pop_struct(buf_factory):
     assert a == 0x405
     pytest.raises(qbuf.BufferUnderflow, buf.pop_struct, '!H')
     pytest.raises(struct.error, buf.pop_struct, '_bad_struct_format')
+
+
+def test_pop_struct_formats(buf_factory):
+    formats = ['<bBhHiIlLqQ', '>bBhHiI', '!qQ', '=hH', '<b', '>Q',
+               '<3sH', 'BH', '<bBhHiIlLq', '@i']
+    for format in formats:
+        size = struct.calcsize(format)
+        data = bytes(bytearray((x * 37 + 200) & 0xff for x in xrange(size)))
+        expected = struct.unpack(format, data)
+        for split in xrange(size + 1):
+            buf = buf_factory()
+            buf.push(data[:split])
+            buf.push(data[split:] + b'tail')
+            assert buf.pop_struct(format) == expected
+            assert buf.pop() == b'tail'
+    buf = buf_factory()
+    buf.push(b'\x80\x00\x00\x00\x00\x00\x00\x00' * 2)
+    assert buf.pop_struct('>qQ') == (-2 ** 63, 2 ** 63)
+    buf.push(b'\xff\xfe')
+    assert buf.pop_struct(b'<h') == (-257,)
+    pytest.raises(qbuf.BufferUnderflow, buf.pop_struct, '<h')
+
+
+def test_poplines_budget(buf_factory):
+    lines = [b'a' * x for x in xrange(100)]
+    data = b''.join(line + b'\r\n' for line in lines) + b'tail\r'
+    for keepends in (False, True):
+        expected = [line + b'\r\n' if keepends else line for line in lines]
+        buf = buf_factory(delimiter=b'\r\n')
+        for x in xrange(0, len(data), 7):
+            buf.push(data[x:x + 7])
+        popped = buf.poplines(max_lines=10, keepends=keepends)
+        assert popped == expected[:10]
+        assert buf.poplines(max_lines=0) == []
+        popped = buf.poplines(max_bytes=1, keepends=keepends)
+        assert popped == expected[10:11]
+        popped = buf.poplines(max_bytes=60, keepends=keepends)
+        assert popped == expected[11:16]
+        popped = buf.poplines(keepends=keepends)
+        assert popped == expected[16:]
+        buf.push(b'\n')
+        assert buf.poplines(keepends=keepends) == [
+            b'tail\r\n' if keepends else b'tail']
+        assert not buf
+
+
+def test_delimiter_set(buf_factory):
+    buf = buf_factory(delimiters=[b'\n', b'\r\n', b':'])
+    assert buf.delimiters == (b'\r\n', b'\n', b':')
+    assert buf.delimiter == b''
+    data = b'one\r\ntwo\nthree:four\r'
+    for x in xrange(len(data)):
+        buf.push(data[x:x + 1])
+    assert buf.popline_match() == (b'one', b'\r\n')
+    assert buf.popline() == b'two'
+    assert buf.poplines(keepends=True) == [b'three:']
+    # 'four\r' could still end with '\r\n'.
+    pytest.raises(ValueError, buf.popline, b'\n')
+    assert buf.try_popline() is None
+    buf.push(b'\n5\n')
+    assert list(buf) == [b'four\r\n', b'5\n']
+
+    buf.push(b'a,b\n')
+    assert buf.popline(b',') == b'a'
+    buf.delimiter = b'\n'
+    assert buf.delimiters is None
+    assert buf.popline() == b'b'
+    buf.delimiters = (b'ab', b'b')
+    buf.push(b'xxa')
+    assert buf.try_popline() is None
+    buf.push(b'byb')
+    assert buf.poplines() == [b'xx', b'y']
+    pytest.raises(TypeError, buf_factory, b'x', delimiters=[b'y'])
+    pytest.raises(TypeError, buf_factory, delimiters=b'y')
+    pytest.raises(TypeError, buf_factory, delimiters=[b''])
+    delimiters = (b'\n', b'\r\n')
+    buf_factory(delimiters=delimiters)
+    assert delimiters == (b'\n', b'\r\n')
+
+    # A delimiter split across chunks, where the first partial match fails.
+    buf = buf_factory(delimiter=b'aab')
+    for chunk in [b'xaa', b'ab', b'a', b'a', b'cab', b'aab']:
+        buf.push(chunk)
+    assert buf.poplines() == [b'xa', b'aacab']
+
+
+def test_push_front(buf_factory):
+    buf = buf_factory(delimiter=b'\n')
+    buf.push_front(b'')
+    buf.push(b'abc\ndef')
+    assert buf.pop(2) == b'ab'
+    buf.push_front(b'xy')
+    buf.push_front(bytearray(b'1'))
+    buf.push_front(b'')
+    assert len(buf) == 8
+    assert buf.popline() == b'1xyc'
+    assert buf.pop(1) == b'd'
+    for x in xrange(20):
+        buf.push_front(str(x % 10).encode() + b',')
+    assert buf.pop() == b'9,8,7,6,5,4,3,2,1,0,' * 2 + b'ef'
+    buf.push(b'12345')
+    buf.pop(5)
+    buf.push_front(b'z')
+    assert buf.pop() == b'z'
+
+
+def test_cursor(buf_factory):
+    buf = buf_factory()
+    for chunk in [b'GET / HT', b'TP/1.1\r', b'\nHost: x\r\n', b'\r\nbody']:
+        buf.push(chunk)
+    cur = buf.cursor()
+    assert len(cur) == len(buf) == 31
+    assert cur.peek(3) == b'GET'
+    assert cur.peek_byte(4) == ord(b'/')
+    assert cur.find(b'\r\n') == 14
+    assert cur.find(b'\r\n', 15) == 23
+    assert cur.find(b'\r\n\r\n') == 23
+    assert cur.find(b'nope') == -1
+    assert cur.find(b'y', 32) == -1
+    cur.skip(16)
+    assert cur.position == 16
+    assert cur.peek(5) == b'Host:'
+    assert cur.find(b'\r\n') == 7
+    pytest.raises(qbuf.BufferUnderflow, cur.peek, 16)
+    pytest.raises(qbuf.BufferUnderflow, cur.skip, 16)
+    pytest.raises(IndexError, cur.peek_byte, 15)
+    assert cur.peek(0) == b''
+    assert len(buf) == 31
+    buf.push(b'!')
+    assert cur.peek(16) == b'Host: x\r\n\r\nbody!'
+    cur.skip(15)
+    assert cur.peek_byte() == ord(b'!')
+    assert cur.commit() == 31
+    assert cur.position == 0
+    assert cur.commit() == 0
+    assert buf.pop() == b'!'
+
+    buf.push(b'abc')
+    cur = buf.cursor()
+    cur.skip(1)
+    buf.pop(1)
+    pytest.raises(RuntimeError, cur.peek, 1)
+    pytest.raises(RuntimeError, cur.commit)
+    assert buf.cursor().peek(2) == b'bc'
+
+
+def test_try_pop(buf_factory):
+    buf = buf_factory(delimiter=b'\r\n')
+    buf.push(b'\x01\x02ab\r\ncd')
+    assert buf.try_pop_struct('!HQ') is None
+    assert buf.try_pop_struct('!H') == (0x102,)
+    assert buf.try_pop(9) is None
+    assert buf.try_pop(0) == b''
+    assert buf.try_pop(1) == b'a'
+    assert buf.try_popline(b'c') == b'b\r\n'
+    assert buf.try_popline() is None
+    buf.push(b'\r\n')
+    assert buf.try_popline() == b'd'
+    pytest.raises(ValueError, buf.try_pop, -1)
+    buf.delimiter = b''
+    pytest.raises(ValueError, buf.try_popline)
+
+
+def test_pop_frames(buf_factory):
+    def pop_frames(*a, **kw):
+        return [memoryview(f).tobytes() for f in buf.pop_frames(*a, **kw)]
+
+    frames = [b'', b'a', b'bc' * 300, b'def']
+    data = b''.join(struct.pack('!H', len(f)) + f for f in frames)
+    for format, as_bytes in [('!H', False), ('>H', True), ('!1H', False)]:
+        buf = buf_factory()
+        for x in xrange(len(data)):
+            buf.push(data[x:x + 1])
+            buf.push(data[:0])
+        assert pop_frames(format, as_bytes=as_bytes) == frames
+        assert not buf
+    buf = buf_factory()
+    buf.push(data[:-1])
+    assert pop_frames('!H', max_frames=2) == frames[:2]
+    assert pop_frames('!H') == frames[2:3]
+    assert pop_frames('!H') == []
+    assert len(buf) == 4
+    buf.push(data[-1:])
+    assert pop_frames('!H') == frames[3:]
+
+    buf = buf_factory()
+    buf.push(data)
+    assert pop_frames('!H', max_length=3) == frames[:2]
+    pytest.raises(qbuf.FrameTooLong, buf.pop_frames, '!H', max_length=3)
+    pytest.raises(ValueError, buf.pop_frames, '!HH')
+    assert len(buf) == len(data) - 5
+    buf = buf_factory()
+    buf.push(b'\xff\xffabc')
+    pytest.raises(ValueError, buf.pop_frames, '!h')
+
+
+def test_incremental_delimiter_search(pair_factory):
+    data = b'x' * 4000 + b'\r\n' + b'y' * 10 + b'\r\r\n' + b'z' * 5
+    pair = pair_factory(delimiter=b'\r\n', data=data)
+    for x in xrange(3999):
+        pair.push(1)
+        pytest.raises(ValueError, pair.test_buf.popline)
+    pair.push(2)
+    pytest.raises(ValueError, pair.test_buf.popline)
+    pair.push(1)
+    pair.popline()
+    pair.push(11)
+    pytest.raises(ValueError, pair.test_buf.popline)
+    pair.pop(3)
+    pytest.raises(ValueError, pair.test_buf.popline)
+    pair.push(2)
+    pair.popline()
+    pair.push(5)
+    pytest.raises(ValueError, pair.test_buf.popline)
+    pair.pop()
+    pair.close()
+
+
+def test_incremental_delimiter_change(buf_factory):
+    buf = buf_factory(b'**')
+    buf.push(b'foo*')
+    pytest.raises(ValueError, buf.popline)
+    pytest.raises(ValueError, buf.popline, b'*!')
+    buf.push(b'!bar*')
+    assert b'foo' == buf.popline(b'*!')
+    pytest.raises(ValueError, buf.popline)
+    buf.delimiter = b'*'
+    assert b'bar' == buf.popline()
+    buf.push(b'baz**')
+    buf.clear()
+    buf.delimiter = b'**'
+    buf.push(b'qu')
+    pytest.raises(ValueError, buf.popline)
+    buf.push(b'ux**')
+    assert b'quux' == buf.popline()
+
+
+def test_long_delimiter_search(pair_factory):
+    data = (
+        b'a' * 300 + b'<-->'
+        + b'b' * 298 + b'<-'
+        + b'->' + b'c' * 600 + b'<--'
+        + b'>' + b'<-->' * 2
+    )
+    pair = pair_factory(delimiter=b'<-->', data=data)
+    for x in [304, 300, 605, 9]:
+        pair.push(x)
+    for x in xrange(5):
+        pair.popline()
+    pair.close()
+
+
+def test_push_buffer_protocol():
+    buf = qbuf.BufferQueue(b'\n')
+    data = bytearray(b'foo\nbar')
+    buf.push(data)
+    buf.push(memoryview(b'xbaz\nquux')[1:])
+    pytest.raises(BufferError, data.extend, b'!')
+    assert b'foo' == buf.popline()
+    b = buf.pop_view(2)
+    assert b'ba' == memoryview(b).tobytes()
+    del b
+    data[6] = ord('z')
+    assert b'zbaz' == buf.popline()
+    data.extend(b'!')
+    assert b'quux' == buf.pop()
+    pytest.raises(TypeError, buf.push, u'foo')
+
+
+def test_recv_from(buf_factory):
+    buf = buf_factory(b'\n')
+    r, w = os.pipe()
+    try:
+        os.write(w, b'foo\nba')
+        assert 6 == buf.recv_from(r, 64)
+        os.write(w, b'r\nbaz')
+        assert 3 == buf.recv_from(r, 3)
+        assert [b'foo', b'bar'] == buf.poplines()
+        assert 2 == buf.recv_from(r)
+        assert b'baz' == memoryview(buf.pop_view()).tobytes()
+        os.close(w)
+        w = None
+        assert 0 == buf.recv_from(r)
+        assert 0 == len(buf)
+    finally:
+        os.close(r)
+        if w is not None:
+            os.close(w)
+
+
+def test_recv_from_socket(buf_factory):
+    buf = buf_factory(b'\r\n')
+    a, b = socket.socketpair()
+    try:
+        b.setblocking(False)
+        assert buf.recv_from(b, 16) is None
+        for x in xrange(100):
+            a.sendall(b'line %d\r\n' % (x,))
+            assert buf.recv_from(b, 16)
+            assert b'line %d' % (x,) == buf.popline()
+    finally:
+        a.close()
+        b.close()
+
+
+def test_push_during_recv_from(buf_factory):
+    buf = buf_factory(coalesce_below=64)
+    a, b = socket.socketpair()
+    reader = threading.Thread(target=buf.recv_from, args=(b,))
+    try:
+        reader.start()
+        time.sleep(0.05)
+        # Coalesced into the tail slab while the read may be in flight.
+        buf.push(b'PUSHED')
+        buf.push_struct('!H', 7)
+        a.sendall(b'READDATA')
+        reader.join()
+        assert b'PUSHED\x00\x07READDATA' == buf.pop()
+    finally:
+        a.close()
+        b.close()
+
+
+def test_push_struct(buf_factory):
+    buf = buf_factory(coalesce_below=64)
+    buf.push_struct('!HI', 7, 0xdeadbeef)
+    buf.push(b'abc')
+    buf.push_struct('<q', -2)
+    buf.push_struct('!3s', b'xyz')
+    assert struct.pack('!HI', 7, 0xdeadbeef) + b'abc' + struct.pack(
+        '<q', -2) + b'xyz' == buf.pop()
+    pytest.raises(struct.error, buf.push_struct, '!B', 256)
+    pytest.raises(struct.error, buf.push_struct, '!H', -1)
+    pytest.raises(struct.error, buf.push_struct, '!HH', 1)
+    assert 0 == len(buf)
+
+
+def test_send_to(buf_factory):
+    buf = buf_factory()
+    a, b = socket.socketpair()
+    try:
+        a.setblocking(False)
+        for x in xrange(50):
+            buf.push(b'chunk %d;' % (x,))
+        expected = b''.join(
+            memoryview(v).tobytes() for v in buf.peek_iov())
+        assert 5 == buf.send_to(a, 5)
+        assert len(expected) - 5 == buf.send_to(a.fileno())
+        assert 0 == len(buf)
+        got = b''
+        while len(got) < len(expected):
+            got += b.recv(4096)
+        assert expected == got
+
+        buf.push(b'x' * (1 << 22))
+        sent = 0
+        while True:
+            n = buf.send_to(a)
+            if not n:
+                break
+            sent += n
+        assert sent + len(buf) == 1 << 22
+        assert 0 < len(buf)
+        pytest.raises(ValueError, buf.send_to, a, 0)
+    finally:
+        a.close()
+        b.close()
+
+
+def test_send_to_while_popped(buf_factory):
+    buf = buf_factory()
+    a, b = socket.socketpair()
+    result = []
+
+    def send():
+        try:
+            buf.send_to(a)
+        except RuntimeError as e:
+            result.append(e.args[1])
+
+    try:
+        buf.push(b'x' * (1 << 22))
+        thread = threading.Thread(target=send)
+        thread.start()
+        # Let the write fill the socket and block before popping.
+        time.sleep(0.1)
+        assert buf.pop(1) == b'x'
+        got = 0
+        while thread.is_alive() or select.select([b], [], [], 0)[0]:
+            if select.select([b], [], [], 0.01)[0]:
+                got += len(b.recv(1 << 16))
+        thread.join()
+        assert result == [got]
+        assert len(buf) == (1 << 22) - 1
+    finally:
+        a.close()
+        b.close()
+
+
+def test_pop_timeout(buf_factory):
+    buf = buf_factory()
+    pytest.raises(qbuf.BufferUnderflow, buf.pop, 4, timeout=0.01)
+    pytest.raises(qbuf.BufferUnderflow, buf.pop, timeout=0.01)
+    assert b'' == buf.pop()
+    pytest.raises(ValueError, buf.pop, 4, timeout=-1)
+    timer = threading.Timer(0.05, buf.push, [b'spam'])
+    timer.start()
+    try:
+        assert b'sp' == buf.pop(2, timeout=10)
+    finally:
+        timer.join()
+    assert b'am' == buf.pop(timeout=None)
+    timer = threading.Timer(0.05, buf.push_many, [[b'eg', b'gs']])
+    timer.start()
+    try:
+        assert b'eggs' == buf.pop(4, timeout=None)
+    finally:
+        timer.join()
+
+
+class Interrupted(Exception):
+    pass
+
+
+def test_pop_wait_interrupted(buf_factory):
+    if not hasattr(signal, 'setitimer'):
+        pytest.skip('signal.setitimer')
+    buf = buf_factory()
+
+    def handler(signum, frame):
+        raise Interrupted()
+
+    old = signal.signal(signal.SIGALRM, handler)
+    try:
+        signal.setitimer(signal.ITIMER_REAL, 0.05)
+        pytest.raises(Interrupted, buf.pop, timeout=None)
+    finally:
+        signal.setitimer(signal.ITIMER_REAL, 0)
+        signal.signal(signal.SIGALRM, old)
+
+
+def test_release_gil(buf_factory):
+    buf = buf_factory(b'\r\n', release_gil_above=8)
+    lines = [b'line %d ' % (x,) * x for x in xrange(200)]
+    done = []
+
+    def produce():
+        for line in lines:
+            buf.push(line[:len(line) // 2])
+            buf.push(line[len(line) // 2:] + b'\r\n')
+        done.append(True)
+
+    producer = threading.Thread(target=produce)
+    producer.start()
+    try:
+        got = []
+        while len(got) < len(lines):
+            got.extend(buf.poplines())
+            if done and not buf:
+                break
+        assert lines == got
+    finally:
+        producer.join()
+    buf.push(b'x' * 10)
+    buf.push(b'y' * 10)
+    assert b'x' * 10 + b'y' * 5 == buf.pop(15)
+    assert b'y' * 5 == buf.pop_atmost(20)
+    buf.push_many([b'a' * 10, b'b' * 10 + b'\r', b'\nc'])
+    assert (b'a' * 10 + b'b' * 10, b'\r\n') == buf.popline_match()
+    assert b'c' == buf.pop()
+
+
+def test_push_file(buf_factory, tmpdir):
+    path = str(tmpdir.join('data'))
+    data = b''.join(b'line %d\n' % (x,) for x in xrange(5000))
+    with open(path, 'wb') as outfile:
+        outfile.write(data)
+    buf = buf_factory(b'\n')
+    with open(path, 'rb') as infile:
+        buf.push_file(infile)
+        buf.push_file(infile.fileno(), offset=5, length=10)
+        pytest.raises(ValueError, buf.push_file, infile, offset=len(data) + 1)
+        pytest.raises(ValueError, buf.push_file, infile, offset=1,
+                      length=len(data))
+    assert len(data) + 10 == len(buf)
+    assert b'line 0' == buf.popline()
+    assert b'line 1\nline 2' == memoryview(buf.pop_view(13)).tobytes()
+    lines = (data[20:] + data[5:15]).split(b'\n')
+    rest = lines.pop()
+    assert lines == buf.poplines()
+    assert rest == buf.pop()
+
+    # A sparse file just over one 64MiB segment, starting part way into a
+    # page, goes in as two chunks.
+    path = str(tmpdir.join('sparse'))
+    with open(path, 'wb') as outfile:
+        outfile.truncate((64 << 20) + 100)
+    with open(path, 'rb') as infile:
+        buf.push_file(infile, offset=3)
+    assert (64 << 20) + 97 == len(buf)
+    assert 2 == len(buf.peek_iov())
+    buf.clear()
+
+
+def test_reserve(buf_factory):
+    buf = buf_factory(b'\n', coalesce_below=16)
+    pytest.raises(ValueError, buf.commit, 0)
+    view = buf.reserve(10)
+    assert len(view) >= 10
+    view[:6] = b'abc\nde'
+    buf.commit(6)
+    pytest.raises(ValueError, buf.commit, 0)
+    view = buf.reserve()
+    view[:2] = b'xx'
+    view = buf.reserve(3)
+    pytest.raises(ValueError, buf.commit, len(view) + 1)
+    view[:3] = b'f\ng'
+    buf.push(b'hi')
+    buf.commit(3)
+    assert [b'abc', b'dehif'] == buf.poplines()
+    assert b'g' == buf.pop()
+
+    # A tail slab without room for the whole hint isn't handed out.
+    buf = buf_factory(coalesce_below=64)
+    buf.push(b'x' * 10)
+    assert len(buf.reserve(8192)) >= 8192
+    buf.commit(0)
+    assert b'x' * 10 == buf.pop()
+
+    # A recv_from in flight has its own memory, so reserving can go ahead.
+    a, b = socket.socketpair()
+    reader = threading.Thread(target=buf.recv_from, args=(b,))
+    try:
+        reader.start()
+        time.sleep(0.05)
+        view = buf.reserve(8)
+        view[:8] = b'RESERVED'
+        buf.commit(8)
+        a.sendall(b'READ')
+        reader.join()
+        assert b'RESERVEDREAD' == buf.pop()
+    finally:
+        a.close()
+        b.close()
+
+
+def test_pop_into(buf_factory):
+    buf = buf_factory(b'\r\n')
+    buf.push_many([b'abc', b'def\r', b'\nghijklmnop'])
+    target = bytearray(8)
+    assert 2 == buf.pop_into(target, 2)
+    assert bytearray(b'ab\0\0\0\0\0\0') == target
+    assert 4 == buf.popline_into(target)
+    assert bytearray(b'cdef\0\0\0\0') == target
+    pytest.raises(ValueError, buf.pop_into, target, 9)
+    pytest.raises(qbuf.BufferUnderflow, buf.pop_into, bytearray(20), 11)
+    pytest.raises(ValueError, buf.popline_into, target)
+    pytest.raises(TypeError, buf.pop_into, b'not writable')
+    assert 8 == buf.pop_into(memoryview(target))
+    assert bytearray(b'ghijklmn') == target
+    assert 2 == buf.pop_into(target)
+    assert b'op' == bytes(target[:2])
+    buf.push(b'x' * 10 + b'\r\n')
+    pytest.raises(ValueError, buf.popline_into, target)
+    assert 12 == len(buf)
+
+
+def test_stats(buf_factory):
+    assert buf_factory().stats() is None
+    buf = buf_factory(b'\n', stats=True, initial_capacity=2)
+    buf.push_many([b'abc', b'de\nf', b'ghij', b'k\n'])
+    assert b'abcde' == buf.popline()
+    assert b'f' == buf.pop(1)
+    assert b'ghij' == buf.pop(4)
+    stats = buf.stats(reset=True)
+    assert 13 == stats['bytes_pushed']
+    assert 11 == stats['bytes_popped']
+    assert 4 == stats['chunks_high_water']
+    assert 1 == stats['zero_copy_pops']
+    assert 6 == stats['copied_bytes']
+    assert 5 <= stats['scanned_bytes']
+    assert [0, 0, 0, 2, 1] == stats['buffered_histogram']
+    if buf_factory is qbuf.BufferQueue:
+        assert 1 == stats['ring_grows']
+    stats = buf.stats()
+    assert 0 == stats['bytes_pushed']
+    assert [] == stats['buffered_histogram']
+
+    buf.clear()
+    buf.stats(reset=True)
+    buf.push(struct.pack('!HH', 1, 2) + b'ab')
+    assert (1,) == buf.pop_struct('!H')
+    assert (2,) == buf.pop_struct('!H')
+    assert b'ab' == buf.pop(2)
+    stats = buf.stats()
+    assert 6 == stats['copied_bytes']
+    assert [0, 0, 1, 2] == stats['buffered_histogram']
+
+
+def test_dispatcher(dispatcher_factory):
+    d = dispatcher_factory()
+    assert qbuf.MODE_STATEFUL == d.mode
+    d.feed(b'03ab')
+    assert [('header', b'03')] == d.got
+    d.feed(b'c0')
+    d.feed(b'4line')
+    d.feed(b'one\ntwo\nthr')
+    assert [('header', b'03'), ('body', b'abc'), ('header', b'04'),
+            ('body', b'line'), ('line', b'one'), ('line', b'two')] == d.got
+    assert b'thr' == d.buffer.pop()
+    del d.got[:]
+    d.mode = qbuf.MODE_RAW
+    d.feed(b'a\nb')
+    assert [('raw', b'a\nb')] == d.got
+    d.close()
+    assert d.closed
+    d.feed(b'ignored')
+    assert not d.buffer
+
+    d = dispatcher_factory()
+    d.getInitialState = lambda: None
+    pytest.raises(TypeError, d.feed, b'xx')
+
+
+def test_dispatcher_reads(dispatcher_factory):
+    d = dispatcher_factory()
+    got, failed = [], []
+    d.add_read(got.append, qbuf.MODE_STATEFUL, 3)
+    d.add_read(got.append, qbuf.MODE_DELIMITED, b'|')
+    d.add_read(got.append)
+    assert 3 == d.pending_reads
+    d.feed(b'abcde|fg')
+    assert [b'abc', b'de', b'fg'] == got
+    assert [] == d.got
+    d.add_read(got.append, qbuf.MODE_DELIMITED, None, failed.append)
+    d.add_read(got.append, qbuf.MODE_RAW, None, failed.append)
+    d.feed(b'part')
+    d.fail_reads('reason')
+    assert ['reason', 'reason'] == failed
+    assert 0 == d.pending_reads
+    d.mode = qbuf.MODE_DELIMITED
+    d.feed(b'\n')
+    assert [('line', b'part')] == d.got
+    pytest.raises(ValueError, d.add_read, got.append, 7)
+    pytest.raises(ValueError, d.add_read, got.append, qbuf.MODE_STATEFUL, -1)
+
+
+def test_poller(poller_factory):
+    poller_cls, buf_cls = poller_factory
+    poller = poller_cls()
+    pairs = [socket.socketpair() for _ in xrange(3)]
+    try:
+        lines, raw, closing = buffers = [
+            buf_cls(b'\r\n'), buf_cls(), buf_cls(b'\n')]
+        for (a, b), buf in zip(pairs, buffers):
+            a.setblocking(False)
+            poller.register(a, buf, max_bytes=16)
+        assert 3 == len(poller)
+        pairs[0][1].sendall(b'one\r\ntwo\r\nthr')
+        pairs[1][1].sendall(b'raw data')
+        pairs[2][1].sendall(b'partial')
+        result = dict(poller.poll(1))
+        assert {lines: [b'one', b'two'], raw: []} == result
+        assert b'raw data' == raw.pop()
+        pairs[0][1].sendall(b'ee\r\n')
+        pairs[2][1].close()
+        result = dict(poller.poll(1))
+        assert {lines: [b'three'], closing: None} == result
+        assert b'partial' == closing.pop()
+        assert 2 == len(poller)
+        assert [] == poller.poll(0)
+        pytest.raises(KeyError, poller.unregister, pairs[2][0])
+        poller.unregister(pairs[1][0])
+        pairs[1][1].sendall(b'ignored')
+        assert [] == poller.poll(0)
+        pytest.raises(ValueError, poller.register, pairs[0][0], lines, 0)
+    finally:
+        poller.close()
+        for a, b in pairs:
+            a.close()
+            b.close()
+    assert poller.closed
+    pytest.raises(ValueError, poller.poll)
+
+
+def test_poller_push_during_read():
+    # Pushes from another thread while the Poller reads with the GIL
+    # released; only the C queue supports pushing from two threads.
+    if not hasattr(select, 'epoll'):
+        pytest.skip('Poller needs epoll')
+    poller = qbuf.Poller()
+    a, b = socket.socketpair()
+    buf = qbuf.BufferQueue(coalesce_below=64)
+    stop = []
+
+    def push():
+        while not stop:
+            buf.push(b'P')
+
+    try:
+        a.setblocking(False)
+        poller.register(a, buf, max_bytes=1 << 20)
+        thread = threading.Thread(target=push)
+        thread.start()
+        try:
+            for x in xrange(200):
+                b.sendall(b'S' * 100000)
+                poller.poll(1)
+        finally:
+            stop.append(True)
+            thread.join()
+        while poller.poll(0):
+            pass
+        data = buf.pop()
+        assert 200 * 100000 == data.count(b'S')
+        assert len(data) == data.count(b'S') + data.count(b'P')
+    finally:
+        poller.close()
+        a.close()
+        b.close()
+
+
+def test_asyncio_protocol():
+    asyncio = pytest.importorskip('asyncio')
+    if not hasattr(asyncio, 'BufferedProtocol'):
+        pytest.skip('asyncio.BufferedProtocol needs Python 3.7')
+    from qbuf.asyncio_support import BufferedProtocol
+
+    class Protocol(BufferedProtocol):
+        limit = 64
+
+    loop = asyncio.new_event_loop()
+    a, b = socket.socketpair()
+    try:
+        _, proto = loop.run_until_complete(
+            loop.connect_accepted_socket(Protocol, a))
+        b.sendall(b'line one\r\nsome:\x00\x05thing' + b'x' * 200)
+        assert b'line one' == loop.run_until_complete(proto.readline())
+        assert b'some:' == loop.run_until_complete(proto.readuntil(b':'))
+        assert (5,) == loop.run_until_complete(proto.unpack('!H'))
+        assert b'thing' == loop.run_until_complete(proto.readexactly(5))
+        assert b'x' * 200 == loop.run_until_complete(proto.read(200))
+        b.sendall(b'rest')
+        assert b'rest' == loop.run_until_complete(proto.read())
+        b.sendall(b'partial')
+        b.close()
+        with pytest.raises(asyncio.IncompleteReadError):
+            loop.run_until_complete(proto.readexactly(10))
+    finally:
+        b.close()
+        loop.close()
+
+
+def test_shared_ring():
+    memory = bytearray(qbuf.SharedRing.header_size + 100)
+    ring = qbuf.SharedRing(memory, b'\r\n', create=True)
+    assert 64 == ring.capacity
+    ring.push(b'x' * 60)
+    assert b'x' * 60 == ring.pop(60)
+    # From here on, pushes wrap around the end of the ring.
+    ring.push(b'one\r')
+    ring.push(b'\ntwo\r\n' + struct.pack('!HI', 1, 2))
+    other = qbuf.SharedRing(memory)
+    assert 16 == len(other)
+    assert b'one' == other.popline(b'\r\n')
+    assert b'two' == ring.popline()
+    pytest.raises(ValueError, ring.popline)
+    assert (1, 2) == ring.pop_struct('!HI')
+    pytest.raises(qbuf.BufferUnderflow, ring.pop, 1)
+    pytest.raises(qbuf.BufferUnderflow, ring.pop, 1, timeout=0.01)
+    ring.push(b'y' * 64)
+    pytest.raises(qbuf.BufferOverflow, ring.push, b'z', timeout=0)
+    pytest.raises(qbuf.FrameTooLong, ring.popline)
+    pytest.raises(ValueError, ring.push, b'z' * 65)
+    assert b'y' * 64 == ring.pop()
+    ring.release()
+    pytest.raises(ValueError, ring.pop)
+    pytest.raises(ValueError, qbuf.SharedRing, bytearray(len(memory)))
+
+    # Releasing a ring with a thread waiting on it would pull the memory
+    # out from under the wait.
+    ring = qbuf.SharedRing(memory, create=True)
+    popped = []
+    thread = threading.Thread(
+        target=lambda: popped.append(ring.pop(timeout=None)))
+    thread.start()
+    try:
+        time.sleep(0.05)
+        pytest.raises(BufferError, ring.release)
+    finally:
+        ring.push(b'wake')
+        thread.join()
+    assert popped == [b'wake']
+    pytest.raises(qbuf.BufferUnderflow, ring.pop, timeout=0.01)
+    ring.release()
+
+
+def _push_lines(handle, n_lines):
+    ring = handle.open()
+    for i in xrange(n_lines):
+        ring.push(b'line ' + str(i).encode())
+        ring.push(b'\n')
+    ring.release()
+    handle.close()
+
+
+def test_shared_ring_processes():
+    pytest.importorskip('multiprocessing.shared_memory')
+    import multiprocessing
+    from qbuf.multiprocessing_support import SharedRingHandle
+    handle = SharedRingHandle(256, b'\n')
+    process = multiprocessing.Process(target=_push_lines, args=(handle, 1000))
+    process.start()
+    # After starting, so that a forked child doesn't inherit this ring.
+    ring = handle.open()
+    try:
+        for i in xrange(1000):
+            assert b'line ' + str(i).encode() == ring.popline(timeout=10)
+        process.join()
+        assert 0 == process.exitcode
+    finally:
+        ring.release()
+        handle.close()
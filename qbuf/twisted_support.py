@@ -5,14 +5,13 @@ changing the buffering mode of MultiBufferer.
 """
 
 #from __future__ import absolute_import
-from qbuf import BufferQueue, BufferUnderflow
+from qbuf import (
+    BufferQueue, Dispatcher, FrameTooLong, MODE_RAW, MODE_DELIMITED,
+    MODE_STATEFUL)
 from twisted.internet import protocol, defer
-import collections
 import struct
 
-MODE_RAW, MODE_DELIMITED, MODE_STATEFUL = xrange(3)
-
-class MultiBufferer(protocol.Protocol):
+class MultiBufferer(Dispatcher, protocol.Protocol):
     """A replacement for a couple of buffering classes provided by twisted.
 
     Without subclassing, it can work the same way as LineReceiver and
@@ -33,15 +32,22 @@ class MultiBufferer(protocol.Protocol):
     MultiBufferers can also return Deferreds that are fired when a certain
     amount of data has been sent over the wire. This is intended for use with
     twisted.internet.defer.inlineCallbacks.
+
+    The buffering itself is done by qbuf.Dispatcher, which runs the loop
+    handing out received data natively and only calls back into Python with
+    complete payloads. Outgoing data is queued in out_buffer, a BufferQueue
+    copying together writes smaller than write_coalesce_below, and handed
+    to the transport once per turn of the reactor.
     """
     mode = MODE_RAW
-    initial_delimiter = '\r\n'
+    initial_delimiter = b'\r\n'
     current_state = None
-    _closed = False
+    write_coalesce_below = 512
+    _flush_call = None
 
     def __init__(self):
-        self._buffer = BufferQueue(self.initial_delimiter)
-        self._callbacks = collections.deque()
+        Dispatcher.__init__(self, self.initial_delimiter)
+        self.out_buffer = BufferQueue(coalesce_below=self.write_coalesce_below)
 
     def read(self, size=None):
         """Wait for some data to be received.
@@ -52,9 +58,9 @@ class MultiBufferer(protocol.Protocol):
         """
         d = defer.Deferred()
         if size is None:
-            self._callbacks.append((d, MODE_RAW, None))
+            self.add_read(d.callback, MODE_RAW, None, d.errback)
         else:
-            self._callbacks.append((d, MODE_STATEFUL, size))
+            self.add_read(d.callback, MODE_STATEFUL, size, d.errback)
         return d
 
     def unpack(self, fmt):
@@ -79,65 +85,50 @@ class MultiBufferer(protocol.Protocol):
         Deferred that will be fired with the received line, without delimiter.
         """
         d = defer.Deferred()
-        self._callbacks.append((d, MODE_DELIMITED, delimiter))
+        self.add_read(d.callback, MODE_DELIMITED, delimiter, d.errback)
         return d
 
     def write(self, data):
         """Send some data over the wire.
 
-        This method merely forwards the data to the underlying transport,
-        provided to parallel the read/readline methods.
+        The data is queued rather than written straight away, so everything
+        written before control goes back to the reactor reaches the
+        transport in one writeSequence call; see flush. Provided to
+        parallel the read/readline methods.
+        """
+        self.out_buffer.push(data)
+        self._schedule_flush()
+
+    def _schedule_flush(self):
+        if self._flush_call is None:
+            from twisted.internet import reactor
+            self._flush_call = reactor.callLater(0, self.flush)
+
+    def flush(self):
+        """Hand everything queued by write to the transport now.
+
+        The queued chunks are passed to writeSequence as views, without
+        joining them. Twisted's own transports still join the sequence into
+        one string when they write it out, so a payload is copied once
+        there; what the queue saves is a transport call per write and the
+        copies made building messages out of pieces.
         """
-        self.transport.write(data)
+        if self._flush_call is not None:
+            if self._flush_call.active():
+                self._flush_call.cancel()
+            self._flush_call = None
+        if self.out_buffer:
+            self.transport.writeSequence(self.out_buffer.pop_iov())
 
-    def _updateCallbacks(self, data):
-        d, _, _ = self._callbacks.popleft()
-        d.callback(data)
+    dataReceived = Dispatcher.feed
 
-    def dataReceived(self, data):
-        if self._closed:
-            return
-
-        self._buffer.push(data)
-        while self._buffer and not self._closed:
-            if self._callbacks:
-                _, mode, extra = self._callbacks[0]
-            else:
-                mode, extra = self.mode, None
-            if mode == MODE_RAW:
-                self._rawDataReceived(self._buffer.pop())
-            elif mode == MODE_DELIMITED:
-                try:
-                    line = self._buffer.popline(extra)
-                except ValueError:
-                    break
-                else:
-                    self._lineReceived(line)
-            elif mode == MODE_STATEFUL:
-                if self._callbacks:
-                    try:
-                        chunk = self._buffer.pop(extra)
-                    except BufferUnderflow:
-                        break
-                    else:
-                        self._updateCallbacks(chunk)
-                else:
-                    if self.current_state is None:
-                        self.current_state = self.getInitialState()
-                    try:
-                        chunk = self._buffer.pop(self.current_state[1])
-                    except BufferUnderflow:
-                        break
-                    else:
-                        result = self.current_state[0](chunk)
-                        if result:
-                            self.current_state = result
-
-    def setMode(self, mode, extra='', flush=False, state=None, delimiter=None):
+    def setMode(self, mode, extra=b'', flush=False, state=None, delimiter=None):
         """Change the buffering mode.
 
-        If 'extra' is provided, add that to the buffer. If 'flush' is True and
-        'extra' is provided, also flush the buffer as much as possible. If
+        If 'extra' is provided, add that to the front of the buffer, ahead of
+        anything already received; this is for handing back bytes that were
+        read but belong to the new mode. If 'flush' is True and 'extra' is
+        provided, also flush the buffer as much as possible. If
         'state' is not None, that value will be assigned to self.current_state
         before anything else. If 'delimiter' is not None, the delimiter will
         be set before anything else.
@@ -147,37 +138,25 @@ class MultiBufferer(protocol.Protocol):
             self.current_state = state
         if delimiter is not None:
             self.delimiter = delimiter
-        if extra and flush:
-            self.dataReceived(extra)
-        elif extra:
-            self._buffer.push(extra)
+        if extra:
+            self.buffer.push_front(extra)
+            if flush:
+                self.dataReceived(b'')
 
     def _get_delimiter(self):
-        return self._buffer.delimiter
+        return self.buffer.delimiter
 
     def _set_delimiter(self, delimiter):
-        self._buffer.delimiter = delimiter
+        self.buffer.delimiter = delimiter
 
     delimiter = property(_get_delimiter, _set_delimiter)
 
-    def _rawDataReceived(self, data):
-        if self._callbacks:
-            self._updateCallbacks(data)
-        else:
-            self.rawDataReceived(data)
-
     def rawDataReceived(self, data):
         """Called when the buffering mode is MODE_RAW and there is new data
         available.
         """
         raise NotImplementedError
 
-    def _lineReceived(self, line):
-        if self._callbacks:
-            self._updateCallbacks(line)
-        else:
-            self.lineReceived(line)
-
     def lineReceived(self, line):
         """Called when the buffering mode is MODE_DELIMITED and there is a new
         line available.
@@ -202,28 +181,67 @@ class MultiBufferer(protocol.Protocol):
         buffer. If 'disconnect' is True, this will also lose the connection on
         the transport.
         """
-        self._buffer.clear()
-        self._closed = True
+        Dispatcher.close(self)
         if disconnect:
+            self.flush()
             self.transport.loseConnection()
 
     def connectionLost(self, reason):
+        if self._flush_call is not None:
+            if self._flush_call.active():
+                self._flush_call.cancel()
+            self._flush_call = None
+        self.out_buffer.clear()
         self.close(False)
-        for d, _, _ in self._callbacks:
-            d.errback(reason)
+        self.fail_reads(reason)
 
 class IntNStringReceiver(MultiBufferer):
     """This class is identical to the IntNStringReceiver provided by Twisted,
     implemented using MultiBufferer as a demonstration of how MODE_STATEFUL
     works.
+
+    While it is waiting for a length prefix, complete strings are pulled out
+    of the buffer in bulk with BufferQueue.pop_frames. If MAX_LENGTH is not
+    None, a longer string causes lengthLimitExceeded to be called.
     """
     mode = MODE_STATEFUL
+    MAX_LENGTH = None
 
     def getInitialState(self):
         return self.receiveLength, self.prefixLength
 
+    def dataReceived(self, data):
+        if (self.closed or self.pending_reads or self.mode != MODE_STATEFUL
+                or self.current_state not in (None, self.getInitialState())):
+            return MultiBufferer.dataReceived(self, data)
+
+        self.buffer.push(data)
+        try:
+            frames = self.buffer.pop_frames(
+                self.structFormat, max_length=self.MAX_LENGTH, as_bytes=True)
+        except FrameTooLong:
+            length, = self.buffer.pop_struct(self.structFormat)
+            self.lengthLimitExceeded(length)
+            return
+        self.current_state = None
+        for i, string in enumerate(frames):
+            self.stringReceived(string)
+            if self.closed:
+                return
+            if self.pending_reads or self.mode != MODE_STATEFUL:
+                # Hand the strings not yet delivered back to the buffer for
+                # whatever reads next.
+                self.buffer.push_front(b''.join(
+                    struct.pack(self.structFormat, len(s)) + s
+                    for s in frames[i + 1:]))
+                break
+        MultiBufferer.dataReceived(self, b'')
+
     def receiveLength(self, data):
         length, = struct.unpack(self.structFormat, data)
+        if self.MAX_LENGTH is not None and length > self.MAX_LENGTH:
+            self.lengthLimitExceeded(length)
+            return
         return self.receiveString, length
 
     def receiveString(self, string):
@@ -231,11 +249,18 @@ class IntNStringReceiver(MultiBufferer):
         return self.receiveLength, self.prefixLength
 
     def sendString(self, data):
-        self.transport.write(struct.pack(self.structFormat, len(data)) + data)
+        self.out_buffer.push_struct(self.structFormat, len(data))
+        self.write(data)
 
     def stringReceived(self, string):
         raise NotImplementedError
 
+    def lengthLimitExceeded(self, length):
+        """Called when a string longer than MAX_LENGTH is announced. By
+        default, this drops the connection.
+        """
+        self.close()
+
 class Int32StringReceiver(IntNStringReceiver):
     """This class is an implementation of the abstract IntNStringReceiver
     class, only provided as a demonstration of MODE_STATEFUL.
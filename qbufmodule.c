@@ -2,9 +2,260 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <Python.h>
 #include "structmember.h"
 
+#ifdef MS_WINDOWS
+#  include <winsock2.h>
+#  define qbuf_read(fd, buf, len) recv((SOCKET)(fd), (buf), (int)(len), 0)
+typedef WSABUF qbuf_iovec;
+#  define QBUF_IOV_SET(iov, ptr, len) \
+        ((iov).buf = (ptr), (iov).len = (ULONG)(len))
+#  define QBUF_IOV_MAX 1024
+static Py_ssize_t
+qbuf_writev(int fd, qbuf_iovec *iov, int n_iov)
+{
+    DWORD sent;
+    if (WSASend((SOCKET)fd, iov, n_iov, &sent, 0, NULL, NULL))
+        return -1;
+    return sent;
+}
+#  define QBUF_LAST_ERROR() WSAGetLastError()
+#  define QBUF_EINTR(err) ((err) == WSAEINTR)
+#  define QBUF_WOULDBLOCK(err) ((err) == WSAEWOULDBLOCK)
+#  define QBUF_SET_ERROR(err) PyErr_SetExcFromWindowsErr(PyExc_OSError, (err))
+typedef struct {
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+} qbuf_waitlock;
+typedef ULONGLONG qbuf_deadline;
+#  define qbuf_waitlock_init(w) (InitializeSRWLock(&(w)->lock), \
+        InitializeConditionVariable(&(w)->cond), 0)
+#  define qbuf_waitlock_destroy(w) ((void)0)
+#  define qbuf_waitlock_lock(w) AcquireSRWLockExclusive(&(w)->lock)
+#  define qbuf_waitlock_unlock(w) ReleaseSRWLockExclusive(&(w)->lock)
+#  define qbuf_waitlock_broadcast(w) WakeAllConditionVariable(&(w)->cond)
+#  define qbuf_deadline_set(d, timeout) \
+        (*(d) = GetTickCount64() + (ULONGLONG)((timeout) * 1000))
+static int
+qbuf_waitlock_wait(qbuf_waitlock *w, qbuf_deadline *deadline)
+{
+    ULONGLONG now;
+    DWORD ms = INFINITE;
+    if (deadline) {
+        if ((now = GetTickCount64()) >= *deadline)
+            return 1;
+        ms = (DWORD)(*deadline - now);
+    }
+    if (!SleepConditionVariableSRW(&w->cond, &w->lock, ms, 0))
+        return GetLastError() == ERROR_TIMEOUT;
+    return 0;
+}
+#  include <io.h>
+#  include <sys/stat.h>
+static char *
+qbuf_map(int fd, PY_LONG_LONG offset, Py_ssize_t length)
+{
+    HANDLE mapping, file = (HANDLE)_get_osfhandle(fd);
+    char *ret = NULL;
+    if (file == INVALID_HANDLE_VALUE) {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return NULL;
+    }
+    if ((mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+        ret = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(offset >> 32),
+            (DWORD)offset, length);
+        CloseHandle(mapping);
+    }
+    return ret;
+}
+#  define qbuf_unmap(ptr, length) UnmapViewOfFile(ptr)
+#  define QBUF_SET_MAP_ERROR() PyErr_SetFromWindowsErr(0)
+static Py_ssize_t
+qbuf_map_granularity(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+}
+static int
+qbuf_file_size(int fd, PY_LONG_LONG *size)
+{
+    struct _stati64 st;
+    if (_fstati64(fd, &st))
+        return -1;
+    *size = st.st_size;
+    return 0;
+}
+#  define qbuf_monotonic() (GetTickCount64() / 1000.0)
+#  define qbuf_sleep_us(us) Sleep((DWORD)(((us) + 999) / 1000))
+#  define QBUF_HAVE_EVENTS 0
+#  define qbuf_event_signal(fd) ((void)0)
+#  define qbuf_event_wait(fd, ms) Sleep(ms)
+#else
+#  include <unistd.h>
+#  include <limits.h>
+#  include <sys/uio.h>
+#  define qbuf_read(fd, buf, len) read((fd), (buf), (len))
+typedef struct iovec qbuf_iovec;
+#  define QBUF_IOV_SET(iov, ptr, len) \
+        ((iov).iov_base = (ptr), (iov).iov_len = (len))
+#  if defined(IOV_MAX) && IOV_MAX < 1024
+#    define QBUF_IOV_MAX IOV_MAX
+#  else
+#    define QBUF_IOV_MAX 1024
+#  endif
+#  define qbuf_writev(fd, iov, n_iov) writev((fd), (iov), (n_iov))
+#  define QBUF_LAST_ERROR() errno
+#  define QBUF_EINTR(err) ((err) == EINTR)
+#  define QBUF_WOULDBLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#  define QBUF_SET_ERROR(err) (errno = (err), \
+        PyErr_SetFromErrno(PyExc_OSError))
+#  include <pthread.h>
+#  include <sys/time.h>
+#  include <time.h>
+/* Wait deadlines are on the monotonic clock wherever condition variables
+ * can be told to use it (not macOS), so steps in the wall clock don't
+ * stretch them. */
+#  if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+#    define QBUF_WAIT_MONOTONIC
+#  endif
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} qbuf_waitlock;
+typedef struct timespec qbuf_deadline;
+#  define qbuf_waitlock_destroy(w) (pthread_cond_destroy(&(w)->cond), \
+        pthread_mutex_destroy(&(w)->mutex))
+#  define qbuf_waitlock_lock(w) pthread_mutex_lock(&(w)->mutex)
+#  define qbuf_waitlock_unlock(w) pthread_mutex_unlock(&(w)->mutex)
+#  define qbuf_waitlock_broadcast(w) pthread_cond_broadcast(&(w)->cond)
+static int
+qbuf_waitlock_init(qbuf_waitlock *w)
+{
+    pthread_condattr_t attr;
+    int err;
+    if (pthread_mutex_init(&w->mutex, NULL))
+        return -1;
+    if (pthread_condattr_init(&attr)) {
+        pthread_mutex_destroy(&w->mutex);
+        return -1;
+    }
+#  ifdef QBUF_WAIT_MONOTONIC
+    err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+        || pthread_cond_init(&w->cond, &attr);
+#  else
+    err = pthread_cond_init(&w->cond, &attr);
+#  endif
+    pthread_condattr_destroy(&attr);
+    if (err) {
+        pthread_mutex_destroy(&w->mutex);
+        return -1;
+    }
+    return 0;
+}
+static void
+qbuf_deadline_set(qbuf_deadline *deadline, double timeout)
+{
+#  ifdef QBUF_WAIT_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+#  else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    deadline->tv_sec = now.tv_sec;
+    deadline->tv_nsec = now.tv_usec * 1000;
+#  endif
+    deadline->tv_sec += (time_t)timeout;
+    deadline->tv_nsec += (long)((timeout - (time_t)timeout) * 1e9);
+    if (deadline->tv_nsec >= 1000000000) {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+/* Returns 1 if the deadline passed, and 0 if the wait was woken up. */
+static int
+qbuf_waitlock_wait(qbuf_waitlock *w, qbuf_deadline *deadline)
+{
+    if (!deadline)
+        return pthread_cond_wait(&w->cond, &w->mutex), 0;
+    return pthread_cond_timedwait(&w->cond, &w->mutex, deadline) == ETIMEDOUT;
+}
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+static char *
+qbuf_map(int fd, PY_LONG_LONG offset, Py_ssize_t length)
+{
+    void *ret = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, (off_t)offset);
+    if (ret == MAP_FAILED)
+        return NULL;
+#  ifdef MADV_SEQUENTIAL
+    madvise(ret, length, MADV_SEQUENTIAL);
+#  endif
+    return ret;
+}
+#  define qbuf_unmap(ptr, length) munmap((ptr), (length))
+#  define QBUF_SET_MAP_ERROR() PyErr_SetFromErrno(PyExc_OSError)
+#  define qbuf_map_granularity() ((Py_ssize_t)sysconf(_SC_PAGESIZE))
+static int
+qbuf_file_size(int fd, PY_LONG_LONG *size)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return -1;
+    *size = st.st_size;
+    return 0;
+}
+#  include <poll.h>
+static double
+qbuf_monotonic(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+#  define qbuf_sleep_us(us) usleep(us)
+/* SharedRing wakeups go through eventfds shared between the processes. */
+#  define QBUF_HAVE_EVENTS 1
+#  ifdef __linux__
+#    include <sys/epoll.h>
+#    define QBUF_HAVE_EPOLL
+#  endif
+static void
+qbuf_event_signal(int fd)
+{
+    PY_UINT64_T one = 1;
+    while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+/* Wait up to ms milliseconds for fd to be signalled, and reset it. */
+static void
+qbuf_event_wait(int fd, int ms)
+{
+    struct pollfd pfd;
+    PY_UINT64_T value;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, ms) == 1 && read(fd, &value, sizeof(value)) == -1)
+        value = 0;
+}
+#endif
+
+/* Loads and stores of a SharedRing's indices, which another process may be
+ * using at the same time. Loads acquire, stores release, and the fence is
+ * a full barrier. */
+#ifdef _MSC_VER
+#  define qbuf_atomic_load(p) ((PY_UINT64_T)InterlockedCompareExchange64( \
+        (volatile LONG64 *)(p), 0, 0))
+#  define qbuf_atomic_store(p, v) \
+        ((void)InterlockedExchange64((volatile LONG64 *)(p), (LONG64)(v)))
+#  define qbuf_atomic_fence() MemoryBarrier()
+#else
+#  define qbuf_atomic_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#  define qbuf_atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#  define qbuf_atomic_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
 #ifndef Py_RETURN_NONE
 #  define Py_RETURN_NONE do { Py_INCREF(Py_None); return Py_None; } while (0)
 #endif
@@ -23,6 +274,18 @@
 #  define PyMODINIT_FUNC void
 #endif
 
+#if PY_MAJOR_VERSION >= 3
+#  define PyInt_FromSsize_t PyLong_FromSsize_t
+#  define PyInt_FromLong PyLong_FromLong
+#  define PyNativeString_FromFormat PyUnicode_FromFormat
+#  define PyNativeString_InternFromString PyUnicode_InternFromString
+#  define BufferView_Check PyMemoryView_Check
+#else
+#  define PyNativeString_FromFormat PyString_FromFormat
+#  define PyNativeString_InternFromString PyString_InternFromString
+#  define BufferView_Check(ob) (PyBuffer_Check(ob) || PyMemoryView_Check(ob))
+#endif
+
 #if PY_VERSION_HEX < 0x02050000
   typedef int Py_ssize_t;
   typedef int (*lenfunc) (PyObject *);
@@ -35,38 +298,376 @@
 #endif
 
 #define INITIAL_BUFFER_SIZE 8
+/* The ring shrinks to a quarter of its size once no more than an eighth of
+ * it is in use, but never below the capacity it started with. */
+#define SHRINK_THRESHOLD 8
+#define SHRINK_FACTOR 4
+/* Delimiters at least this long are searched for with Horspool's algorithm
+ * once the stretch of a chunk being scanned is long enough to pay for
+ * building the skip table. Shorter ones use memchr to find candidates. */
+#define HORSPOOL_MIN_DELIM 4
+#define HORSPOOL_MIN_HAYSTACK 256
+/* Slabs for recv_from come in power-of-two size classes from SLAB_MIN_SIZE
+ * up; freed slabs of each class are kept around, up to SLAB_POOL_DEPTH of
+ * them, for reuse. A read goes into the remainder of the current slab
+ * unless less than SLAB_MIN_READ bytes (or the amount asked for) are
+ * left. */
+#define SLAB_MIN_SIZE 4096
+#define SLAB_N_CLASSES 9
+#define SLAB_POOL_DEPTH 16
+#define SLAB_MIN_READ 1024
+/* reserve() without a size hint makes sure there is this much room. */
+#define RESERVE_DEFAULT_SIZE 65536
+/* push_file maps files in pieces of at most MAP_SEGMENT_SIZE bytes, each
+ * one a slab of class SLAB_MAPPED that is unmapped once it is freed. */
+#define MAP_SEGMENT_SIZE (64 * 1024 * 1024)
+#define SLAB_MAPPED -2
+
+/* Compiled struct formats are kept in struct_cache, keyed by the format
+ * passed in. Like the struct module's own cache, it is simply emptied once
+ * it holds STRUCT_CACHE_SIZE of them. Formats made only of up to
+ * FAST_STRUCT_MAX_FIELDS standard-size integer codes are decoded without
+ * going through struct at all. */
+#define STRUCT_CACHE_SIZE 100
+#define FAST_STRUCT_MAX_FIELDS 8
+
+/* Timeouts longer than this (about three years) wait forever instead. */
+#define MAX_WAIT_TIMEOUT 1e8
+/* Waits for wakeups last at most this many milliseconds at a time, so
+ * signals get handled. */
+#define WAIT_SLICE 100
+
+/* The histogram kept with stats has a bucket per bit length of the number
+ * of bytes buffered. */
+#define STATS_HISTOGRAM_BUCKETS (8 * (int)sizeof(Py_ssize_t))
+
+/* How many line ends poplines can note before going to the heap. */
+#define POPLINES_STACK_BOUNDS 64
+
+/* Dispatcher modes, exported as MODE_RAW, MODE_DELIMITED and MODE_STATEFUL,
+ * and how many pending reads a dispatcher first makes room for. */
+#define MODE_RAW 0
+#define MODE_DELIMITED 1
+#define MODE_STATEFUL 2
+#define INITIAL_READS_SIZE 4
+
+/* A SharedRing's memory starts with a header of three cache lines; see
+ * SharedRingHeader. */
+#define SHARED_RING_LINE 64
+#define SHARED_RING_MAGIC 0x7162756672696e67ULL
+/* Without wakeup fds, waits sleep instead, backing off from the first to
+ * the second of these many microseconds. */
+#define SHARED_RING_MIN_SLEEP 50
+#define SHARED_RING_MAX_SLEEP 1000
+/* Poller.poll reads from at most this many descriptors by default. */
+#define POLLER_MAX_EVENTS 1024
 
 static PyObject *qbuf_underflow;
+static PyObject *qbuf_frame_too_long;
+static PyObject *qbuf_overflow;
 static PyObject *_struct_obj;
+static PyObject *struct_cache;
+/* Attribute and method names the dispatcher looks up, interned once. */
+static PyObject *str_mode, *str_current_state, *str_getInitialState;
+static PyObject *str_rawDataReceived, *str_lineReceived;
 
 PyDoc_STRVAR(BufferQueue_doc,
-"BufferQueue([delimiter])\n\
+"BufferQueue([delimiter], [coalesce_below], [initial_capacity], [delimiters],\n\
+             [release_gil_above], [stats])\n\
 \n\
 Initialize a new buffer. If the delimiter is provided, it can be\n\
-used to pop lines off instead of just bytes.\n\
+used to pop lines off instead of just bytes; delimiters can be given\n\
+instead to let any of several delimiters end a line. If coalesce_below is\n\
+provided, pushes of fewer bytes than that are copied together into\n\
+larger chunks instead of each being kept separately, which saves\n\
+memory and time when data trickles in a few bytes at a time.\n\
+initial_capacity is how many chunks the buffer has room for before\n\
+it needs to grow; it also never shrinks below that.\n\
+\n\
+When one thread pushes while another pops, release_gil_above lets\n\
+them overlap: pops copying and delimiter searches scanning at least\n\
+that many bytes release the GIL while they do so. If stats is true,\n\
+the buffer keeps the counters reported by .stats().\n\
 \n\
 Iterating over a BufferQueue is the same as repeatedly calling\n\
 .popline() on it, except that the delimiter is included in the\n\
-string yielded. An empty BufferQueue evaluates to boolean false.\n\
+line yielded. An empty BufferQueue evaluates to boolean false.\n\
 ");
 
+/* One entry in the ring: either a bytes object, or a memoryview holding an
+ * export of some other object's buffer. ptr and size describe its data. */
+typedef struct {
+    PyObject *obj;
+    char *ptr;
+    Py_ssize_t size;
+} BufferQueueChunk;
+
+/* A block of memory that data read by recv_from lands in, or a read-only
+ * mapping of part of a file made by push_file. Chunks in the ring and views
+ * handed out refer to parts of it; the memory goes back to slab_pool, or is
+ * unmapped, once the last of them is gone. */
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t capacity;
+    int size_class;
+} BufferSlab;
+
+static struct {
+    char *free[SLAB_POOL_DEPTH];
+    int n_free;
+} slab_pool[SLAB_N_CLASSES];
+
+static PyTypeObject BufferSlabType;
+
+static BufferSlab *
+BufferSlab_new(Py_ssize_t min_size)
+{
+    BufferSlab *self;
+    Py_ssize_t size;
+    int size_class;
+    for (size_class = 0, size = SLAB_MIN_SIZE; size < min_size;
+            ++size_class, size *= 2) {
+        if (size_class == SLAB_N_CLASSES - 1) {
+            size_class = -1;
+            size = min_size;
+            break;
+        }
+    }
+
+    if (!(self = PyObject_New(BufferSlab, &BufferSlabType)))
+        return NULL;
+    self->capacity = size;
+    self->size_class = size_class;
+    if (size_class != -1 && slab_pool[size_class].n_free)
+        self->data = slab_pool[size_class].free[
+            --slab_pool[size_class].n_free];
+    else if (!(self->data = PyMem_Malloc(size))) {
+        Py_DECREF(self);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return self;
+}
+
+static BufferSlab *
+BufferSlab_map(int fd, PY_LONG_LONG offset, Py_ssize_t length)
+{
+    BufferSlab *self;
+    if (!(self = PyObject_New(BufferSlab, &BufferSlabType)))
+        return NULL;
+    self->capacity = length;
+    self->size_class = SLAB_MAPPED;
+    if (!(self->data = qbuf_map(fd, offset, length))) {
+        QBUF_SET_MAP_ERROR();
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+static void
+BufferSlab_dealloc(BufferSlab *self)
+{
+    if (self->data && self->size_class == SLAB_MAPPED)
+        qbuf_unmap(self->data, self->capacity);
+    else if (self->data) {
+        if (self->size_class != -1
+                && slab_pool[self->size_class].n_free < SLAB_POOL_DEPTH)
+            slab_pool[self->size_class].free[
+                slab_pool[self->size_class].n_free++] = self->data;
+        else
+            PyMem_Free(self->data);
+    }
+    PyObject_Del(self);
+}
+
+static int
+BufferSlab_getbuffer(BufferSlab *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data,
+        self->capacity, 1, flags);
+}
+
+static PyBufferProcs BufferSlab_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                          /* bf_getreadbuffer */
+    0,                          /* bf_getwritebuffer */
+    0,                          /* bf_getsegcount */
+    0,                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)BufferSlab_getbuffer, /* bf_getbuffer */
+    0,                          /* bf_releasebuffer */
+};
+
+#if PY_MAJOR_VERSION < 3
+#  define BUFFERSLAB_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#else
+#  define BUFFERSLAB_TPFLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+static PyTypeObject BufferSlabType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.BufferSlab",          /*tp_name*/
+    sizeof(BufferSlab),         /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)BufferSlab_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    &BufferSlab_as_buffer,      /*tp_as_buffer*/
+    BUFFERSLAB_TPFLAGS,         /*tp_flags*/
+    "Memory backing data read into a BufferQueue.", /* tp_doc */
+};
+
+/* The part of a slab handed out by reserve() to be written into. Unlike the
+ * slab itself, it exports its memory writable. */
+typedef struct {
+    PyObject_HEAD
+    BufferSlab *slab;
+    char *ptr;
+    Py_ssize_t size;
+} BufferReservation;
+
+static void
+BufferReservation_dealloc(BufferReservation *self)
+{
+    Py_DECREF(self->slab);
+    PyObject_Del(self);
+}
+
+static int
+BufferReservation_getbuffer(BufferReservation *self, Py_buffer *view,
+        int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->ptr, self->size,
+        0, flags);
+}
+
+static PyBufferProcs BufferReservation_as_buffer = {
+#if PY_MAJOR_VERSION < 3
+    0,                          /* bf_getreadbuffer */
+    0,                          /* bf_getwritebuffer */
+    0,                          /* bf_getsegcount */
+    0,                          /* bf_getcharbuffer */
+#endif
+    (getbufferproc)BufferReservation_getbuffer, /* bf_getbuffer */
+    0,                          /* bf_releasebuffer */
+};
+
+static PyTypeObject BufferReservationType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.BufferReservation",   /*tp_name*/
+    sizeof(BufferReservation),  /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)BufferReservation_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    &BufferReservation_as_buffer, /*tp_as_buffer*/
+    BUFFERSLAB_TPFLAGS,         /*tp_flags*/
+    "Room in a BufferQueue's memory for data to be written.", /* tp_doc */
+};
+
+/* Counters kept for stats() by buffers made with stats=True. */
+typedef struct {
+    PY_LONG_LONG bytes_pushed;
+    PY_LONG_LONG bytes_popped;
+    PY_LONG_LONG chunks_high_water;
+    PY_LONG_LONG ring_grows;
+    PY_LONG_LONG copied_bytes;
+    PY_LONG_LONG zero_copy_pops;
+    PY_LONG_LONG scanned_bytes;
+    /* Pops of bytes or views by how much was buffered at the time: bucket
+     * i counts those with fewer than 2**i bytes buffered that don't fit in
+     * bucket i - 1. */
+    PY_LONG_LONG buffered_histogram[STATS_HISTOGRAM_BUCKETS];
+} BufferQueueStats;
+
+#define QBUF_STAT_ADD(self, field, n) do { \
+        if ((self)->stats) \
+            (self)->stats->field += (n); \
+    } while (0)
+
 typedef struct {
     PyObject_HEAD
-    PyStringObject **buffer;
+    BufferQueueChunk *buffer;
     Py_ssize_t start_idx;
     Py_ssize_t end_idx;
     Py_ssize_t buffer_length;
+    Py_ssize_t initial_capacity;
     Py_ssize_t n_items;
     Py_ssize_t tot_length;
     Py_ssize_t cur_offset;
     PyObject *delim_obj;
+    /* The delimiter set, if one is used instead of delim_obj: a tuple of
+     * bytes, longest first, which bytes any of them start with, and the
+     * length of the shortest. */
+    PyObject *delim_set;
+    char delim_set_first[256];
+    Py_ssize_t delim_set_min;
+    /* Resumable delimiter scan state. If scan_delim is set, no occurrence of
+     * it starts before scan_pos bytes into the buffer; scan_chunk is the
+     * chunk (relative to start_idx) and scan_offset the offset into it where
+     * that position lies. Any partial match straddling the end of the
+     * buffered data begins exactly at the cursor. */
+    PyObject *scan_delim;
+    Py_ssize_t scan_chunk;
+    Py_ssize_t scan_offset;
+    Py_ssize_t scan_pos;
+    /* The slab recv_from reads into, and how much of it is used. */
+    BufferSlab *tail_slab;
+    Py_ssize_t tail_used;
+    int recv_busy;
+    /* The room last handed out by reserve(), until it is committed. It is
+     * taken out of the tail slab right away so that nothing else writes
+     * there meanwhile. */
+    BufferSlab *reserved_slab;
+    char *reserved_ptr;
+    Py_ssize_t reserved_size;
+    /* Pushes shorter than this are copied into the tail slab. */
+    Py_ssize_t coalesce_below;
+    /* Bumped whenever data is taken off the front, which invalidates any
+     * cursors. */
+    Py_ssize_t generation;
+    /* Pops and delimiter scans covering at least this many bytes release
+     * the GIL while they copy or search; 0 means never. */
+    Py_ssize_t release_gil_above;
+    /* Threads blocked in pop wait on wait_lock for push_seq to change.
+     * Pushes only bump it while there are any waiters. */
+    qbuf_waitlock wait_lock;
+    int wait_ready;
+    int n_waiters;
+    Py_ssize_t push_seq;
+    /* NULL unless the buffer was made with stats=True. */
+    BufferQueueStats *stats;
 } BufferQueue;
 
 typedef struct {
     BufferQueue *parent;
     Py_ssize_t string_idx;
     Py_ssize_t char_idx;
-    PyStringObject *cur_string;
+    BufferQueueChunk *cur_chunk;
     Py_ssize_t s_size;
     char *s_ptr;
 } BufferQueueIterator;
@@ -74,9 +675,9 @@ typedef struct {
 static void
 BufferQueueIterator_update(BufferQueueIterator *self)
 {
-    self->cur_string = self->parent->buffer[self->string_idx];
-    self->s_size = PyString_GET_SIZE(self->cur_string);
-    self->s_ptr = PyString_AS_STRING(self->cur_string);
+    self->cur_chunk = &self->parent->buffer[self->string_idx];
+    self->s_size = self->cur_chunk->size;
+    self->s_ptr = self->cur_chunk->ptr;
 }
 
 static void
@@ -109,695 +710,5439 @@ BufferQueueIterator_advance_char(BufferQueueIterator *self)
     return 0;
 }
 
+static void
+BufferQueue_reset_scan(BufferQueue *self)
+{
+    Py_CLEAR(self->scan_delim);
+    self->scan_chunk = self->scan_offset = self->scan_pos = 0;
+}
+
+/* Fill in a chunk referring to the data in obj without copying it. bytes
+ * are stored as-is; anything else supporting the buffer protocol is
+ * wrapped in a memoryview, which keeps its buffer exported (and a bytearray
+ * from being resized) for as long as the data is in the queue. */
 static int
-BufferQueue_push(BufferQueue *self, PyStringObject *string)
+BufferQueueChunk_init(BufferQueueChunk *chunk, PyObject *obj)
 {
-    PyStringObject **l_buffer, **l_buffer_end;
-    Py_ssize_t width, split;
-    if (PyString_GET_SIZE(string) == 0)
+    PyObject *view, *tmp;
+    Py_buffer *info;
+    if (PyBytes_Check(obj)) {
+        Py_INCREF(obj);
+        chunk->obj = obj;
+        chunk->ptr = PyBytes_AS_STRING(obj);
+        chunk->size = PyBytes_GET_SIZE(obj);
         return 0;
-
-    if (self->n_items == self->buffer_length) {
-        l_buffer = PyMem_New(PyStringObject *, self->buffer_length * 2);
-        if (!l_buffer) {
-            PyErr_SetString(PyExc_MemoryError, "failed to alloc bigger buffer");
+    }
+    if (!PyObject_CheckBuffer(obj)) {
+        PyErr_Format(PyExc_TypeError, "expected bytes or an object "
+            "supporting the buffer protocol (got %.50s instead)",
+            Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    if (!(view = PyMemoryView_FromObject(obj)))
+        return -1;
+    info = PyMemoryView_GET_BUFFER(view);
+    if (!PyBuffer_IsContiguous(info, 'C')) {
+        Py_DECREF(view);
+        PyErr_SetString(PyExc_ValueError, "buffer is not contiguous");
+        return -1;
+    }
+    if (info->ndim > 1 || info->itemsize != 1) {
+#if PY_MAJOR_VERSION >= 3
+        /* Views handed out later are sliced by byte offsets. */
+        tmp = PyObject_CallMethod(view, "cast", "s", "B");
+        Py_DECREF(view);
+        if (!(view = tmp))
             return -1;
-        }
-        l_buffer_end = l_buffer + self->buffer_length;
-        width = sizeof(self->buffer);
-        if (self->start_idx == 0 && self->end_idx == 0) {
-            memcpy(l_buffer_end, self->buffer, self->buffer_length * width);
+        info = PyMemoryView_GET_BUFFER(view);
+#else
+        (void)tmp;
+        Py_DECREF(view);
+        PyErr_SetString(PyExc_TypeError, "buffer must be of single bytes");
+        return -1;
+#endif
+    }
+    chunk->obj = view;
+    chunk->ptr = (char *)info->buf;
+    chunk->size = info->len;
+    return 0;
+}
+
+/* Return a read-only view of part of a chunk sharing its memory. */
+static PyObject *
+BufferQueueChunk_view(BufferQueueChunk *chunk, Py_ssize_t offset,
+        Py_ssize_t length)
+{
+    PyObject *view, *ret;
+#if PY_MAJOR_VERSION < 3
+    if (PyBytes_Check(chunk->obj))
+        return PyBuffer_FromObject(chunk->obj,
+            offset + (chunk->ptr - PyBytes_AS_STRING(chunk->obj)), length);
+#endif
+    if (PyMemoryView_Check(chunk->obj)) {
+        view = chunk->obj;
+        Py_INCREF(view);
+    } else if (!(view = PyMemoryView_FromObject(chunk->obj)))
+        return NULL;
+    /* The chunk may only cover part of the object's memory. */
+    offset += chunk->ptr - (char *)PyMemoryView_GET_BUFFER(view)->buf;
+    if (offset == 0 && length == PyMemoryView_GET_BUFFER(view)->len)
+        return view;
+    ret = PySequence_GetSlice(view, offset, offset + length);
+    Py_DECREF(view);
+    return ret;
+}
+
+/* Move the ring into a new array of new_length slots, starting at index 0.
+ * Scan cursors are relative to start_idx, so they stay valid. Returns -1,
+ * leaving the ring alone, if the allocation fails. */
+static int
+BufferQueue_resize(BufferQueue *self, Py_ssize_t new_length)
+{
+    BufferQueueChunk *l_buffer;
+    Py_ssize_t width = sizeof(*self->buffer), split;
+    if (!(l_buffer = PyMem_New(BufferQueueChunk, new_length)))
+        return -1;
+    if (self->n_items) {
+        if (self->start_idx < self->end_idx) {
+            memcpy(l_buffer, self->buffer + self->start_idx,
+                self->n_items * width);
         } else {
             split = self->buffer_length - self->start_idx;
-            memcpy(l_buffer_end, self->buffer + self->start_idx, split * width);
-            memcpy(l_buffer_end + split, self->buffer, self->end_idx * width);
+            memcpy(l_buffer, self->buffer + self->start_idx, split * width);
+            memcpy(l_buffer + split, self->buffer, self->end_idx * width);
         }
-        PyMem_Free(self->buffer);
-        self->buffer = l_buffer;
-        self->start_idx = self->buffer_length;
-        self->end_idx = 0;
-        self->buffer_length *= 2;
     }
-    self->buffer[self->end_idx] = string;
-    if (++self->end_idx == self->buffer_length)
-        self->end_idx = 0;
-    ++self->n_items;
-    self->tot_length += PyString_GET_SIZE(string);
+    PyMem_Free(self->buffer);
+    if (new_length > self->buffer_length)
+        QBUF_STAT_ADD(self, ring_grows, 1);
+    self->buffer = l_buffer;
+    self->buffer_length = new_length;
+    self->start_idx = 0;
+    self->end_idx = (self->n_items == new_length)? 0 : self->n_items;
     return 0;
 }
 
+/* Give back most of the ring once it has drained well below its size. */
 static void
-BufferQueue_advance_start(BufferQueue *self)
+BufferQueue_maybe_shrink(BufferQueue *self)
 {
-    Py_DECREF(self->buffer[self->start_idx]);
-    self->cur_offset = 0;
-    --self->n_items;
-    if (++self->start_idx == self->buffer_length)
-        self->start_idx = 0;
+    Py_ssize_t new_length = self->buffer_length;
+    while (new_length > self->initial_capacity
+            && self->n_items <= new_length / SHRINK_THRESHOLD)
+        new_length /= SHRINK_FACTOR;
+    if (new_length == self->buffer_length)
+        return;
+    if (new_length < self->initial_capacity)
+        new_length = self->initial_capacity;
+    /* Failing to shrink is harmless; keep the bigger ring. */
+    BufferQueue_resize(self, new_length);
 }
 
-static PyObject *
-BufferQueue_pop(BufferQueue *self, Py_ssize_t length, int as_buffer)
+/* Note that length more bytes have been pushed, and wake up any threads
+ * blocked in pop. */
+static void
+BufferQueue_pushed(BufferQueue *self, Py_ssize_t length)
 {
-    PyObject *ret = NULL, *cur_string;
-    Py_ssize_t copied, to_copy, size, delta;
-    char *ret_dest;
-    if (length == 0) {
-        ret = PyString_FromString("");
-        goto cleanup;
-    }
-
-    cur_string = (PyObject *)self->buffer[self->start_idx];
-    if (self->cur_offset == 0 && PyString_GET_SIZE(cur_string) == length) {
-        ret = (PyObject *)cur_string;
-        Py_INCREF(ret);
-        BufferQueue_advance_start(self);
-    } else if (as_buffer && self->cur_offset + length <=
-            PyString_GET_SIZE(cur_string)) {
-        if (!(ret = PyBuffer_FromObject(cur_string, self->cur_offset, length)))
-            return NULL;
-        if (self->cur_offset + length == PyString_GET_SIZE(cur_string))
-            BufferQueue_advance_start(self);
-        else
-            self->cur_offset += length;
-    } else if (self->cur_offset + length == PyString_GET_SIZE(cur_string)) {
-        if (!(ret = PyString_FromStringAndSize(
-                PyString_AS_STRING(cur_string) + self->cur_offset, length)))
-            return NULL;
-        BufferQueue_advance_start(self);
-    } else {
-        if (!(ret = PyString_FromStringAndSize(NULL, length)))
-            return NULL;
-        ret_dest = PyString_AS_STRING(ret);
-        copied = 0;
-        while (copied < length) {
-            to_copy = length - copied;
-            size = PyString_GET_SIZE(cur_string);
-            if (to_copy + self->cur_offset >= size) {
-                delta = size - self->cur_offset;
-                memcpy(ret_dest + copied,
-                    PyString_AS_STRING(cur_string) + self->cur_offset, delta);
-                BufferQueue_advance_start(self);
-                cur_string = (PyObject *)self->buffer[self->start_idx];
-            } else {
-                delta = to_copy;
-                memcpy(ret_dest + copied,
-                    PyString_AS_STRING(cur_string) + self->cur_offset, delta);
-                self->cur_offset += delta;
-            }
-            copied += delta;
-        }
-    }
-    self->tot_length -= length;
-
-cleanup:
-    if (ret && as_buffer && !PyBuffer_Check(ret)) {
-        PyObject *tmp = ret;
-        /* Implicitly returns NULL on error. */
-        ret = PyBuffer_FromObject(tmp, 0, Py_END_OF_BUFFER);
-        Py_DECREF(tmp);
+    if (self->stats) {
+        self->stats->bytes_pushed += length;
+        if (self->n_items > self->stats->chunks_high_water)
+            self->stats->chunks_high_water = self->n_items;
     }
-    return ret;
+    if (!self->n_waiters)
+        return;
+    qbuf_waitlock_lock(&self->wait_lock);
+    ++self->push_seq;
+    qbuf_waitlock_broadcast(&self->wait_lock);
+    qbuf_waitlock_unlock(&self->wait_lock);
 }
 
+/* Add a chunk to the end of the ring, taking over its reference. On
+ * failure, the reference is released. */
 static int
-BufferQueue_find_delim(BufferQueue *self, PyStringObject *delim_obj)
+BufferQueue_append(BufferQueue *self, BufferQueueChunk chunk)
 {
-    BufferQueueIterator iter, split_iter;
-    Py_ssize_t pos = 0, i, offset, delim_pos;
-    PyObject *tmp = NULL;
-    char *delimiter = PyString_AS_STRING(delim_obj);
-    Py_ssize_t delim_size = PyString_GET_SIZE(delim_obj);
-    if (delim_size > self->tot_length)
+    if (self->n_items == self->buffer_length
+            && BufferQueue_resize(self, self->buffer_length * 2) == -1) {
+        Py_DECREF(chunk.obj);
+        PyErr_SetString(PyExc_MemoryError, "failed to alloc bigger buffer");
         return -1;
+    }
+    self->buffer[self->end_idx] = chunk;
+    if (++self->end_idx == self->buffer_length)
+        self->end_idx = 0;
+    ++self->n_items;
+    self->tot_length += chunk.size;
+    BufferQueue_pushed(self, chunk.size);
+    return 0;
+}
 
-    BufferQueueIterator_init(&iter, self);
-    do {
-        if (!(tmp = PyObject_CallMethod((PyObject *)iter.cur_string, "find",
-                "O" ARG_PY_SSIZE_T, delim_obj, iter.char_idx)))
-            goto cleanup;
-        if ((delim_pos = PyNumber_AsSsize_t(tmp, PyExc_OverflowError)) == -1
-                && PyErr_Occurred())
-            goto cleanup;
-        Py_CLEAR(tmp);
-        if (delim_pos != -1)
-            return pos + delim_pos - iter.char_idx;
-
-        pos += iter.s_size - iter.char_idx;
-        for (offset = 1; offset < delim_size; ++offset) {
-            if (pos + offset > self->tot_length)
-                break;
-            split_iter = iter;
-            split_iter.char_idx = split_iter.s_size - delim_size + offset;
-            for (i = 0; i < delim_size; ++i) {
-                if (delimiter[i] != split_iter.s_ptr[split_iter.char_idx])
-                    break;
-                BufferQueueIterator_advance_char(&split_iter);
+/* Add length bytes which were just written to the tail slab at ptr. If they
+ * directly follow the last chunk in the ring, that chunk is extended
+ * instead of using another slot. */
+static int
+BufferQueue_append_slab(BufferQueue *self, char *ptr, Py_ssize_t length)
+{
+    BufferQueueChunk chunk, *last;
+    if (self->n_items) {
+        last = &self->buffer[(self->end_idx? self->end_idx
+            : self->buffer_length) - 1];
+        if (last->obj == (PyObject *)self->tail_slab
+                && last->ptr + last->size == ptr) {
+            /* A scan cursor at the very end has to stay in front of the
+             * new bytes, which are now part of the last chunk. */
+            if (self->scan_delim && self->scan_chunk == self->n_items) {
+                --self->scan_chunk;
+                self->scan_offset = last->size;
             }
-            if (i == delim_size)
-                return pos - delim_size + offset;
+            last->size += length;
+            self->tot_length += length;
+            BufferQueue_pushed(self, length);
+            return 0;
         }
-    } while(!BufferQueueIterator_advance_string(&iter));
-
-cleanup:
-    Py_XDECREF(tmp);
-    return -1;
+    }
+    chunk.obj = (PyObject *)self->tail_slab;
+    Py_INCREF(chunk.obj);
+    chunk.ptr = ptr;
+    chunk.size = length;
+    return BufferQueue_append(self, chunk);
 }
 
+/* Make sure the tail slab has at least min_free bytes left, switching to a
+ * new slab big enough for want bytes if it doesn't. */
 static int
-BufferQueue_popline(BufferQueue *self, PyStringObject **ret,
-        PyStringObject *delim_obj)
+BufferQueue_reserve_tail(BufferQueue *self, Py_ssize_t min_free,
+        Py_ssize_t want)
 {
-    PyObject *line, *delim;
-    Py_ssize_t line_size;
-    if (!delim_obj)
-        delim_obj = (PyStringObject *)self->delim_obj;
-    if (!delim_obj || !PyString_GET_SIZE(delim_obj)) {
-        PyErr_SetString(PyExc_ValueError, "no delimiter");
+    BufferSlab *slab;
+    if (self->tail_slab
+            && self->tail_slab->capacity - self->tail_used >= min_free)
+        return 0;
+    if (!(slab = BufferSlab_new(want)))
+        return -1;
+    Py_XDECREF(self->tail_slab);
+    self->tail_slab = slab;
+    self->tail_used = 0;
+    return 0;
+}
+
+/* Claim up to *max_bytes of free memory at the end of the tail slab (at
+ * least min_read, unless *max_bytes is smaller) for a read done with the
+ * GIL released, shrinking *max_bytes to what was claimed. The memory is
+ * taken out of the tail slab straight away, so pushes made meanwhile go
+ * after it, and *slab gets a reference to keep it alive. */
+static char *
+BufferQueue_claim_read(BufferQueue *self, Py_ssize_t *max_bytes,
+        BufferSlab **slab)
+{
+    char *dest;
+    if (BufferQueue_reserve_tail(self,
+            *max_bytes < SLAB_MIN_READ? *max_bytes : SLAB_MIN_READ,
+            *max_bytes))
+        return NULL;
+    *slab = self->tail_slab;
+    Py_INCREF(*slab);
+    if (*max_bytes > (*slab)->capacity - self->tail_used)
+        *max_bytes = (*slab)->capacity - self->tail_used;
+    dest = (*slab)->data + self->tail_used;
+    self->tail_used += *max_bytes;
+    return dest;
+}
+
+/* Add the n_read bytes read into memory claimed by BufferQueue_claim_read
+ * to the buffer, and give back the rest of the claimed bytes if nothing
+ * was put after them. Drops the reference to slab. */
+static int
+BufferQueue_finish_read(BufferQueue *self, BufferSlab *slab, char *dest,
+        Py_ssize_t claimed, Py_ssize_t n_read)
+{
+    BufferQueueChunk chunk;
+    int result = 0;
+    if (n_read < 0)
+        n_read = 0;
+    if (slab == self->tail_slab
+            && dest + claimed == slab->data + self->tail_used)
+        self->tail_used -= claimed - n_read;
+    if (n_read && slab == self->tail_slab)
+        result = BufferQueue_append_slab(self, dest, n_read);
+    else if (n_read) {
+        chunk.obj = (PyObject *)slab;
+        Py_INCREF(chunk.obj);
+        chunk.ptr = dest;
+        chunk.size = n_read;
+        result = BufferQueue_append(self, chunk);
+    }
+    Py_DECREF(slab);
+    return result;
+}
+
+static int
+BufferQueue_push(BufferQueue *self, PyObject *obj)
+{
+    BufferQueueChunk chunk;
+    char *dest;
+    if (BufferQueueChunk_init(&chunk, obj) == -1)
+        return -1;
+    if (chunk.size == 0) {
+        Py_DECREF(chunk.obj);
+        return 0;
+    }
+    if (chunk.size >= self->coalesce_below)
+        return BufferQueue_append(self, chunk);
+
+    /* Small pushes get copied onto the end of the tail slab, so that a
+     * run of them only takes up one slot in the ring. A recv_from in
+     * progress has already claimed the memory it's reading into, so
+     * they go after it. */
+    if (BufferQueue_reserve_tail(self, chunk.size, self->coalesce_below)) {
+        Py_DECREF(chunk.obj);
+        return -1;
+    }
+    dest = self->tail_slab->data + self->tail_used;
+    memcpy(dest, chunk.ptr, chunk.size);
+    self->tail_used += chunk.size;
+    Py_DECREF(chunk.obj);
+    return BufferQueue_append_slab(self, dest, chunk.size);
+}
+
+/* Put obj's data at the front of the buffer. Whatever was already popped
+ * from the first chunk is trimmed off it, so cur_offset can go back to 0
+ * for the new chunk. */
+static int
+BufferQueue_push_front(BufferQueue *self, PyObject *obj)
+{
+    BufferQueueChunk chunk, *first;
+    if (BufferQueueChunk_init(&chunk, obj) == -1)
+        return -1;
+    if (chunk.size == 0) {
+        Py_DECREF(chunk.obj);
+        return 0;
+    }
+    if (self->n_items == self->buffer_length
+            && BufferQueue_resize(self, self->buffer_length * 2) == -1) {
+        Py_DECREF(chunk.obj);
+        PyErr_SetString(PyExc_MemoryError, "failed to alloc bigger buffer");
+        return -1;
+    }
+    if (self->n_items && self->cur_offset) {
+        first = &self->buffer[self->start_idx];
+        first->ptr += self->cur_offset;
+        first->size -= self->cur_offset;
+        self->cur_offset = 0;
+    }
+    if (--self->start_idx < 0)
+        self->start_idx = self->buffer_length - 1;
+    self->buffer[self->start_idx] = chunk;
+    ++self->n_items;
+    self->tot_length += chunk.size;
+    ++self->generation;
+    BufferQueue_reset_scan(self);
+    BufferQueue_pushed(self, chunk.size);
+    return 0;
+}
+
+static void
+BufferQueue_advance_start(BufferQueue *self)
+{
+    Py_DECREF(self->buffer[self->start_idx].obj);
+    self->cur_offset = 0;
+    --self->n_items;
+    if (++self->start_idx == self->buffer_length)
+        self->start_idx = 0;
+    if (self->scan_delim && self->scan_chunk-- == 0)
+        BufferQueue_reset_scan(self);
+}
+
+/* Account for length bytes having been taken off the front of the buffer. */
+static void
+BufferQueue_consumed(BufferQueue *self, Py_ssize_t length)
+{
+    QBUF_STAT_ADD(self, bytes_popped, length);
+    self->tot_length -= length;
+    if (length)
+        ++self->generation;
+    if (self->scan_delim) {
+        if (length > self->scan_pos)
+            BufferQueue_reset_scan(self);
+        else
+            self->scan_pos -= length;
+    }
+    BufferQueue_maybe_shrink(self);
+}
+
+/* Count a pop in the histogram of how much was buffered. */
+static void
+BufferQueue_stat_pop(BufferQueue *self)
+{
+    Py_ssize_t buffered = self->tot_length;
+    int bucket = 0;
+    while (buffered) {
+        buffered >>= 1;
+        ++bucket;
+    }
+    ++self->stats->buffered_histogram[bucket];
+}
+
+static PyObject *
+BufferQueue_pop(BufferQueue *self, Py_ssize_t length, int as_buffer)
+{
+    PyObject *ret = NULL;
+    BufferQueueChunk *cur_chunk;
+    Py_ssize_t copied, to_copy, delta;
+    char *ret_dest;
+    if (length == 0) {
+        ret = PyBytes_FromString("");
+        goto cleanup;
+    }
+    if (self->stats)
+        BufferQueue_stat_pop(self);
+
+    cur_chunk = &self->buffer[self->start_idx];
+    if (self->cur_offset == 0 && cur_chunk->size == length
+            && PyBytes_Check(cur_chunk->obj)
+            && PyBytes_GET_SIZE(cur_chunk->obj) == length) {
+        ret = cur_chunk->obj;
+        Py_INCREF(ret);
+        BufferQueue_advance_start(self);
+        QBUF_STAT_ADD(self, zero_copy_pops, 1);
+    } else if (as_buffer && self->cur_offset + length <= cur_chunk->size) {
+        if (!(ret = BufferQueueChunk_view(cur_chunk, self->cur_offset, length)))
+            return NULL;
+        QBUF_STAT_ADD(self, zero_copy_pops, 1);
+        if (self->cur_offset + length == cur_chunk->size)
+            BufferQueue_advance_start(self);
+        else
+            self->cur_offset += length;
+    } else if (self->cur_offset + length == cur_chunk->size) {
+        if (!(ret = PyBytes_FromStringAndSize(
+                cur_chunk->ptr + self->cur_offset, length)))
+            return NULL;
+        BufferQueue_advance_start(self);
+        QBUF_STAT_ADD(self, copied_bytes, length);
+    } else {
+        QBUF_STAT_ADD(self, copied_bytes, length);
+        if (!(ret = PyBytes_FromStringAndSize(NULL, length)))
+            return NULL;
+        ret_dest = PyBytes_AS_STRING(ret);
+        copied = 0;
+        while (copied < length) {
+            to_copy = length - copied;
+            if (to_copy + self->cur_offset >= cur_chunk->size) {
+                delta = cur_chunk->size - self->cur_offset;
+                memcpy(ret_dest + copied,
+                    cur_chunk->ptr + self->cur_offset, delta);
+                BufferQueue_advance_start(self);
+                cur_chunk = &self->buffer[self->start_idx];
+            } else {
+                delta = to_copy;
+                memcpy(ret_dest + copied,
+                    cur_chunk->ptr + self->cur_offset, delta);
+                self->cur_offset += delta;
+            }
+            copied += delta;
+        }
+    }
+    BufferQueue_consumed(self, length);
+
+cleanup:
+    if (ret && as_buffer && !BufferView_Check(ret)) {
+        PyObject *tmp = ret;
+        /* Implicitly returns NULL on error. */
+#if PY_MAJOR_VERSION >= 3
+        ret = PyMemoryView_FromObject(tmp);
+#else
+        ret = PyBuffer_FromObject(tmp, 0, Py_END_OF_BUFFER);
+#endif
+        Py_DECREF(tmp);
+    }
+    return ret;
+}
+
+/* Drop some bytes off the front of the buffer without copying them. */
+static void
+BufferQueue_skip(BufferQueue *self, Py_ssize_t length)
+{
+    Py_ssize_t left = length, delta;
+    while (left) {
+        delta = self->buffer[self->start_idx].size - self->cur_offset;
+        if (left >= delta) {
+            BufferQueue_advance_start(self);
+            left -= delta;
+        } else {
+            self->cur_offset += left;
+            left = 0;
+        }
+    }
+    BufferQueue_consumed(self, length);
+}
+
+/* Copy length bytes off the front of the buffer into dest and drop the drop
+ * bytes after them, releasing the GIL for the copy. All of the bytes are
+ * taken off the buffer first, and references to their chunks are held
+ * while they are copied out, so other threads can push or pop freely. */
+static int
+BufferQueue_copy_released(BufferQueue *self, char *dest, Py_ssize_t length,
+        Py_ssize_t drop)
+{
+    BufferQueueIterator iter;
+    BufferQueueChunk *chunks;
+    Py_ssize_t n_chunks = 0, left, i, delta;
+
+    BufferQueueIterator_init(&iter, self);
+    for (left = length; left > 0; ++n_chunks) {
+        if ((left -= iter.s_size - iter.char_idx) > 0)
+            BufferQueueIterator_advance_string(&iter);
+    }
+    if (!(chunks = PyMem_New(BufferQueueChunk, n_chunks))) {
+        PyErr_NoMemory();
         return -1;
     }
-    if ((line_size = BufferQueue_find_delim(self, delim_obj)) == -1)
+    BufferQueueIterator_init(&iter, self);
+    for (i = 0, left = length; i < n_chunks; ++i) {
+        delta = iter.s_size - iter.char_idx;
+        if (delta > left)
+            delta = left;
+        chunks[i].obj = iter.cur_chunk->obj;
+        Py_INCREF(chunks[i].obj);
+        chunks[i].ptr = iter.s_ptr + iter.char_idx;
+        chunks[i].size = delta;
+        if (left -= delta)
+            BufferQueueIterator_advance_string(&iter);
+    }
+    if (self->stats) {
+        BufferQueue_stat_pop(self);
+        self->stats->copied_bytes += length;
+    }
+    BufferQueue_skip(self, length + drop);
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n_chunks; ++i) {
+        memcpy(dest, chunks[i].ptr, chunks[i].size);
+        dest += chunks[i].size;
+    }
+    Py_END_ALLOW_THREADS
+    for (i = 0; i < n_chunks; ++i)
+        Py_DECREF(chunks[i].obj);
+    PyMem_Free(chunks);
+    return 0;
+}
+
+/* Pop length bytes as BufferQueue_pop does, then drop the drop bytes after
+ * them (a line's delimiter, say) just by moving the start of the buffer on.
+ * Once release_gil_above says the copy is big enough, it is done by
+ * BufferQueue_copy_released instead. */
+static PyObject *
+BufferQueue_pop_released(BufferQueue *self, Py_ssize_t length,
+        Py_ssize_t drop)
+{
+    BufferQueueChunk *first = &self->buffer[self->start_idx];
+    PyObject *ret;
+    if (!self->release_gil_above || length < self->release_gil_above
+            || (self->cur_offset == 0 && first->size == length
+                && PyBytes_Check(first->obj)
+                && PyBytes_GET_SIZE(first->obj) == length)) {
+        if ((ret = BufferQueue_pop(self, length, 0)) && drop)
+            BufferQueue_skip(self, drop);
+        return ret;
+    }
+
+    if (!(ret = PyBytes_FromStringAndSize(NULL, length)))
+        return NULL;
+    if (BufferQueue_copy_released(self, PyBytes_AS_STRING(ret), length,
+            drop) == -1) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/* Block until the buffer holds at least length bytes, or until timeout
+ * seconds have passed if timeout isn't negative. The GIL is released while
+ * waiting, and pushes from other threads wake the wait up; it's taken back
+ * every WAIT_SLICE to run signal handlers. Returns 0 once there is enough
+ * data, 1 on timing out, and -1 on error. */
+static int
+BufferQueue_wait(BufferQueue *self, Py_ssize_t length, double timeout)
+{
+    qbuf_deadline deadline;
+    double end = 0, left, slice;
+    Py_ssize_t seq;
+    if (!self->wait_ready) {
+        if (qbuf_waitlock_init(&self->wait_lock)) {
+            PyErr_SetString(PyExc_RuntimeError, "failed to create a lock");
+            return -1;
+        }
+        self->wait_ready = 1;
+    }
+    if (timeout >= 0)
+        end = qbuf_monotonic() + timeout;
+
+    while (self->tot_length < length) {
+        slice = WAIT_SLICE / 1000.0;
+        if (timeout >= 0) {
+            if ((left = end - qbuf_monotonic()) <= 0)
+                return 1;
+            if (slice > left)
+                slice = left;
+        }
+        seq = self->push_seq;
+        ++self->n_waiters;
+        qbuf_deadline_set(&deadline, slice);
+        Py_BEGIN_ALLOW_THREADS
+        qbuf_waitlock_lock(&self->wait_lock);
+        while (self->push_seq == seq
+                && !qbuf_waitlock_wait(&self->wait_lock, &deadline))
+            ;
+        qbuf_waitlock_unlock(&self->wait_lock);
+        Py_END_ALLOW_THREADS
+        --self->n_waiters;
+        if (PyErr_CheckSignals())
+            return -1;
+    }
+    return 0;
+}
+
+/* Copy length bytes starting at the iterator's position into dest. */
+static void
+BufferQueueIterator_copy_out(BufferQueueIterator iter, char *dest,
+        Py_ssize_t length)
+{
+    Py_ssize_t delta;
+    for (;;) {
+        delta = iter.s_size - iter.char_idx;
+        if (delta > length)
+            delta = length;
+        memcpy(dest, iter.s_ptr + iter.char_idx, delta);
+        dest += delta;
+        if (!(length -= delta))
+            break;
+        BufferQueueIterator_advance_string(&iter);
+    }
+}
+
+/* Copy the first length bytes of the buffer into dest, leaving them in the
+ * buffer. */
+static void
+BufferQueue_copy_out(BufferQueue *self, char *dest, Py_ssize_t length)
+{
+    BufferQueueIterator iter;
+    if (!length)
+        return;
+    BufferQueueIterator_init(&iter, self);
+    BufferQueueIterator_copy_out(iter, dest, length);
+}
+
+/* Pop length bytes into dest instead of a new bytes object, then drop the
+ * drop bytes after them. */
+static int
+BufferQueue_pop_into(BufferQueue *self, char *dest, Py_ssize_t length,
+        Py_ssize_t drop)
+{
+    if (!length) {
+        if (drop)
+            BufferQueue_skip(self, drop);
         return 0;
+    }
+    if (self->release_gil_above && length >= self->release_gil_above)
+        return BufferQueue_copy_released(self, dest, length, drop);
+    if (self->stats) {
+        BufferQueue_stat_pop(self);
+        self->stats->copied_bytes += length;
+    }
+    BufferQueue_copy_out(self, dest, length);
+    BufferQueue_skip(self, length + drop);
+    return 0;
+}
+
+/* Build a tuple of views covering the first length bytes of the buffer,
+ * one per chunk, and drop those bytes if consume is set. */
+static PyObject *
+BufferQueue_iov(BufferQueue *self, Py_ssize_t length, int consume)
+{
+    PyObject *ret, *view;
+    BufferQueueIterator iter;
+    Py_ssize_t n_views = 0, left = length, delta;
+    if (length == 0)
+        return PyTuple_New(0);
+
+    BufferQueueIterator_init(&iter, self);
+    for (;;) {
+        ++n_views;
+        if ((left -= iter.s_size - iter.char_idx) <= 0)
+            break;
+        BufferQueueIterator_advance_string(&iter);
+    }
+    if (!(ret = PyTuple_New(n_views)))
+        return NULL;
+
+    BufferQueueIterator_init(&iter, self);
+    left = length;
+    for (n_views = 0; left; ++n_views) {
+        delta = iter.s_size - iter.char_idx;
+        if (delta > left)
+            delta = left;
+        if (!(view = BufferQueueChunk_view(iter.cur_chunk, iter.char_idx,
+                delta))) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(ret, n_views, view);
+        if (left -= delta)
+            BufferQueueIterator_advance_string(&iter);
+    }
+
+    if (consume)
+        BufferQueue_skip(self, length);
+    return ret;
+}
+
+static void
+qbuf_horspool_init(Py_ssize_t *skip, const char *needle, Py_ssize_t n)
+{
+    Py_ssize_t i;
+    for (i = 0; i < 256; ++i)
+        skip[i] = n;
+    for (i = 0; i < n - 1; ++i)
+        skip[(unsigned char)needle[i]] = n - 1 - i;
+}
+
+/* Find the first complete occurrence of needle in [hay, hay + size). skip is
+ * a Horspool table for the needle, built on demand when *have_skip is 0. The
+ * C library's memchr does the first-byte filtering; on most platforms it is
+ * vectorized and picks the widest instruction set available at runtime. */
+static const char *
+qbuf_search(const char *hay, Py_ssize_t size, const char *needle,
+        Py_ssize_t n, Py_ssize_t *skip, int *have_skip)
+{
+    const char *end = hay + size - n + 1, *cur = hay;
+    unsigned char last;
+    if (size < n)
+        return NULL;
+    if (n == 1)
+        return memchr(hay, needle[0], size);
+
+    if (n >= HORSPOOL_MIN_DELIM && size >= HORSPOOL_MIN_HAYSTACK) {
+        if (!*have_skip) {
+            qbuf_horspool_init(skip, needle, n);
+            *have_skip = 1;
+        }
+        last = (unsigned char)needle[n - 1];
+        while (cur < end) {
+            if ((unsigned char)cur[n - 1] == last
+                    && !memcmp(cur, needle, n - 1))
+                return cur;
+            cur += skip[(unsigned char)cur[n - 1]];
+        }
+        return NULL;
+    }
+
+    while (cur < end && (cur = memchr(cur, needle[0], end - cur))) {
+        if (!memcmp(cur + 1, needle + 1, n - 1))
+            return cur;
+        ++cur;
+    }
+    return NULL;
+}
+
+/* Compare the delimiter against the buffer starting at the iterator's
+ * position. Returns 1 on a full match, 0 on a mismatch, and -1 if the buffer
+ * ran out while everything so far matched. */
+static int
+BufferQueue_match_at(BufferQueueIterator iter, const char *delimiter,
+        Py_ssize_t delim_size)
+{
+    Py_ssize_t i;
+    for (i = 0; i < delim_size; ++i) {
+        if (delimiter[i] != iter.s_ptr[iter.char_idx])
+            return 0;
+        if (BufferQueueIterator_advance_char(&iter) && i + 1 < delim_size)
+            return -1;
+    }
+    return 1;
+}
+
+static void
+BufferQueue_set_scan(BufferQueue *self, PyObject *delim_obj,
+        BufferQueueIterator *iter, Py_ssize_t pos)
+{
+    if (self->scan_delim != delim_obj) {
+        Py_XDECREF(self->scan_delim);
+        self->scan_delim = delim_obj;
+        Py_INCREF(self->scan_delim);
+    }
+    self->scan_pos = pos;
+    if (pos == self->tot_length) {
+        /* The iterator ran off the end; when the ring is full, end_idx is
+         * the same as start_idx, so don't derive the chunk from it. */
+        self->scan_chunk = self->n_items;
+        self->scan_offset = 0;
+        return;
+    }
+    self->scan_chunk = iter->string_idx - self->start_idx;
+    if (self->scan_chunk < 0)
+        self->scan_chunk += self->buffer_length;
+    self->scan_offset = iter->char_idx;
+}
+
+/* Point iter at the scan cursor and return the cursor's position. */
+static Py_ssize_t
+BufferQueue_scan_iter(BufferQueue *self, BufferQueueIterator *iter)
+{
+    Py_ssize_t chunk = self->start_idx + self->scan_chunk;
+    if (chunk >= self->buffer_length)
+        chunk -= self->buffer_length;
+    iter->parent = self;
+    iter->string_idx = chunk;
+    iter->char_idx = self->scan_offset;
+    BufferQueueIterator_update(iter);
+    return self->scan_pos;
+}
+
+/* Move the scan cursor, which must be on a delimiter just found by
+ * BufferQueue_find_delim, past the end of that delimiter. */
+static void
+BufferQueue_scan_past_delim(BufferQueue *self, Py_ssize_t delim_size)
+{
+    BufferQueueIterator iter;
+    Py_ssize_t left = delim_size;
+    BufferQueue_scan_iter(self, &iter);
+    while (left >= iter.s_size - iter.char_idx) {
+        left -= iter.s_size - iter.char_idx;
+        if (BufferQueueIterator_advance_string(&iter))
+            break;
+    }
+    iter.char_idx += left;
+    BufferQueue_set_scan(self, self->scan_delim, &iter,
+        self->scan_pos + delim_size);
+}
+
+/* Search for a delimiter starting from iter, which is *pos bytes into the
+ * buffer. Returns 1 if it was found, with iter and *pos moved to the match;
+ * otherwise returns 0 with them moved to where a match could still begin
+ * once more data arrives. */
+static int
+BufferQueue_search_from(BufferQueueIterator *iter, Py_ssize_t *pos,
+        const char *delimiter, Py_ssize_t delim_size)
+{
+    BufferQueueIterator split_iter;
+    Py_ssize_t skip[256];
+    int have_skip = 0;
+    const char *cur, *end, *found;
+
+    do {
+        cur = iter->s_ptr + iter->char_idx;
+        end = iter->s_ptr + iter->s_size;
+        if ((found = qbuf_search(cur, end - cur, delimiter, delim_size,
+                skip, &have_skip))) {
+            *pos += found - cur;
+            iter->char_idx = found - iter->s_ptr;
+            return 1;
+        }
+
+        /* Only matches straddling the end of this chunk are left; find their
+         * candidate starts by the first byte and finish them byte-wise. */
+        if (end - cur >= delim_size) {
+            *pos += end - cur - delim_size + 1;
+            cur = end - delim_size + 1;
+        }
+        while (cur < end && (found = memchr(cur, delimiter[0], end - cur))) {
+            *pos += found - cur;
+            split_iter = *iter;
+            split_iter.char_idx = found - iter->s_ptr;
+            switch (BufferQueue_match_at(split_iter, delimiter, delim_size)) {
+            case 1:
+                *iter = split_iter;
+                return 1;
+            case -1:
+                *iter = split_iter;
+                return 0;
+            }
+            cur = found + 1;
+            ++*pos;
+        }
+        *pos += end - cur;
+    } while (!BufferQueueIterator_advance_string(iter));
+    return 0;
+}
+
+/* Run BufferQueue_search_from with the GIL released. The search goes over
+ * a copy of the ring from iter's chunk on, holding references to those
+ * chunks, so that pushes from another thread can't move them and pops
+ * can't free them. Afterwards iter is pointed back into the ring. Returns
+ * -1, leaving iter and *pos alone, if data was taken off the buffer in the
+ * meantime or the copy couldn't be made. */
+static int
+BufferQueue_search_released(BufferQueue *self, BufferQueueIterator *iter,
+        Py_ssize_t *pos, const char *delimiter, Py_ssize_t delim_size)
+{
+    BufferQueue shadow;
+    BufferQueueIterator shadow_iter;
+    Py_ssize_t first, n_chunks, i, found_pos = *pos;
+    Py_ssize_t generation = self->generation;
+    int found;
+    if ((first = iter->string_idx - self->start_idx) < 0)
+        first += self->buffer_length;
+    n_chunks = self->n_items - first;
+    if (!(shadow.buffer = PyMem_New(BufferQueueChunk, n_chunks + 1)))
+        return -1;
+    for (i = 0; i < n_chunks; ++i) {
+        shadow.buffer[i] = self->buffer[
+            (self->start_idx + first + i) % self->buffer_length];
+        Py_INCREF(shadow.buffer[i].obj);
+    }
+    shadow.buffer_length = n_chunks + 1;
+    shadow.end_idx = n_chunks;
+    shadow_iter = *iter;
+    shadow_iter.parent = &shadow;
+    shadow_iter.string_idx = 0;
+    BufferQueueIterator_update(&shadow_iter);
+
+    Py_BEGIN_ALLOW_THREADS
+    found = BufferQueue_search_from(&shadow_iter, &found_pos,
+        delimiter, delim_size);
+    Py_END_ALLOW_THREADS
+    for (i = 0; i < n_chunks; ++i)
+        Py_DECREF(shadow.buffer[i].obj);
+
+    if (generation != self->generation) {
+        PyMem_Free(shadow.buffer);
+        return -1;
+    }
+    if (shadow_iter.string_idx == n_chunks) {
+        /* The search ran off the end. Stay at the end of the last chunk
+         * searched, since it may have been extended since. */
+        shadow_iter.string_idx = n_chunks - 1;
+        shadow_iter.char_idx = shadow.buffer[n_chunks - 1].size;
+    }
+    iter->string_idx = (self->start_idx + first + shadow_iter.string_idx)
+        % self->buffer_length;
+    iter->char_idx = shadow_iter.char_idx;
+    BufferQueueIterator_update(iter);
+    *pos = found_pos;
+    PyMem_Free(shadow.buffer);
+    return found;
+}
+
+static Py_ssize_t
+BufferQueue_find_delim(BufferQueue *self, PyObject *delim_obj)
+{
+    BufferQueueIterator iter;
+    Py_ssize_t pos = 0, start_pos;
+    int found;
+    char *delimiter = PyBytes_AS_STRING(delim_obj);
+    Py_ssize_t delim_size = PyBytes_GET_SIZE(delim_obj);
+    if (delim_size > self->tot_length)
+        return -1;
+
+    if (self->scan_delim && (self->scan_delim == delim_obj || (
+            PyBytes_Check(self->scan_delim)
+            && PyBytes_GET_SIZE(self->scan_delim) == delim_size && !memcmp(
+                PyBytes_AS_STRING(self->scan_delim), delimiter, delim_size)))) {
+        /* Resume where the last unsuccessful scan left off. */
+        if (self->scan_pos + delim_size > self->tot_length)
+            return -1;
+        pos = BufferQueue_scan_iter(self, &iter);
+    } else
+        BufferQueueIterator_init(&iter, self);
+    start_pos = pos;
+
+    if (!self->release_gil_above
+            || self->tot_length - pos < self->release_gil_above) {
+        found = BufferQueue_search_from(&iter, &pos, delimiter, delim_size);
+        BufferQueue_set_scan(self, delim_obj, &iter, pos);
+        QBUF_STAT_ADD(self, scanned_bytes, pos - start_pos);
+        return found? pos : -1;
+    }
+
+    /* The caller may only have a borrowed reference, which another thread
+     * could drop by changing the delimiter. Once the scan cursor is set,
+     * scan_delim keeps the delimiter alive for the caller again. */
+    Py_INCREF(delim_obj);
+    found = BufferQueue_search_released(self, &iter, &pos,
+        delimiter, delim_size);
+    if (found == -1) {
+        /* Start over with the GIL held. */
+        if (delim_size > self->tot_length) {
+            Py_DECREF(delim_obj);
+            return -1;
+        }
+        BufferQueueIterator_init(&iter, self);
+        pos = start_pos = 0;
+        found = BufferQueue_search_from(&iter, &pos, delimiter, delim_size);
+    }
+    BufferQueue_set_scan(self, delim_obj, &iter, pos);
+    QBUF_STAT_ADD(self, scanned_bytes, pos - start_pos);
+    Py_DECREF(delim_obj);
+    return found? pos : -1;
+}
 
-    if (!(line = BufferQueue_pop(self, line_size, 0)))
+/* Find the earliest occurrence of any delimiter in the delimiter set,
+ * preferring the longest where several start at the same place. Bytes that
+ * can't start a delimiter are skipped with a table lookup. If a delimiter
+ * might match but runs off the end of the buffered data, the search stops
+ * there, since a longer or earlier match could still complete. The scan
+ * cursor is kept exactly as for a single delimiter. */
+static Py_ssize_t
+BufferQueue_find_delim_set(BufferQueue *self, PyObject **matched)
+{
+    BufferQueueIterator iter, split_iter;
+    PyObject *delims = self->delim_set, *delim;
+    Py_ssize_t pos = 0, i, n_delims = PyTuple_GET_SIZE(delims), delim_size;
+    const char *cur, *end, *delimiter;
+    int result;
+    if (self->delim_set_min > self->tot_length)
         return -1;
-    if (!(delim = BufferQueue_pop(self, PyString_GET_SIZE(delim_obj), 0)))
+
+    if (self->scan_delim == delims) {
+        if (self->scan_pos + self->delim_set_min > self->tot_length)
+            return -1;
+        pos = BufferQueue_scan_iter(self, &iter);
+    } else
+        BufferQueueIterator_init(&iter, self);
+
+    do {
+        cur = iter.s_ptr + iter.char_idx;
+        end = iter.s_ptr + iter.s_size;
+        for (; cur < end; ++cur, ++pos) {
+            if (!self->delim_set_first[(unsigned char)*cur])
+                continue;
+            split_iter = iter;
+            split_iter.char_idx = cur - iter.s_ptr;
+            for (i = 0; i < n_delims; ++i) {
+                delim = PyTuple_GET_ITEM(delims, i);
+                delimiter = PyBytes_AS_STRING(delim);
+                delim_size = PyBytes_GET_SIZE(delim);
+                if (delimiter[0] != *cur)
+                    continue;
+                if (end - cur >= delim_size)
+                    result = !memcmp(cur, delimiter, delim_size);
+                else
+                    result = BufferQueue_match_at(
+                        split_iter, delimiter, delim_size);
+                if (result) {
+                    BufferQueue_set_scan(self, delims, &split_iter, pos);
+                    if (result == -1)
+                        return -1;
+                    *matched = delim;
+                    return pos;
+                }
+            }
+        }
+    } while (!BufferQueueIterator_advance_string(&iter));
+
+    BufferQueue_set_scan(self, delims, &iter, pos);
+    return -1;
+}
+
+/* Work out what ends a line: delim_obj if it was given, or else the
+ * delimiter set or the delimiter. Returns a borrowed reference to bytes or
+ * to the delimiter set tuple, or NULL with ValueError set if there is
+ * nothing to split on. */
+static PyObject *
+BufferQueue_line_delim(BufferQueue *self, PyObject *delim_obj)
+{
+    if (!delim_obj)
+        delim_obj = self->delim_set? self->delim_set : self->delim_obj;
+    if (!delim_obj || (PyBytes_Check(delim_obj)
+            && !PyBytes_GET_SIZE(delim_obj))) {
+        PyErr_SetString(PyExc_ValueError, "no delimiter");
+        return NULL;
+    }
+    return delim_obj;
+}
+
+/* Find the end of the next line for something returned by
+ * BufferQueue_line_delim. Returns the line's length, or -1 if there is no
+ * complete line, and sets *matched to the (borrowed) delimiter found. */
+static Py_ssize_t
+BufferQueue_find_line(BufferQueue *self, PyObject *delim_obj,
+        PyObject **matched)
+{
+    if (delim_obj == self->delim_set)
+        return BufferQueue_find_delim_set(self, matched);
+    *matched = delim_obj;
+    return BufferQueue_find_delim(self, delim_obj);
+}
+
+/* Pop the next line into *ret, returning 1, or return 0 if there isn't a
+ * complete one. On success *matched is a new reference to the delimiter
+ * that ended the line; the line is copied out and the delimiter dropped in
+ * a single pass from the front of the buffer. */
+static int
+BufferQueue_popline(BufferQueue *self, PyObject **ret,
+        PyObject *delim_obj, PyObject **matched)
+{
+    Py_ssize_t line_size;
+    if (!(delim_obj = BufferQueue_line_delim(self, delim_obj)))
+        return -1;
+    if ((line_size = BufferQueue_find_line(self, delim_obj, matched)) == -1)
+        return 0;
+
+    /* Another thread could change the delimiter while the GIL is released
+     * for the copy. */
+    Py_INCREF(*matched);
+    if (!(*ret = BufferQueue_pop_released(self, line_size,
+            PyBytes_GET_SIZE(*matched)))) {
+        Py_DECREF(*matched);
+        return -1;
+    }
+    return 1;
+}
+
+static void
+BufferQueue_clear_buffer(BufferQueue *self)
+{
+    Py_ssize_t count, index = self->start_idx;
+    for (count = 0; count < self->n_items; ++count) {
+        Py_DECREF(self->buffer[index].obj);
+        if (++index == self->buffer_length)
+            index = 0;
+    }
+}
+
+static void
+BufferQueue_dealloc(BufferQueue *self)
+{
+    BufferQueue_clear_buffer(self);
+    PyMem_Free(self->buffer);
+    Py_CLEAR(self->delim_obj);
+    Py_CLEAR(self->delim_set);
+    Py_CLEAR(self->scan_delim);
+    Py_CLEAR(self->tail_slab);
+    Py_CLEAR(self->reserved_slab);
+    if (self->wait_ready)
+        qbuf_waitlock_destroy(&self->wait_lock);
+    PyMem_Free(self->stats);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+BufferQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    BufferQueue *self;
+
+    if ((self = (BufferQueue *)type->tp_alloc(type, 0))) {
+        self->buffer = NULL;
+        self->start_idx = self->end_idx = 0;
+        self->delim_obj = self->delim_set = NULL;
+        self->delim_set_min = 0;
+        self->n_items = self->tot_length = self->cur_offset = 0;
+        self->scan_delim = NULL;
+        self->scan_chunk = self->scan_offset = self->scan_pos = 0;
+        self->tail_slab = NULL;
+        self->tail_used = 0;
+        self->recv_busy = 0;
+        self->reserved_slab = NULL;
+        self->reserved_ptr = NULL;
+        self->reserved_size = 0;
+        self->coalesce_below = 0;
+        self->generation = 0;
+        self->release_gil_above = 0;
+        self->wait_ready = self->n_waiters = 0;
+        self->push_seq = 0;
+        self->stats = NULL;
+        self->buffer_length = self->initial_capacity = 0;
+    }
+
+    return (PyObject *)self;
+}
+
+static int BufferQueue_setdelim(BufferQueue *, PyObject *, void *);
+static int BufferQueue_setdelims(BufferQueue *, PyObject *, void *);
+
+static int
+BufferQueue_init(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {
+        "delimiter", "coalesce_below", "initial_capacity", "delimiters",
+        "release_gil_above", "stats", NULL};
+    PyObject *delim_tmp = Py_None, *delims_tmp = Py_None;
+    Py_ssize_t coalesce_below = 0, initial_capacity = INITIAL_BUFFER_SIZE;
+    Py_ssize_t release_gil_above = 0;
+    int stats = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "|O" ARG_PY_SSIZE_T ARG_PY_SSIZE_T "O" ARG_PY_SSIZE_T "i", kwlist,
+            &delim_tmp, &coalesce_below, &initial_capacity, &delims_tmp,
+            &release_gil_above, &stats))
+        return -1;
+    if (delims_tmp != Py_None && delim_tmp != Py_None
+            && !(PyBytes_Check(delim_tmp) && !PyBytes_GET_SIZE(delim_tmp))) {
+        PyErr_SetString(PyExc_TypeError,
+            "only one of delimiter and delimiters may be given");
+        return -1;
+    }
+    if (coalesce_below < 0) {
+        PyErr_SetString(PyExc_ValueError, "coalesce_below must not be negative");
+        return -1;
+    }
+    if (initial_capacity < 1) {
+        PyErr_SetString(PyExc_ValueError, "initial_capacity must be positive");
+        return -1;
+    }
+    if (release_gil_above < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "release_gil_above must not be negative");
+        return -1;
+    }
+    self->coalesce_below = coalesce_below;
+    self->release_gil_above = release_gil_above;
+    if (stats && !self->stats) {
+        if (!(self->stats = PyMem_New(BufferQueueStats, 1))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memset(self->stats, 0, sizeof(*self->stats));
+    }
+
+    if (BufferQueue_setdelim(self, delim_tmp, NULL) == -1)
+        return -1;
+    if (delims_tmp != Py_None
+            && BufferQueue_setdelims(self, delims_tmp, NULL) == -1)
+        return -1;
+
+    self->buffer_length = self->initial_capacity = initial_capacity;
+    if (!(self->buffer = PyMem_New(BufferQueueChunk, self->buffer_length))) {
+        PyErr_SetString(PyExc_MemoryError, "malloc of buffer failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+static PyObject *
+BufferQueue_getdelim(BufferQueue *self, void *closure)
+{
+    if (!self->delim_obj)
+        return PyBytes_FromString("");
+    else {
+        Py_INCREF(self->delim_obj);
+        return self->delim_obj;
+    }
+}
+
+static int
+BufferQueue_setdelim(BufferQueue *self, PyObject *value, void *closure)
+{
+    if (!PyBytes_Check(value) && value != Py_None) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        return -1;
+    }
+    Py_XDECREF(self->delim_obj);
+    Py_CLEAR(self->delim_set);
+    BufferQueue_reset_scan(self);
+    if (value == Py_None || !PyBytes_GET_SIZE(value)) {
+        self->delim_obj = NULL;
+        return 0;
+    }
+    self->delim_obj = value;
+    Py_INCREF(self->delim_obj);
+    return 0;
+}
+
+static PyObject *
+BufferQueue_getdelims(BufferQueue *self, void *closure)
+{
+    if (!self->delim_set)
+        Py_RETURN_NONE;
+    Py_INCREF(self->delim_set);
+    return self->delim_set;
+}
+
+static int
+BufferQueue_setdelims(BufferQueue *self, PyObject *value, void *closure)
+{
+    PyObject *list, *delims, *tmp;
+    Py_ssize_t i, j, n_delims, min_size = PY_SSIZE_T_MAX;
+    if (!value)
+        value = Py_None;
+    if (value == Py_None) {
+        Py_CLEAR(self->delim_set);
+        BufferQueue_reset_scan(self);
+        return 0;
+    }
+    if (PyBytes_Check(value)) {
+        PyErr_SetString(PyExc_TypeError,
+            "delimiters must be an iterable of bytes, not bytes");
+        return -1;
+    }
+    if (!(list = PySequence_List(value)))
+        return -1;
+    n_delims = PyList_GET_SIZE(list);
+    for (i = 0; i < n_delims; ++i) {
+        tmp = PyList_GET_ITEM(list, i);
+        if (!PyBytes_Check(tmp) || !PyBytes_GET_SIZE(tmp)) {
+            PyErr_SetString(PyExc_TypeError,
+                "delimiters must all be non-empty bytes");
+            Py_DECREF(list);
+            return -1;
+        }
+        if (PyBytes_GET_SIZE(tmp) < min_size)
+            min_size = PyBytes_GET_SIZE(tmp);
+    }
+
+    /* Sort the copy longest first, and otherwise in the order given. */
+    for (i = 1; i < n_delims; ++i) {
+        tmp = PyList_GET_ITEM(list, i);
+        for (j = i; j > 0 && PyBytes_GET_SIZE(PyList_GET_ITEM(list, j - 1))
+                < PyBytes_GET_SIZE(tmp); --j)
+            PyList_SET_ITEM(list, j, PyList_GET_ITEM(list, j - 1));
+        PyList_SET_ITEM(list, j, tmp);
+    }
+    delims = PyList_AsTuple(list);
+    Py_DECREF(list);
+    if (!delims)
+        return -1;
+
+    Py_CLEAR(self->delim_obj);
+    Py_XDECREF(self->delim_set);
+    BufferQueue_reset_scan(self);
+    if (!n_delims) {
+        Py_DECREF(delims);
+        self->delim_set = NULL;
+        return 0;
+    }
+    self->delim_set = delims;
+    self->delim_set_min = min_size;
+    memset(self->delim_set_first, 0, sizeof(self->delim_set_first));
+    for (i = 0; i < n_delims; ++i)
+        self->delim_set_first[(unsigned char)PyBytes_AS_STRING(
+            PyTuple_GET_ITEM(delims, i))[0]] = 1;
+    return 0;
+}
+
+static PyGetSetDef BufferQueue_getset[] = {
+    {"delimiter",
+     (getter)BufferQueue_getdelim, (setter)BufferQueue_setdelim,
+     "delimiter bytes",
+     NULL},
+    {"delimiters",
+     (getter)BufferQueue_getdelims, (setter)BufferQueue_setdelims,
+     "tuple of delimiters, longest first, or None",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(BufferQueue_doc_push,
+"push(data) -> None\n\
+\n\
+Push some data into the buffer. Besides bytes, any object supporting\n\
+the buffer protocol (bytearray, memoryview, mmap, ...) is accepted.\n\
+Its data is not copied, so it must not be modified while it is still\n\
+in the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopush(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", NULL};
+    PyObject *in_data;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:push", kwlist,
+            &in_data))
+        return NULL;
+    if (BufferQueue_push(self, in_data) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_push_front,
+"push_front(data) -> None\n\
+\n\
+Push some data onto the front of the buffer, so that it will be\n\
+popped before everything already there. This is for handing back\n\
+bytes which were popped but not used. The data isn't copied, as\n\
+with push.\n\
+");
+
+static PyObject *
+BufferQueue_dopush_front(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", NULL};
+    PyObject *in_data;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:push_front", kwlist,
+            &in_data))
+        return NULL;
+    if (BufferQueue_push_front(self, in_data) == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_push_file,
+"push_file(file, [offset], [length]) -> None\n\
+\n\
+Push part of a file, by default everything from offset to its end, by\n\
+mapping it into memory instead of reading it. file is a file\n\
+descriptor or an object with a fileno() method. The file is mapped in\n\
+pieces of up to 64MiB, each unmapped once everything taken from it is\n\
+gone, and pop_view and pop_iov return views of the mapped pages. The\n\
+file must not shrink while its data is in the buffer. If any piece\n\
+can't be mapped, nothing is pushed.\n\
+");
+
+static PyObject *
+BufferQueue_dopush_file(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"file", "offset", "length", NULL};
+    PyObject *file_obj, *length_obj = Py_None, *ret = NULL;
+    PY_LONG_LONG offset = 0, length, file_size, base;
+    Py_ssize_t granularity, lead, segment, n_chunks, n_mapped = 0, i;
+    Py_ssize_t new_length;
+    BufferQueueChunk *chunks;
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|LO:push_file", kwlist,
+            &file_obj, &offset, &length_obj))
+        return NULL;
+    if ((fd = PyObject_AsFileDescriptor(file_obj)) == -1)
+        return NULL;
+    if (qbuf_file_size(fd, &file_size) == -1)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    if (offset < 0 || offset > file_size) {
+        PyErr_SetString(PyExc_ValueError, "offset is outside the file");
+        return NULL;
+    }
+    if (length_obj == Py_None)
+        length = file_size - offset;
+    else {
+        length = PyLong_AsLongLong(length_obj);
+        if (length == -1 && PyErr_Occurred())
+            return NULL;
+        if (length < 0 || length > file_size - offset) {
+            PyErr_SetString(PyExc_ValueError,
+                "length runs past the end of the file");
+            return NULL;
+        }
+    }
+
+    if (!length)
+        Py_RETURN_NONE;
+
+    /* Every segment is mapped, and the ring made big enough for them all,
+     * before any is pushed, so a failure leaves the buffer as it was. Only
+     * the first segment can start part way into a page. */
+    granularity = qbuf_map_granularity();
+    n_chunks = (Py_ssize_t)((offset % granularity + length
+        + MAP_SEGMENT_SIZE - 1) / MAP_SEGMENT_SIZE);
+    if (!(chunks = PyMem_New(BufferQueueChunk, n_chunks)))
+        return PyErr_NoMemory();
+    for (; n_mapped < n_chunks; ++n_mapped) {
+        /* Mappings have to start on a page boundary. */
+        base = offset - offset % granularity;
+        lead = (Py_ssize_t)(offset - base);
+        segment = MAP_SEGMENT_SIZE - lead;
+        if (segment > length)
+            segment = (Py_ssize_t)length;
+        if (!(chunks[n_mapped].obj = (PyObject *)BufferSlab_map(fd, base,
+                lead + segment)))
+            goto cleanup;
+        chunks[n_mapped].ptr = ((BufferSlab *)chunks[n_mapped].obj)->data
+            + lead;
+        chunks[n_mapped].size = segment;
+        offset += segment;
+        length -= segment;
+    }
+    for (new_length = self->buffer_length;
+            new_length < self->n_items + n_chunks; new_length *= 2)
+        ;
+    if (new_length != self->buffer_length
+            && BufferQueue_resize(self, new_length) == -1) {
+        PyErr_SetString(PyExc_MemoryError, "failed to alloc bigger buffer");
+        goto cleanup;
+    }
+    /* With room in the ring, these can't fail. */
+    for (i = 0; i < n_chunks; ++i)
+        BufferQueue_append(self, chunks[i]);
+    n_mapped = 0;
+    ret = Py_None;
+    Py_INCREF(ret);
+
+  cleanup:
+    for (i = 0; i < n_mapped; ++i)
+        Py_DECREF(chunks[i].obj);
+    PyMem_Free(chunks);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_push_many,
+"push_many(iterable) -> None\n\
+\n\
+Push each item of data in the provided iterable into the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopush_many(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"iterable", NULL};
+    PyObject *iter = NULL, *item = NULL, *ret = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:push_many", kwlist,
+            &iter))
+        goto cleanup;
+    if (!(iter = PyObject_GetIter(iter)))
+        goto cleanup;
+
+    while ((item = PyIter_Next(iter))) {
+        if (BufferQueue_push(self, item) == -1)
+            goto cleanup;
+        Py_DECREF(item);
+    }
+    item = NULL;
+
+    if (PyErr_Occurred())
+        goto cleanup;
+
+    ret = Py_None;
+    Py_INCREF(ret);
+
+cleanup:
+    Py_XDECREF(iter);
+    Py_XDECREF(item);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_recv_from,
+"recv_from(fd, [max_bytes]) -> int or None\n\
+\n\
+Read at most max_bytes (default 4096) from a file descriptor, or an\n\
+object with a fileno() method such as a socket, straight into memory\n\
+owned by the buffer. This avoids creating a bytes object for every\n\
+read. Returns the number of bytes read, which is 0 at end of file, or\n\
+None if the descriptor is non-blocking and no data is available.\n\
+");
+
+static PyObject *
+BufferQueue_dorecv_from(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"fd", "max_bytes", NULL};
+    PyObject *fd_obj;
+    BufferSlab *slab;
+    Py_ssize_t max_bytes = SLAB_MIN_SIZE, n_read;
+    char *dest;
+    int fd, err = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "O|" ARG_PY_SSIZE_T ":recv_from", kwlist, &fd_obj, &max_bytes))
+        return NULL;
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
+        return NULL;
+    if (max_bytes <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes must be positive");
+        return NULL;
+    }
+    if (self->recv_busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+            "recv_from called while another is in progress");
+        return NULL;
+    }
+
+    if (!(dest = BufferQueue_claim_read(self, &max_bytes, &slab)))
+        return NULL;
+
+    self->recv_busy = 1;
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        n_read = qbuf_read(fd, dest, max_bytes);
+        if (n_read < 0)
+            err = QBUF_LAST_ERROR();
+        Py_END_ALLOW_THREADS
+        if (n_read >= 0 || !QBUF_EINTR(err) || PyErr_CheckSignals())
+            break;
+    }
+    self->recv_busy = 0;
+
+    if (BufferQueue_finish_read(self, slab, dest, max_bytes, n_read) == -1)
+        return NULL;
+    if (n_read < 0) {
+        if (PyErr_Occurred())
+            return NULL;
+        if (QBUF_WOULDBLOCK(err))
+            Py_RETURN_NONE;
+        QBUF_SET_ERROR(err);
+        return NULL;
+    }
+    return PyInt_FromSsize_t(n_read);
+}
+
+/* Drop the reservation, handing back all but the first used bytes of it to
+ * the tail slab if nothing was put there after it. */
+static void
+BufferQueue_end_reservation(BufferQueue *self, Py_ssize_t used)
+{
+    if (self->reserved_slab == self->tail_slab
+            && self->reserved_ptr + self->reserved_size
+                == self->tail_slab->data + self->tail_used)
+        self->tail_used -= self->reserved_size - used;
+    Py_CLEAR(self->reserved_slab);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_reserve,
+"reserve([sizehint]) -> memoryview\n\
+\n\
+Return a writable view of free memory owned by the buffer, at least\n\
+sizehint bytes long if sizehint is positive, for data to be read\n\
+into directly; commit then adds what was written to the buffer. This\n\
+is what asyncio.BufferedProtocol.get_buffer wants. Reserving again\n\
+before committing gives up the earlier reservation. The view must\n\
+not be used once the reservation is committed or given up.\n\
+");
+
+static PyObject *
+BufferQueue_doreserve(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"sizehint", NULL};
+    BufferReservation *reservation;
+    PyObject *ret;
+    Py_ssize_t sizehint = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "|" ARG_PY_SSIZE_T ":reserve", kwlist, &sizehint))
+        return NULL;
+    if (self->reserved_slab)
+        BufferQueue_end_reservation(self, 0);
+    if (sizehint <= 0)
+        sizehint = RESERVE_DEFAULT_SIZE;
+
+    if (BufferQueue_reserve_tail(self, sizehint, sizehint))
+        return NULL;
+    if (!(reservation = PyObject_New(BufferReservation,
+            &BufferReservationType)))
+        return NULL;
+    reservation->slab = self->tail_slab;
+    Py_INCREF(reservation->slab);
+    reservation->ptr = self->tail_slab->data + self->tail_used;
+    reservation->size = self->tail_slab->capacity - self->tail_used;
+    ret = PyMemoryView_FromObject((PyObject *)reservation);
+    Py_DECREF(reservation);
+    if (!ret)
+        return NULL;
+
+    self->reserved_slab = self->tail_slab;
+    Py_INCREF(self->reserved_slab);
+    self->reserved_ptr = self->tail_slab->data + self->tail_used;
+    self->reserved_size = self->tail_slab->capacity - self->tail_used;
+    self->tail_used = self->tail_slab->capacity;
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_commit,
+"commit(length) -> None\n\
+\n\
+Add the first length bytes of the memory handed out by reserve to the\n\
+end of the buffer, without copying them.\n\
+");
+
+static PyObject *
+BufferQueue_docommit(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    BufferQueueChunk chunk;
+    BufferSlab *slab;
+    Py_ssize_t length;
+    int result = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":commit",
+            kwlist, &length))
+        return NULL;
+    if (!self->reserved_slab) {
+        PyErr_SetString(PyExc_ValueError, "nothing is reserved");
+        return NULL;
+    }
+    if (length < 0 || length > self->reserved_size) {
+        PyErr_SetString(PyExc_ValueError,
+            "length must be within the reservation");
+        return NULL;
+    }
+
+    slab = self->reserved_slab;
+    Py_INCREF(slab);
+    chunk.ptr = self->reserved_ptr;
+    chunk.size = length;
+    BufferQueue_end_reservation(self, length);
+    if (length && slab == self->tail_slab)
+        result = BufferQueue_append_slab(self, chunk.ptr, length);
+    else if (length) {
+        chunk.obj = (PyObject *)slab;
+        Py_INCREF(chunk.obj);
+        result = BufferQueue_append(self, chunk);
+    }
+    Py_DECREF(slab);
+    if (result == -1)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_send_to,
+"send_to(fd, [max_bytes]) -> int\n\
+\n\
+Write the buffer out to a file descriptor, or an object with a fileno()\n\
+method such as a socket, dropping whatever was written. The chunks are\n\
+handed to writev (WSASend on Windows) in batches rather than being\n\
+joined, and batches keep going out until the buffer is empty, at most\n\
+max_bytes have been written, or a write comes up short. Returns the\n\
+number of bytes written, which is 0 if the descriptor is non-blocking\n\
+and can't take any more data.\n\
+\n\
+If another thread takes data off the buffer while a batch is being\n\
+written, RuntimeError is raised with the number of bytes written so far\n\
+as its second argument, and nothing more is dropped.\n\
+");
+
+static PyObject *
+BufferQueue_dosend_to(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"fd", "max_bytes", NULL};
+    qbuf_iovec iov[QBUF_IOV_MAX];
+    PyObject *fd_obj, *max_bytes_obj = Py_None, *held[QBUF_IOV_MAX];
+    BufferQueueIterator iter;
+    Py_ssize_t max_bytes = PY_SSIZE_T_MAX, total = 0, batch, delta, n_written;
+    Py_ssize_t generation;
+    int fd, n_iov, i, err = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:send_to", kwlist,
+            &fd_obj, &max_bytes_obj))
+        return NULL;
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
+        return NULL;
+    if (max_bytes_obj != Py_None) {
+        max_bytes = PyNumber_AsSsize_t(max_bytes_obj, PyExc_OverflowError);
+        if (max_bytes == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_bytes <= 0) {
+            PyErr_SetString(PyExc_ValueError, "max_bytes must be positive");
+            return NULL;
+        }
+    }
+
+    while (self->tot_length && total < max_bytes) {
+        /* The chunks are kept alive while the GIL is released, in case
+         * another thread pops them in the meantime. */
+        BufferQueueIterator_init(&iter, self);
+        batch = 0;
+        for (n_iov = 0; n_iov < QBUF_IOV_MAX; ++n_iov) {
+            delta = iter.s_size - iter.char_idx;
+            if (delta > max_bytes - total - batch)
+                delta = max_bytes - total - batch;
+            QBUF_IOV_SET(iov[n_iov], iter.s_ptr + iter.char_idx, delta);
+            held[n_iov] = iter.cur_chunk->obj;
+            Py_INCREF(held[n_iov]);
+            batch += delta;
+            if (batch == max_bytes - total
+                    || BufferQueueIterator_advance_string(&iter)) {
+                ++n_iov;
+                break;
+            }
+        }
+
+        generation = self->generation;
+        for (;;) {
+            Py_BEGIN_ALLOW_THREADS
+            n_written = qbuf_writev(fd, iov, n_iov);
+            if (n_written < 0)
+                err = QBUF_LAST_ERROR();
+            Py_END_ALLOW_THREADS
+            if (n_written >= 0 || !QBUF_EINTR(err) || PyErr_CheckSignals())
+                break;
+        }
+        for (i = 0; i < n_iov; ++i)
+            Py_DECREF(held[i]);
+
+        if (n_written < 0) {
+            if (PyErr_Occurred())
+                return NULL;
+            if (QBUF_WOULDBLOCK(err))
+                break;
+            QBUF_SET_ERROR(err);
+            return NULL;
+        }
+        if (generation != self->generation) {
+            /* What went out can't be found in the buffer any more, so
+             * leave it alone but say how much was written. */
+            PyObject *exc_args = Py_BuildValue("(sn)",
+                "data was taken off the buffer during send_to",
+                total + n_written);
+            if (exc_args) {
+                PyErr_SetObject(PyExc_RuntimeError, exc_args);
+                Py_DECREF(exc_args);
+            }
+            return NULL;
+        }
+        BufferQueue_skip(self, n_written);
+        total += n_written;
+        if (n_written < batch)
+            break;
+    }
+    return PyInt_FromSsize_t(total);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop,
+"pop([length], [timeout]) -> bytes\n\
+\n\
+Pop some bytes out of the buffer. If no length is provided, pop\n\
+the entire buffer out. Raises a BufferUnderflow exception if the\n\
+buffer would underflow.\n\
+\n\
+If a timeout in seconds is given, or None to wait indefinitely, pop\n\
+blocks until another thread has pushed enough data (or any at all, if\n\
+no length was given) before giving up with BufferUnderflow.\n\
+");
+
+static PyObject *
+BufferQueue_dopop(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", "timeout", NULL};
+    PyObject *length_obj = Py_None, *timeout_obj = NULL;
+    Py_ssize_t out_string_size = -1;
+    double timeout = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:pop", kwlist,
+            &length_obj, &timeout_obj))
+        return NULL;
+    if (length_obj != Py_None) {
+        out_string_size = PyNumber_AsSsize_t(length_obj, PyExc_OverflowError);
+        if (out_string_size == -1 && PyErr_Occurred())
+            return NULL;
+        if (out_string_size < 0) {
+            PyErr_SetString(PyExc_ValueError, "tried to pop a negative "
+                "number of bytes from buffer");
+            return NULL;
+        }
+    }
+    if (timeout_obj == Py_None)
+        timeout = -1;
+    else if (timeout_obj) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1 && PyErr_Occurred())
+            return NULL;
+        if (timeout < 0) {
+            PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+            return NULL;
+        }
+        if (timeout > MAX_WAIT_TIMEOUT)
+            timeout = -1;
+    }
+
+    if (timeout && BufferQueue_wait(self,
+            (out_string_size == -1)? 1 : out_string_size, timeout) == -1)
+        return NULL;
+    if (out_string_size == -1) {
+        if (timeout && !self->tot_length) {
+            PyErr_SetString(qbuf_underflow,
+                "buffer underflow: nothing was pushed before the timeout");
+            return NULL;
+        }
+        out_string_size = self->tot_length;
+    }
+    else if (out_string_size > self->tot_length) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T " bytes",
+            self->tot_length, out_string_size);
+        return NULL;
+    }
+    return BufferQueue_pop_released(self, out_string_size, 0);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_try_pop,
+"try_pop(length) -> bytes or None\n\
+\n\
+Pop some number of bytes from the buffer, like pop, but return None\n\
+instead of raising BufferUnderflow if there aren't enough bytes.\n\
+");
+
+static PyObject *
+BufferQueue_dotry_pop(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t out_string_size;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":try_pop",
+            kwlist, &out_string_size))
+        return NULL;
+    if (out_string_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
+            "bytes from buffer");
+        return NULL;
+    } else if (out_string_size > self->tot_length)
+        Py_RETURN_NONE;
+    return BufferQueue_pop_released(self, out_string_size, 0);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_into,
+"pop_into(buffer, [length]) -> int\n\
+\n\
+Pop some number of bytes from the buffer straight into a writable\n\
+object supporting the buffer protocol (a bytearray, a numpy array,\n\
+an mmap, ...), from its start, and return how many there were. If\n\
+length isn't provided, as much as fits is popped. If length is\n\
+larger than the object, a ValueError is raised, and if there aren't\n\
+enough bytes, BufferUnderflow.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_into(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"buffer", "length", NULL};
+    PyObject *length_obj = Py_None, *ret = NULL;
+    Py_buffer view;
+    Py_ssize_t length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|O:pop_into", kwlist,
+            &view, &length_obj))
+        return NULL;
+    if (length_obj == Py_None)
+        length = (view.len < self->tot_length)? view.len : self->tot_length;
+    else {
+        length = PyNumber_AsSsize_t(length_obj, PyExc_OverflowError);
+        if (length == -1 && PyErr_Occurred())
+            goto cleanup;
+        if (length < 0) {
+            PyErr_SetString(PyExc_ValueError, "tried to pop a negative "
+                "number of bytes from buffer");
+            goto cleanup;
+        } else if (length > view.len) {
+            PyErr_SetString(PyExc_ValueError,
+                "length is larger than the buffer given");
+            goto cleanup;
+        } else if (length > self->tot_length) {
+            PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+                FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T
+                " bytes", self->tot_length, length);
+            goto cleanup;
+        }
+    }
+    if (BufferQueue_pop_into(self, view.buf, length, 0) == -1)
+        goto cleanup;
+    ret = PyInt_FromSsize_t(length);
+
+  cleanup:
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_atmost,
+"pop_atmost(length) -> bytes\n\
+\n\
+Pop at most some number of bytes from the buffer. The returned\n\
+bytes will have a length anywhere between 0 and the length\n\
+provided.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_atmost(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t out_string_size;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":pop_atmost",
+            kwlist, &out_string_size))
+        return NULL;
+    if (out_string_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
+            "bytes from buffer");
+        return NULL;
+    }
+    if (out_string_size > self->tot_length)
+        out_string_size = self->tot_length;
+    return BufferQueue_pop_released(self, out_string_size, 0);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_view,
+"pop_view([length]) -> memoryview\n\
+\n\
+Pop some bytes from the buffer and return them as a memoryview (a\n\
+'buffer' object on python 2). If possible, no new bytes will be\n\
+constructed and the view returned will just be a view of one of the\n\
+chunks of data pushed into the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_view(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t out_string_size = self->tot_length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "|" ARG_PY_SSIZE_T ":pop_view", kwlist, &out_string_size))
+        return NULL;
+    if (out_string_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
+            "bytes from buffer");
+        return NULL;
+    } else if (out_string_size > self->tot_length) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T " bytes",
+            self->tot_length, out_string_size);
+        return NULL;
+    }
+    return BufferQueue_pop(self, out_string_size, 1);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_iov,
+"pop_iov([length]) -> tuple\n\
+\n\
+Pop some bytes from the buffer and return them as a tuple of\n\
+memoryviews (or 'buffer' objects on python 2), one for each chunk of\n\
+data the bytes span. No data is copied, which makes the result\n\
+suitable for passing straight to socket.sendmsg or os.writev. If no\n\
+argument is provided, pop the entire buffer out. Raises a\n\
+BufferUnderflow exception if the buffer would underflow.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_iov(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t out_string_size = self->tot_length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "|" ARG_PY_SSIZE_T ":pop_iov", kwlist, &out_string_size))
+        return NULL;
+    if (out_string_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
+            "bytes from buffer");
+        return NULL;
+    } else if (out_string_size > self->tot_length) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T " bytes",
+            self->tot_length, out_string_size);
+        return NULL;
+    }
+    return BufferQueue_iov(self, out_string_size, 1);
+}
+
+PyDoc_STRVAR(BufferQueue_doc_peek_iov,
+"peek_iov([length]) -> tuple\n\
+\n\
+Like pop_iov, but leave the bytes in the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopeek_iov(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t out_string_size = self->tot_length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "|" ARG_PY_SSIZE_T ":peek_iov", kwlist, &out_string_size))
+        return NULL;
+    if (out_string_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to peek at a negative "
+            "number of bytes from buffer");
+        return NULL;
+    } else if (out_string_size > self->tot_length) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes, tried to peek at " FMT_PY_SSIZE_T
+            " bytes", self->tot_length, out_string_size);
+        return NULL;
+    }
+    return BufferQueue_iov(self, out_string_size, 0);
+}
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *struct_obj;
+    Py_ssize_t size;
+    /* For the fast path: the number of fields (0 if the format can't take
+     * it), their codes, and whether they are little-endian. */
+    int n_fields;
+    int little_endian;
+    char codes[FAST_STRUCT_MAX_FIELDS];
+} StructCacheEntry;
+
+static void
+StructCacheEntry_dealloc(StructCacheEntry *self)
+{
+    Py_XDECREF(self->struct_obj);
+    PyObject_Del(self);
+}
+
+static PyTypeObject StructCacheEntryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.StructCacheEntry",    /*tp_name*/
+    sizeof(StructCacheEntry),   /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)StructCacheEntry_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    "A compiled struct format.", /* tp_doc */
+};
+
+static int
+qbuf_int_code_size(char code)
+{
+    switch (code) {
+    case 'b': case 'B':
+        return 1;
+    case 'h': case 'H':
+        return 2;
+    case 'i': case 'I': case 'l': case 'L':
+        return 4;
+    case 'q': case 'Q':
+        return 8;
+    }
+    return 0;
+}
+
+/* Work out whether a format can be decoded by the fast path: an explicit
+ * standard-size byte order followed only by integer codes. */
+static void
+StructCacheEntry_compile(StructCacheEntry *self, PyObject *format)
+{
+    const char *fmt;
+    Py_ssize_t fmt_size, i;
+    self->n_fields = 0;
+    if (PyBytes_Check(format)) {
+        fmt = PyBytes_AS_STRING(format);
+        fmt_size = PyBytes_GET_SIZE(format);
+#if PY_MAJOR_VERSION >= 3
+    } else if (PyUnicode_Check(format)) {
+        if (!(fmt = PyUnicode_AsUTF8AndSize(format, &fmt_size))) {
+            PyErr_Clear();
+            return;
+        }
+#endif
+    } else
+        return;
+
+    if (fmt_size < 2 || fmt_size - 1 > FAST_STRUCT_MAX_FIELDS)
+        return;
+    switch (fmt[0]) {
+    case '<':
+        self->little_endian = 1;
+        break;
+    case '>': case '!':
+        self->little_endian = 0;
+        break;
+    case '=': {
+        const int one = 1;
+        self->little_endian = *(const char *)&one;
+        break;
+    }
+    default:
+        return;
+    }
+    for (i = 1; i < fmt_size; ++i)
+        if (!qbuf_int_code_size(fmt[i]))
+            return;
+    memcpy(self->codes, fmt + 1, fmt_size - 1);
+    self->n_fields = (int)(fmt_size - 1);
+}
+
+/* Return a new reference to the cache entry for a format, compiling it if
+ * it isn't cached yet. */
+static StructCacheEntry *
+qbuf_struct_lookup(PyObject *format)
+{
+    StructCacheEntry *entry;
+    PyObject *tmp;
+    if ((entry = (StructCacheEntry *)PyDict_GetItem(struct_cache, format))) {
+        Py_INCREF(entry);
+        return entry;
+    }
+    if (PyErr_Occurred())
+        return NULL;
+
+    if (!(entry = PyObject_New(StructCacheEntry, &StructCacheEntryType)))
+        return NULL;
+    entry->n_fields = 0;
+    if (!(entry->struct_obj = PyObject_CallFunction(
+            _struct_obj, "O", format)))
+        goto error;
+    if (!(tmp = PyObject_GetAttrString(entry->struct_obj, "size")))
+        goto error;
+    entry->size = PyNumber_AsSsize_t(tmp, PyExc_OverflowError);
+    Py_DECREF(tmp);
+    if (entry->size == -1 && PyErr_Occurred())
+        goto error;
+    if (entry->size < 0) {
+        PyErr_Format(PyExc_ValueError,
+            "got a negative length from struct.calcsize");
+        goto error;
+    }
+    StructCacheEntry_compile(entry, format);
+
+    if (PyDict_Size(struct_cache) >= STRUCT_CACHE_SIZE)
+        PyDict_Clear(struct_cache);
+    if (PyDict_SetItem(struct_cache, format, (PyObject *)entry) == -1)
+        goto error;
+    return entry;
+
+error:
+    Py_DECREF(entry);
+    return NULL;
+}
+
+/* Decode a fast-path format from data into a tuple. */
+static PyObject *
+StructCacheEntry_decode(StructCacheEntry *self, const unsigned char *data)
+{
+    PyObject *ret, *item;
+    unsigned PY_LONG_LONG value;
+    int i, j, width;
+    if (!(ret = PyTuple_New(self->n_fields)))
+        return NULL;
+    for (i = 0; i < self->n_fields; ++i) {
+        width = qbuf_int_code_size(self->codes[i]);
+        value = 0;
+        if (self->little_endian)
+            for (j = width - 1; j >= 0; --j)
+                value = (value << 8) | data[j];
+        else
+            for (j = 0; j < width; ++j)
+                value = (value << 8) | data[j];
+        data += width;
+
+        if (self->codes[i] >= 'a') {
+            /* Sign-extend lowercase (signed) codes. */
+            PY_LONG_LONG svalue;
+            if (width < 8 && (value >> (width * 8 - 1)))
+                value |= ~(unsigned PY_LONG_LONG)0 << (width * 8);
+            svalue = (PY_LONG_LONG)value;
+            if (svalue >= LONG_MIN && svalue <= LONG_MAX)
+                item = PyInt_FromLong((long)svalue);
+            else
+                item = PyLong_FromLongLong(svalue);
+        } else if (value <= LONG_MAX)
+            item = PyInt_FromLong((long)value);
+        else
+            item = PyLong_FromUnsignedLongLong(value);
+        if (!item) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(ret, i, item);
+    }
+    return ret;
+}
+
+/* Pop a struct described by a cache entry off the buffer, which must hold
+ * enough bytes for it. */
+static PyObject *
+BufferQueue_pop_struct(BufferQueue *self, StructCacheEntry *entry)
+{
+    unsigned char data[FAST_STRUCT_MAX_FIELDS * 8];
+    PyObject *tmp, *ret;
+    if (entry->n_fields) {
+        if (self->stats)
+            BufferQueue_stat_pop(self);
+        QBUF_STAT_ADD(self, copied_bytes, entry->size);
+        BufferQueue_copy_out(self, (char *)data, entry->size);
+        BufferQueue_skip(self, entry->size);
+        return StructCacheEntry_decode(entry, data);
+    }
+    if (!(tmp = BufferQueue_pop(self, entry->size, 1)))
+        return NULL;
+    ret = PyObject_CallMethod(entry->struct_obj, "unpack_from", "O", tmp);
+    Py_DECREF(tmp);
+    return ret;
+}
+
+/* Encode values for a fast-path format into dest. Returns -1, with no
+ * exception set, if any of them isn't an int in range; struct can then
+ * produce the proper error. */
+static int
+StructCacheEntry_encode(StructCacheEntry *self, PyObject *values,
+        unsigned char *dest)
+{
+    PyObject *item;
+    PY_LONG_LONG svalue;
+    unsigned PY_LONG_LONG value;
+    int i, j, width, is_signed;
+    if (PyTuple_GET_SIZE(values) != self->n_fields)
+        return -1;
+    for (i = 0; i < self->n_fields; ++i) {
+        item = PyTuple_GET_ITEM(values, i);
+#if PY_MAJOR_VERSION < 3
+        if (!PyLong_Check(item) && !PyInt_Check(item))
+#else
+        if (!PyLong_Check(item))
+#endif
+            return -1;
+        width = qbuf_int_code_size(self->codes[i]);
+        is_signed = self->codes[i] >= 'a';
+        svalue = PyLong_AsLongLong(item);
+        if (svalue == -1 && PyErr_Occurred()) {
+            PyErr_Clear();
+            if (is_signed)
+                return -1;
+            value = PyLong_AsUnsignedLongLong(item);
+            if (value == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred()) {
+                PyErr_Clear();
+                return -1;
+            }
+        } else {
+            if (!is_signed && svalue < 0)
+                return -1;
+            if (width < 8) {
+                if (is_signed && (svalue < -((PY_LONG_LONG)1 << (width * 8 - 1))
+                        || svalue >= (PY_LONG_LONG)1 << (width * 8 - 1)))
+                    return -1;
+                if (!is_signed && svalue >= (PY_LONG_LONG)1 << (width * 8))
+                    return -1;
+            }
+            value = (unsigned PY_LONG_LONG)svalue;
+        }
+
+        if (self->little_endian)
+            for (j = 0; j < width; ++j, value >>= 8)
+                dest[j] = (unsigned char)value;
+        else
+            for (j = width - 1; j >= 0; --j, value >>= 8)
+                dest[j] = (unsigned char)value;
+        dest += width;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_push_struct,
+"push_struct(format, *values) -> None\n\
+\n\
+Pack some values with a struct format and push the result onto the\n\
+buffer, e.g. for a length prefix ahead of a pushed payload. Simple\n\
+integer formats are packed straight into memory owned by the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopush_struct(BufferQueue *self, PyObject *args)
+{
+    PyObject *format, *values, *pack, *packed, *ret = NULL;
+    StructCacheEntry *entry;
+    unsigned char *dest;
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError,
+            "push_struct() takes at least 1 argument (0 given)");
+        return NULL;
+    }
+    format = PyTuple_GET_ITEM(args, 0);
+    if (!(entry = qbuf_struct_lookup(format)))
+        return NULL;
+    if (!(values = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args))))
+        goto cleanup;
+
+    if (entry->n_fields && entry->size) {
+        if (BufferQueue_reserve_tail(self, entry->size, entry->size) == -1)
+            goto cleanup;
+        dest = (unsigned char *)self->tail_slab->data + self->tail_used;
+        if (StructCacheEntry_encode(entry, values, dest) == 0) {
+            self->tail_used += entry->size;
+            if (BufferQueue_append_slab(self, (char *)dest, entry->size) == -1)
+                goto cleanup;
+            ret = Py_None;
+            Py_INCREF(ret);
+            goto cleanup;
+        }
+    }
+    if (!(pack = PyObject_GetAttrString(entry->struct_obj, "pack")))
+        goto cleanup;
+    packed = PyObject_CallObject(pack, values);
+    Py_DECREF(pack);
+    if (!packed)
+        goto cleanup;
+    if (BufferQueue_push(self, packed) == 0) {
+        ret = Py_None;
+        Py_INCREF(ret);
+    }
+    Py_DECREF(packed);
+
+cleanup:
+    Py_XDECREF(values);
+    Py_DECREF(entry);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_struct,
+"pop_struct(format) -> tuple\n\
+\n\
+Pop some bytes from the buffer and unpack them using the 'struct'\n\
+module, returning the resulting tuple. The format string passed is\n\
+the same as the 'struct' module format.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_struct(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"format", NULL};
+    PyObject *format, *ret = NULL;
+    StructCacheEntry *entry;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:pop_struct",
+            kwlist, &format))
+        return NULL;
+    if (!(entry = qbuf_struct_lookup(format)))
+        return NULL;
+    if (entry->size > self->tot_length)
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes; this struct format requires "
+            FMT_PY_SSIZE_T " bytes",
+            self->tot_length, entry->size);
+    else
+        ret = BufferQueue_pop_struct(self, entry);
+    Py_DECREF(entry);
+    return ret;
+}
+
+/* Read the length prefix at the front of the buffer without consuming it.
+ * The buffer must hold at least entry->size bytes. Returns -1 on error. */
+static Py_ssize_t
+BufferQueue_peek_length(BufferQueue *self, StructCacheEntry *entry)
+{
+    unsigned char data[FAST_STRUCT_MAX_FIELDS * 8];
+    PyObject *tmp, *fields;
+    Py_ssize_t ret = -1;
+    if (entry->n_fields) {
+        BufferQueue_copy_out(self, (char *)data, entry->size);
+        fields = StructCacheEntry_decode(entry, data);
+    } else {
+        if (!(tmp = PyBytes_FromStringAndSize(NULL, entry->size)))
+            return -1;
+        BufferQueue_copy_out(self, PyBytes_AS_STRING(tmp), entry->size);
+        fields = PyObject_CallMethod(entry->struct_obj, "unpack", "O", tmp);
+        Py_DECREF(tmp);
+    }
+    if (!fields)
+        return -1;
+    if (PyTuple_GET_SIZE(fields) != 1) {
+        PyErr_SetString(PyExc_ValueError,
+            "prefix_format must describe exactly one integer");
+        goto cleanup;
+    }
+    ret = PyNumber_AsSsize_t(PyTuple_GET_ITEM(fields, 0),
+        PyExc_OverflowError);
+    if (ret == -1 && PyErr_Occurred())
+        goto cleanup;
+    if (ret < 0) {
+        PyErr_Format(PyExc_ValueError,
+            "got a negative frame length: " FMT_PY_SSIZE_T, ret);
+        ret = -1;
+    }
+
+cleanup:
+    Py_DECREF(fields);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_try_pop_struct,
+"try_pop_struct(format) -> tuple or None\n\
+\n\
+Pop a struct off of the buffer, like pop_struct, but return None\n\
+instead of raising BufferUnderflow if there aren't enough bytes.\n\
+");
+
+static PyObject *
+BufferQueue_dotry_pop_struct(BufferQueue *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"format", NULL};
+    PyObject *format, *ret;
+    StructCacheEntry *entry;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:try_pop_struct",
+            kwlist, &format))
+        return NULL;
+    if (!(entry = qbuf_struct_lookup(format)))
+        return NULL;
+    if (entry->size > self->tot_length) {
+        ret = Py_None;
+        Py_INCREF(ret);
+    } else
+        ret = BufferQueue_pop_struct(self, entry);
+    Py_DECREF(entry);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_pop_frames,
+"pop_frames(prefix_format, [max_frames], [max_length], [as_bytes]) -> list\n\
+\n\
+Pop every complete length-prefixed frame out of the buffer. Each frame\n\
+is a length, packed according to the struct format 'prefix_format',\n\
+followed by that many bytes. The frames are returned without their\n\
+prefixes as memoryviews (or as bytes if 'as_bytes' is true), which will\n\
+be views straight onto the pushed data wherever a frame lies within a\n\
+single chunk. Incomplete frames are left in the buffer.\n\
+\n\
+If 'max_frames' is provided, at most that many frames will be popped.\n\
+If 'max_length' is provided and a frame claims to be longer, a\n\
+FrameTooLong exception is raised; the frames before it are returned\n\
+first, and the offending prefix is left in the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_dopop_frames(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"prefix_format", "max_frames", "max_length",
+        "as_bytes", NULL};
+    PyObject *format, *max_frames_obj = Py_None, *max_length_obj = Py_None;
+    PyObject *ret = NULL, *frame;
+    StructCacheEntry *entry;
+    Py_ssize_t max_frames = -1, max_length = -1, length;
+    int as_bytes = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOi:pop_frames", kwlist,
+            &format, &max_frames_obj, &max_length_obj, &as_bytes))
+        return NULL;
+    if (max_frames_obj != Py_None) {
+        max_frames = PyNumber_AsSsize_t(max_frames_obj, PyExc_OverflowError);
+        if (max_frames == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_frames < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                "max_frames must be non-negative");
+            return NULL;
+        }
+    }
+    if (max_length_obj != Py_None) {
+        max_length = PyNumber_AsSsize_t(max_length_obj, PyExc_OverflowError);
+        if (max_length == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_length < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                "max_length must be non-negative");
+            return NULL;
+        }
+    }
+    if (!(entry = qbuf_struct_lookup(format)))
+        return NULL;
+    if (!(ret = PyList_New(0)))
+        goto cleanup;
+
+    while (max_frames && self->tot_length >= entry->size) {
+        if ((length = BufferQueue_peek_length(self, entry)) == -1)
+            goto error;
+        if (max_length >= 0 && length > max_length) {
+            if (PyList_GET_SIZE(ret))
+                break;
+            PyErr_Format(qbuf_frame_too_long, "frame of " FMT_PY_SSIZE_T
+                " bytes is longer than the maximum of " FMT_PY_SSIZE_T
+                " bytes", length, max_length);
+            goto error;
+        }
+        if (self->tot_length - entry->size < length)
+            break;
+        BufferQueue_skip(self, entry->size);
+        if (!(frame = BufferQueue_pop(self, length, !as_bytes)))
+            goto error;
+        if (PyList_Append(ret, frame) == -1) {
+            Py_DECREF(frame);
+            goto error;
+        }
+        Py_DECREF(frame);
+        if (max_frames > 0)
+            --max_frames;
+    }
+    goto cleanup;
+
+error:
+    Py_CLEAR(ret);
+cleanup:
+    Py_DECREF(entry);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_popline,
+"popline([delimiter]) -> bytes\n\
+\n\
+Pop one line of data from the buffer. This scans the buffer for\n\
+the next occurrence of the provided delimiter, or the buffer's\n\
+delimiter (or the earliest of its delimiters) if none was provided,\n\
+and then returns everything up\n\
+to and including the delimiter. If the delimiter was not found\n\
+or there was no delimiter set, a ValueError is raised. The \n\
+delimiter is not included in the bytes returned.\n\
+");
+
+static PyObject *
+BufferQueue_dopopline(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", NULL};
+    PyObject *delim_obj = Py_None;
+    PyObject *ret, *matched;
+    int result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:popline", kwlist,
+            &delim_obj))
+        return NULL;
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        return NULL;
+    }
+    result = BufferQueue_popline(self, &ret,
+        (delim_obj == Py_None)? NULL : delim_obj, &matched);
+    if (result == -1)
+        return NULL;
+    else if (result == 0) {
+        PyErr_SetString(PyExc_ValueError, "delimiter not found");
+        return NULL;
+    }
+    Py_DECREF(matched);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_popline_match,
+"popline_match([delimiter]) -> (bytes, bytes)\n\
+\n\
+Pop one line of data from the buffer, like popline, and return it\n\
+along with the delimiter that ended it. This is mostly useful when\n\
+the buffer has a set of delimiters.\n\
+");
+
+static PyObject *
+BufferQueue_dopopline_match(BufferQueue *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", NULL};
+    PyObject *delim_obj = Py_None;
+    PyObject *ret, *line, *matched;
+    int result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:popline_match", kwlist,
+            &delim_obj))
+        return NULL;
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        return NULL;
+    }
+    result = BufferQueue_popline(self, &line,
+        (delim_obj == Py_None)? NULL : delim_obj, &matched);
+    if (result == -1)
+        return NULL;
+    else if (result == 0) {
+        PyErr_SetString(PyExc_ValueError, "delimiter not found");
+        return NULL;
+    }
+    ret = PyTuple_Pack(2, line, matched);
+    Py_DECREF(line);
+    Py_DECREF(matched);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_popline_into,
+"popline_into(buffer, [delimiter]) -> int\n\
+\n\
+Pop one line of data from the buffer, as popline does, but into the\n\
+start of a writable object supporting the buffer protocol, and\n\
+return the line's length. The delimiter is dropped. If the line\n\
+doesn't fit, a ValueError is raised and nothing is popped.\n\
+");
+
+static PyObject *
+BufferQueue_dopopline_into(BufferQueue *self, PyObject *args,
+        PyObject *kwds)
+{
+    static char *kwlist[] = {"buffer", "delimiter", NULL};
+    PyObject *delim_obj = Py_None, *matched, *ret = NULL;
+    Py_buffer view;
+    Py_ssize_t line_size;
+    int result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|O:popline_into", kwlist,
+            &view, &delim_obj))
+        return NULL;
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        goto cleanup;
+    }
+    if (!(delim_obj = BufferQueue_line_delim(self,
+            (delim_obj == Py_None)? NULL : delim_obj)))
+        goto cleanup;
+    if ((line_size = BufferQueue_find_line(self, delim_obj,
+            &matched)) == -1) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "delimiter not found");
+        goto cleanup;
+    }
+    if (line_size > view.len) {
+        PyErr_SetString(PyExc_ValueError,
+            "line is longer than the buffer given");
+        goto cleanup;
+    }
+
+    /* Another thread could change the delimiter while the GIL is released
+     * for the copy. */
+    Py_INCREF(matched);
+    result = BufferQueue_pop_into(self, view.buf, line_size,
+        PyBytes_GET_SIZE(matched));
+    Py_DECREF(matched);
+    if (result == -1)
+        goto cleanup;
+    ret = PyInt_FromSsize_t(line_size);
+
+  cleanup:
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_try_popline,
+"try_popline([delimiter]) -> bytes or None\n\
+\n\
+Pop a line off of the buffer, like popline, but return None instead\n\
+of raising ValueError if there is no complete line. A ValueError is\n\
+still raised if there is no delimiter.\n\
+");
+
+static PyObject *
+BufferQueue_dotry_popline(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", NULL};
+    PyObject *delim_obj = Py_None;
+    PyObject *ret, *matched;
+    int result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:try_popline", kwlist,
+            &delim_obj))
+        return NULL;
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        return NULL;
+    }
+    result = BufferQueue_popline(self, &ret,
+        (delim_obj == Py_None)? NULL : delim_obj, &matched);
+    if (result == -1)
+        return NULL;
+    else if (result == 0)
+        Py_RETURN_NONE;
+    Py_DECREF(matched);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_poplines,
+"poplines([delimiter], [max_lines], [max_bytes], [keepends]) -> list\n\
+\n\
+Pop as many lines off of the buffer as is possible. This will\n\
+collect and return a list of all of the lines that were in the\n\
+buffer. If there was no delimiter set and no delimiter was \n\
+provided, a ValueError is raised. The delimiter is not included\n\
+in the lines returned unless 'keepends' is true.\n\
+\n\
+If 'max_lines' is provided, at most that many lines are popped. If\n\
+'max_bytes' is provided, no more lines are popped once that many\n\
+bytes (counting delimiters) have been taken off the buffer; at least\n\
+one line is always popped if there is one.\n\
+");
+
+static PyObject *
+BufferQueue_dopoplines(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", "max_lines", "max_bytes",
+        "keepends", NULL};
+    PyObject *ret = NULL, *delim_obj = Py_None, *line, *matched;
+    PyObject *max_lines_obj = Py_None, *max_bytes_obj = Py_None;
+    Py_ssize_t max_lines = -1, max_bytes = -1, pos, prev;
+    Py_ssize_t n_lines = 0, bounds_size = POPLINES_STACK_BOUNDS, i;
+    /* For each line, where it ends and where its delimiter ends. */
+    Py_ssize_t stack_bounds[2 * POPLINES_STACK_BOUNDS];
+    Py_ssize_t *bounds = stack_bounds, *new_bounds;
+    int keepends = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOOi:poplines", kwlist,
+            &delim_obj, &max_lines_obj, &max_bytes_obj, &keepends))
+        return NULL;
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
+        return NULL;
+    }
+    if (!(delim_obj = BufferQueue_line_delim(self,
+            (delim_obj == Py_None)? NULL : delim_obj)))
+        return NULL;
+    if (max_lines_obj != Py_None) {
+        max_lines = PyNumber_AsSsize_t(max_lines_obj, PyExc_OverflowError);
+        if (max_lines == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_lines < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                "max_lines must be non-negative");
+            return NULL;
+        }
+    }
+    if (max_bytes_obj != Py_None) {
+        max_bytes = PyNumber_AsSsize_t(max_bytes_obj, PyExc_OverflowError);
+        if (max_bytes == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_bytes < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                "max_bytes must be non-negative");
+            return NULL;
+        }
+    }
+
+    /* Find where every line ends first, so the list can be built at its
+     * final size. Each search resumes from the scan cursor. */
+    pos = 0;
+    while (n_lines != max_lines
+            && (max_bytes < 0 || !n_lines || pos < max_bytes)) {
+        if ((pos = BufferQueue_find_line(self, delim_obj, &matched)) == -1)
+            break;
+        if (n_lines == bounds_size) {
+            bounds_size *= 2;
+            if (bounds == stack_bounds) {
+                if ((new_bounds = PyMem_New(Py_ssize_t, 2 * bounds_size)))
+                    memcpy(new_bounds, stack_bounds, sizeof(stack_bounds));
+            } else
+                new_bounds = PyMem_Resize(bounds, Py_ssize_t,
+                    2 * bounds_size);
+            if (!new_bounds) {
+                PyErr_NoMemory();
+                goto cleanup;
+            }
+            bounds = new_bounds;
+        }
+        bounds[2 * n_lines] = pos;
+        BufferQueue_scan_past_delim(self, PyBytes_GET_SIZE(matched));
+        pos += PyBytes_GET_SIZE(matched);
+        bounds[2 * n_lines++ + 1] = pos;
+    }
+
+    if (!(ret = PyList_New(n_lines)))
+        goto cleanup;
+    for (i = 0, prev = 0; i < n_lines; ++i) {
+        pos = bounds[2 * i + 1];
+        if (!(line = BufferQueue_pop(self,
+                (keepends? pos : bounds[2 * i]) - prev, 0))) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, line);
+        if (!keepends)
+            BufferQueue_skip(self, pos - bounds[2 * i]);
+        prev = pos;
+    }
+
+cleanup:
+    if (bounds != stack_bounds)
+        PyMem_Free(bounds);
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_memory_usage,
+"memory_usage() -> dict\n\
+\n\
+Report how much memory the buffer is using. The dict returned has\n\
+'slots', the number of chunks there is room for; 'chunks', the\n\
+number in use; 'buffered', the number of bytes in the buffer; 'held',\n\
+the size of all the memory kept alive by the chunks, including parts\n\
+already popped or not yet filled; and 'overhead', the size of the\n\
+BufferQueue itself and its slot array.\n\
+");
+
+static PyObject *
+BufferQueue_domemory_usage(BufferQueue *self)
+{
+    BufferQueueChunk *chunk;
+    PyObject *last = NULL;
+    Py_ssize_t count, index = self->start_idx, held = 0;
+    int tail_counted = 0;
+    for (count = 0; count < self->n_items; ++count) {
+        chunk = &self->buffer[index];
+        if (PyBytes_Check(chunk->obj))
+            held += PyBytes_GET_SIZE(chunk->obj);
+        else if (PyMemoryView_Check(chunk->obj))
+            held += PyMemoryView_GET_BUFFER(chunk->obj)->len;
+        else if (chunk->obj != last) {
+            /* Consecutive chunks from the same slab share its memory. */
+            held += ((BufferSlab *)chunk->obj)->capacity;
+            if (chunk->obj == (PyObject *)self->tail_slab)
+                tail_counted = 1;
+            last = chunk->obj;
+        }
+        if (++index == self->buffer_length)
+            index = 0;
+    }
+    if (self->tail_slab && !tail_counted)
+        held += self->tail_slab->capacity;
+
+    return Py_BuildValue("{s:" ARG_PY_SSIZE_T ",s:" ARG_PY_SSIZE_T
+        ",s:" ARG_PY_SSIZE_T ",s:" ARG_PY_SSIZE_T ",s:" ARG_PY_SSIZE_T "}",
+        "slots", self->buffer_length,
+        "chunks", self->n_items,
+        "buffered", self->tot_length,
+        "held", held,
+        "overhead", (Py_ssize_t)(Py_TYPE(self)->tp_basicsize
+            + self->buffer_length * sizeof(*self->buffer)));
+}
+
+PyDoc_STRVAR(BufferQueue_doc_stats,
+"stats([reset]) -> dict or None\n\
+\n\
+Report what the buffer has been doing, if it was made with stats=True;\n\
+otherwise return None. The dict has 'bytes_pushed' and 'bytes_popped';\n\
+'chunks_high_water', the most chunks ever held at once; 'ring_grows',\n\
+how many times the ring had to grow; 'copied_bytes' and\n\
+'zero_copy_pops', how much pops copied and how many handed out data\n\
+without copying it; 'scanned_bytes', how much delimiter searches\n\
+looked through; and 'buffered_histogram', a list whose item i counts\n\
+pops made with fewer than 2**i bytes buffered (and at least\n\
+2**(i - 1)). If reset is true, the counters start again from zero.\n\
+");
+
+static PyObject *
+BufferQueue_dostats(BufferQueue *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"reset", NULL};
+    BufferQueueStats *stats = self->stats;
+    PyObject *ret, *histogram, *count;
+    int reset = 0, n_buckets = STATS_HISTOGRAM_BUCKETS, i;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:stats", kwlist, &reset))
+        return NULL;
+    if (!stats)
+        Py_RETURN_NONE;
+
+    while (n_buckets && !stats->buffered_histogram[n_buckets - 1])
+        --n_buckets;
+    if (!(histogram = PyList_New(n_buckets)))
+        return NULL;
+    for (i = 0; i < n_buckets; ++i) {
+        if (!(count = PyLong_FromLongLong(stats->buffered_histogram[i]))) {
+            Py_DECREF(histogram);
+            return NULL;
+        }
+        PyList_SET_ITEM(histogram, i, count);
+    }
+    ret = Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:N}",
+        "bytes_pushed", stats->bytes_pushed,
+        "bytes_popped", stats->bytes_popped,
+        "chunks_high_water", stats->chunks_high_water,
+        "ring_grows", stats->ring_grows,
+        "copied_bytes", stats->copied_bytes,
+        "zero_copy_pops", stats->zero_copy_pops,
+        "scanned_bytes", stats->scanned_bytes,
+        "buffered_histogram", histogram);
+    if (ret && reset)
+        memset(stats, 0, sizeof(*stats));
+    return ret;
+}
+
+PyDoc_STRVAR(BufferQueue_doc_clear,
+"clear() -> None\n\
+\n\
+Clear the buffer.\n\
+");
+
+static PyObject *
+BufferQueue_doclear(BufferQueue *self)
+{
+    BufferQueue_clear_buffer(self);
+    self->start_idx = self->end_idx = self->n_items = 0;
+    self->tot_length = self->cur_offset = 0;
+    ++self->generation;
+    BufferQueue_reset_scan(self);
+    BufferQueue_maybe_shrink(self);
+    Py_RETURN_NONE;
+}
+
+/* A cursor reads ahead in a BufferQueue without consuming anything until
+ * it is committed. It stays valid as long as nothing is taken off the front
+ * of the queue; pushes are fine. To avoid walking the ring from the start on
+ * every call, it remembers a chunk (relative to start_idx) at or before its
+ * position and where that chunk starts, measured like pos from the front of
+ * the queue. The first chunk starts at -cur_offset. */
+typedef struct {
+    PyObject_HEAD
+    BufferQueue *parent;
+    Py_ssize_t generation;
+    Py_ssize_t pos;
+    Py_ssize_t chunk;
+    Py_ssize_t chunk_pos;
+} BufferCursor;
+
+static void
+BufferCursor_reset(BufferCursor *self)
+{
+    self->generation = self->parent->generation;
+    self->pos = self->chunk = 0;
+    self->chunk_pos = -self->parent->cur_offset;
+}
+
+static int
+BufferCursor_check(BufferCursor *self)
+{
+    if (self->generation != self->parent->generation) {
+        PyErr_SetString(PyExc_RuntimeError,
+            "data was taken off the buffer after the cursor was made");
+        return -1;
+    }
+    return 0;
+}
+
+/* Point iter at offset bytes into the buffer, which must be at or after
+ * the cursor's position and before the end of the data. If remember is
+ * set, the chunk found is cached for later calls. */
+static void
+BufferCursor_iter_at(BufferCursor *self, Py_ssize_t offset,
+        BufferQueueIterator *iter, int remember)
+{
+    BufferQueue *parent = self->parent;
+    Py_ssize_t chunk = self->chunk, chunk_pos = self->chunk_pos;
+    Py_ssize_t index = parent->start_idx + chunk;
+    if (index >= parent->buffer_length)
+        index -= parent->buffer_length;
+    while (chunk_pos + parent->buffer[index].size <= offset) {
+        chunk_pos += parent->buffer[index].size;
+        ++chunk;
+        if (++index == parent->buffer_length)
+            index = 0;
+    }
+    if (remember) {
+        self->chunk = chunk;
+        self->chunk_pos = chunk_pos;
+    }
+    iter->parent = parent;
+    iter->string_idx = index;
+    iter->char_idx = offset - chunk_pos;
+    BufferQueueIterator_update(iter);
+}
+
+static void
+BufferCursor_dealloc(BufferCursor *self)
+{
+    Py_XDECREF(self->parent);
+    PyObject_Del(self);
+}
+
+static PyObject *
+BufferCursor_repr(BufferCursor *self)
+{
+    return PyNativeString_FromFormat(
+        "<BufferCursor at " FMT_PY_SSIZE_T " of " FMT_PY_SSIZE_T " bytes>",
+        self->pos, self->parent->tot_length);
+}
+
+static Py_ssize_t
+BufferCursor_length(BufferCursor *self)
+{
+    if (BufferCursor_check(self) == -1)
+        return -1;
+    return self->parent->tot_length - self->pos;
+}
+
+PyDoc_STRVAR(BufferCursor_doc_peek,
+"peek(length) -> bytes\n\
+\n\
+Return the next length bytes after the cursor, without moving it.\n\
+Raises BufferUnderflow if there aren't that many.\n\
+");
+
+static PyObject *
+BufferCursor_dopeek(BufferCursor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    BufferQueueIterator iter;
+    Py_ssize_t length;
+    PyObject *ret;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":peek",
+            kwlist, &length))
+        return NULL;
+    if (BufferCursor_check(self) == -1)
+        return NULL;
+    if (length < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to peek at a negative "
+            "number of bytes");
+        return NULL;
+    } else if (length > self->parent->tot_length - self->pos) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: " FMT_PY_SSIZE_T
+            " bytes after the cursor, tried to peek at " FMT_PY_SSIZE_T
+            " bytes", self->parent->tot_length - self->pos, length);
+        return NULL;
+    }
+    if (!(ret = PyBytes_FromStringAndSize(NULL, length)))
+        return NULL;
+    if (length) {
+        BufferCursor_iter_at(self, self->pos, &iter, 1);
+        BufferQueueIterator_copy_out(iter, PyBytes_AS_STRING(ret), length);
+    }
+    return ret;
+}
+
+PyDoc_STRVAR(BufferCursor_doc_peek_byte,
+"peek_byte([index]) -> int\n\
+\n\
+Return the value of the byte 'index' bytes after the cursor, without\n\
+moving it. Raises IndexError if the buffer isn't that long.\n\
+");
+
+static PyObject *
+BufferCursor_dopeek_byte(BufferCursor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"index", NULL};
+    BufferQueueIterator iter;
+    Py_ssize_t index = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|" ARG_PY_SSIZE_T
+            ":peek_byte", kwlist, &index))
+        return NULL;
+    if (BufferCursor_check(self) == -1)
+        return NULL;
+    if (index < 0 || index >= self->parent->tot_length - self->pos) {
+        PyErr_SetString(PyExc_IndexError, "peek_byte index out of range");
+        return NULL;
+    }
+    BufferCursor_iter_at(self, self->pos + index, &iter, 0);
+    return PyInt_FromLong((unsigned char)iter.s_ptr[iter.char_idx]);
+}
+
+PyDoc_STRVAR(BufferCursor_doc_find,
+"find(delimiter, [start]) -> int\n\
+\n\
+Return how many bytes after the cursor the first occurrence of the\n\
+delimiter is, looking no earlier than 'start' bytes after the cursor,\n\
+or -1 if it isn't in the buffer. The cursor isn't moved.\n\
+");
+
+static PyObject *
+BufferCursor_dofind(BufferCursor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", "start", NULL};
+    BufferQueueIterator iter;
+    PyObject *delim_obj;
+    Py_ssize_t start = 0, pos;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|" ARG_PY_SSIZE_T
+            ":find", kwlist, &delim_obj, &start))
+        return NULL;
+    if (!PyBytes_Check(delim_obj) || !PyBytes_GET_SIZE(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError,
+            "delimiter must be non-empty bytes");
+        return NULL;
+    }
+    if (BufferCursor_check(self) == -1)
+        return NULL;
+    if (start < 0) {
+        PyErr_SetString(PyExc_ValueError, "start must not be negative");
+        return NULL;
+    }
+    pos = self->pos + start;
+    if (start > self->parent->tot_length - self->pos
+            || PyBytes_GET_SIZE(delim_obj) > self->parent->tot_length - pos)
+        return PyInt_FromSsize_t(-1);
+    BufferCursor_iter_at(self, pos, &iter, 0);
+    if (!BufferQueue_search_from(&iter, &pos, PyBytes_AS_STRING(delim_obj),
+            PyBytes_GET_SIZE(delim_obj)))
+        return PyInt_FromSsize_t(-1);
+    return PyInt_FromSsize_t(pos - self->pos);
+}
+
+PyDoc_STRVAR(BufferCursor_doc_skip,
+"skip(length) -> None\n\
+\n\
+Move the cursor forward. Raises BufferUnderflow if there aren't that\n\
+many bytes after it.\n\
+");
+
+static PyObject *
+BufferCursor_doskip(BufferCursor *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"length", NULL};
+    Py_ssize_t length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":skip",
+            kwlist, &length))
+        return NULL;
+    if (BufferCursor_check(self) == -1)
+        return NULL;
+    if (length < 0) {
+        PyErr_SetString(PyExc_ValueError, "tried to skip a negative number "
+            "of bytes");
+        return NULL;
+    } else if (length > self->parent->tot_length - self->pos) {
+        PyErr_Format(qbuf_underflow, "buffer underflow: " FMT_PY_SSIZE_T
+            " bytes after the cursor, tried to skip " FMT_PY_SSIZE_T
+            " bytes", self->parent->tot_length - self->pos, length);
+        return NULL;
+    }
+    self->pos += length;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(BufferCursor_doc_commit,
+"commit() -> int\n\
+\n\
+Drop everything before the cursor off the buffer, and return how many\n\
+bytes that was. The cursor is then at the front of the buffer again.\n\
+");
+
+static PyObject *
+BufferCursor_docommit(BufferCursor *self)
+{
+    Py_ssize_t length = self->pos;
+    if (BufferCursor_check(self) == -1)
+        return NULL;
+    if (length)
+        BufferQueue_skip(self->parent, length);
+    BufferCursor_reset(self);
+    return PyInt_FromSsize_t(length);
+}
+
+static PyObject *
+BufferCursor_getpos(BufferCursor *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->pos);
+}
+
+static PyMethodDef BufferCursor_methods[] = {
+    {"peek", (PyCFunction)BufferCursor_dopeek,
+        METH_VARARGS | METH_KEYWORDS, BufferCursor_doc_peek},
+    {"peek_byte", (PyCFunction)BufferCursor_dopeek_byte,
+        METH_VARARGS | METH_KEYWORDS, BufferCursor_doc_peek_byte},
+    {"find", (PyCFunction)BufferCursor_dofind,
+        METH_VARARGS | METH_KEYWORDS, BufferCursor_doc_find},
+    {"skip", (PyCFunction)BufferCursor_doskip,
+        METH_VARARGS | METH_KEYWORDS, BufferCursor_doc_skip},
+    {"commit", (PyCFunction)BufferCursor_docommit,
+        METH_NOARGS, BufferCursor_doc_commit},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef BufferCursor_getset[] = {
+    {"position",
+     (getter)BufferCursor_getpos, NULL,
+     "how many bytes the cursor is past the front of the buffer",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods BufferCursor_as_sequence = {
+    (lenfunc)BufferCursor_length,
+};
+
+PyDoc_STRVAR(BufferCursor_doc,
+"A read-ahead position in a BufferQueue, made by BufferQueue.cursor().\n\
+\n\
+The data after a cursor can be examined and skipped over without\n\
+taking anything off the buffer; commit() then drops everything the\n\
+cursor has moved past in one go. len() of a cursor is the number of\n\
+bytes after it. Pushing more data keeps a cursor valid, but taking\n\
+data off the buffer by any other means invalidates it.\n\
+");
+
+static PyTypeObject BufferCursorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.BufferCursor",        /*tp_name*/
+    sizeof(BufferCursor),       /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)BufferCursor_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    (reprfunc)BufferCursor_repr, /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &BufferCursor_as_sequence,  /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
+    BufferCursor_doc,           /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    BufferCursor_methods,       /* tp_methods */
+    0,                          /* tp_members */
+    BufferCursor_getset,        /* tp_getset */
+};
+
+PyDoc_STRVAR(BufferQueue_doc_cursor,
+"cursor() -> BufferCursor\n\
+\n\
+Make a cursor at the front of the buffer, for looking ahead at the\n\
+data without popping it.\n\
+");
+
+static PyObject *
+BufferQueue_docursor(BufferQueue *self)
+{
+    BufferCursor *ret;
+    if (!(ret = PyObject_New(BufferCursor, &BufferCursorType)))
+        return NULL;
+    Py_INCREF(self);
+    ret->parent = self;
+    BufferCursor_reset(ret);
+    return (PyObject *)ret;
+}
+
+static PyMethodDef BufferQueue_methods[] = {
+    {"push", (PyCFunction)BufferQueue_dopush,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push},
+    {"push_front", (PyCFunction)BufferQueue_dopush_front,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push_front},
+    {"push_struct", (PyCFunction)BufferQueue_dopush_struct,
+        METH_VARARGS, BufferQueue_doc_push_struct},
+    {"push_file", (PyCFunction)BufferQueue_dopush_file,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push_file},
+    {"push_many", (PyCFunction)BufferQueue_dopush_many,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push_many},
+    {"recv_from", (PyCFunction)BufferQueue_dorecv_from,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_recv_from},
+    {"reserve", (PyCFunction)BufferQueue_doreserve,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_reserve},
+    {"commit", (PyCFunction)BufferQueue_docommit,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_commit},
+    {"send_to", (PyCFunction)BufferQueue_dosend_to,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_send_to},
+    {"pop", (PyCFunction)BufferQueue_dopop,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop},
+    {"try_pop", (PyCFunction)BufferQueue_dotry_pop,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_try_pop},
+    {"pop_into", (PyCFunction)BufferQueue_dopop_into,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_into},
+    {"pop_atmost", (PyCFunction)BufferQueue_dopop_atmost,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_atmost},
+    {"pop_view", (PyCFunction)BufferQueue_dopop_view,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_view},
+    {"pop_iov", (PyCFunction)BufferQueue_dopop_iov,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_iov},
+    {"peek_iov", (PyCFunction)BufferQueue_dopeek_iov,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_peek_iov},
+    {"pop_struct", (PyCFunction)BufferQueue_dopop_struct,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_struct},
+    {"try_pop_struct", (PyCFunction)BufferQueue_dotry_pop_struct,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_try_pop_struct},
+    {"pop_frames", (PyCFunction)BufferQueue_dopop_frames,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_frames},
+    {"popline", (PyCFunction)BufferQueue_dopopline,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_popline},
+    {"popline_match", (PyCFunction)BufferQueue_dopopline_match,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_popline_match},
+    {"popline_into", (PyCFunction)BufferQueue_dopopline_into,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_popline_into},
+    {"try_popline", (PyCFunction)BufferQueue_dotry_popline,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_try_popline},
+    {"poplines", (PyCFunction)BufferQueue_dopoplines,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_poplines},
+    {"memory_usage", (PyCFunction)BufferQueue_domemory_usage,
+        METH_NOARGS, BufferQueue_doc_memory_usage},
+    {"stats", (PyCFunction)BufferQueue_dostats,
+        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_stats},
+    {"cursor", (PyCFunction)BufferQueue_docursor,
+        METH_NOARGS, BufferQueue_doc_cursor},
+    {"clear", (PyCFunction)BufferQueue_doclear,
+        METH_NOARGS, BufferQueue_doc_clear},
+    {NULL}  /* Sentinel */
+};
+
+static PyObject *
+BufferQueue_repr(BufferQueue *self)
+{
+    return PyNativeString_FromFormat(
+        "<BufferQueue of " FMT_PY_SSIZE_T " bytes>", self->tot_length);
+}
+
+static PyObject *
+BufferQueue_iter(BufferQueue *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *
+BufferQueue_iternext(BufferQueue *self)
+{
+    PyObject *delim_obj, *matched;
+    Py_ssize_t out_string_size;
+    if (!(delim_obj = BufferQueue_line_delim(self, NULL)))
+        return NULL;
+
+    if ((out_string_size = BufferQueue_find_line(self, delim_obj,
+            &matched)) == -1) {
+        PyErr_SetNone(PyExc_StopIteration);
+        return NULL;
+    }
+    return BufferQueue_pop_released(self,
+        out_string_size + PyBytes_GET_SIZE(matched), 0);
+}
+
+static Py_ssize_t
+BufferQueue_length(BufferQueue *self)
+{
+    return self->tot_length;
+}
+
+static PySequenceMethods BufferQueue_as_sequence = {
+    (lenfunc)BufferQueue_length,
+};
+
+static PyTypeObject BufferQueueType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.BufferQueue",         /*tp_name*/
+    sizeof(BufferQueue),        /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)BufferQueue_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    (reprfunc)BufferQueue_repr, /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &BufferQueue_as_sequence,   /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    (reprfunc)BufferQueue_repr, /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    BufferQueue_doc,            /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    (getiterfunc)BufferQueue_iter, /* tp_iter */
+    (iternextfunc)BufferQueue_iternext, /* tp_iternext */
+    BufferQueue_methods,        /* tp_methods */
+    0,                          /* tp_members */
+    BufferQueue_getset,         /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    (initproc)BufferQueue_init, /* tp_init */
+    0,                          /* tp_alloc */
+    (newfunc)BufferQueue_new,   /* tp_new */
+};
+
+/* A pending read queued with add_read. For MODE_STATEFUL it wants size
+ * bytes; for MODE_DELIMITED, a line ended by delimiter (or, if that is
+ * NULL, by the buffer's own delimiter). */
+typedef struct {
+    int mode;
+    Py_ssize_t size;
+    PyObject *delimiter;
+    PyObject *callback;
+    PyObject *errback;
+} DispatcherRead;
+
+/* The drain loop behind twisted_support.MultiBufferer. Pending reads are
+ * kept in a ring like the BufferQueue's own, which only ever grows. state
+ * is NULL or a (callable, size) tuple, and state_size is its size. */
+typedef struct {
+    PyObject_HEAD
+    BufferQueue *buffer;
+    int mode;
+    int closed;
+    PyObject *state;
+    Py_ssize_t state_size;
+    DispatcherRead *reads;
+    Py_ssize_t reads_start;
+    Py_ssize_t n_reads;
+    Py_ssize_t reads_length;
+} Dispatcher;
+
+/* Attribute names are nearly always interned already, so comparing
+ * pointers is usually enough. */
+static int
+qbuf_name_is(PyObject *name, PyObject *interned)
+{
+    if (name == interned)
+        return 1;
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_Check(name) && !PyUnicode_Compare(name, interned);
+#else
+    return PyString_Check(name) && !strcmp(PyString_AS_STRING(name),
+        PyString_AS_STRING(interned));
+#endif
+}
+
+static int
+Dispatcher_set_mode(Dispatcher *self, PyObject *value)
+{
+    Py_ssize_t mode;
+    if ((mode = PyNumber_AsSsize_t(value, PyExc_OverflowError)) == -1
+            && PyErr_Occurred())
+        return -1;
+    if (mode < MODE_RAW || mode > MODE_STATEFUL) {
+        PyErr_SetString(PyExc_ValueError, "unknown buffering mode");
+        return -1;
+    }
+    self->mode = (int)mode;
+    return 0;
+}
+
+static int
+Dispatcher_set_state(Dispatcher *self, PyObject *value)
+{
+    PyObject *state;
+    Py_ssize_t size;
+    if (value == Py_None) {
+        Py_CLEAR(self->state);
+        return 0;
+    }
+    if (!(state = PySequence_Tuple(value)))
+        return -1;
+    if (PyTuple_GET_SIZE(state) != 2
+            || !PyCallable_Check(PyTuple_GET_ITEM(state, 0))) {
+        PyErr_SetString(PyExc_TypeError,
+            "state must be a (callable, bytes_to_read) tuple");
+        Py_DECREF(state);
+        return -1;
+    }
+    if ((size = PyNumber_AsSsize_t(PyTuple_GET_ITEM(state, 1),
+            PyExc_OverflowError)) == -1 && PyErr_Occurred()) {
+        Py_DECREF(state);
+        return -1;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError,
+            "state wants a negative number of bytes");
+        Py_DECREF(state);
+        return -1;
+    }
+    Py_XDECREF(self->state);
+    self->state = state;
+    self->state_size = size;
+    return 0;
+}
+
+static int
+Dispatcher_push_read(Dispatcher *self, DispatcherRead read)
+{
+    DispatcherRead *new_reads;
+    Py_ssize_t i, new_length;
+    if (self->n_reads == self->reads_length) {
+        new_length = self->reads_length?
+            self->reads_length * 2 : INITIAL_READS_SIZE;
+        if (!(new_reads = PyMem_New(DispatcherRead, new_length))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < self->n_reads; ++i)
+            new_reads[i] = self->reads[
+                (self->reads_start + i) % self->reads_length];
+        PyMem_Free(self->reads);
+        self->reads = new_reads;
+        self->reads_start = 0;
+        self->reads_length = new_length;
+    }
+    self->reads[(self->reads_start + self->n_reads++)
+        % self->reads_length] = read;
+    return 0;
+}
+
+/* Take the first pending read off the ring; the caller owns its
+ * references. */
+static DispatcherRead
+Dispatcher_shift_read(Dispatcher *self)
+{
+    DispatcherRead read = self->reads[self->reads_start];
+    if (++self->reads_start == self->reads_length)
+        self->reads_start = 0;
+    --self->n_reads;
+    return read;
+}
+
+static void
+DispatcherRead_clear(DispatcherRead *read)
+{
+    Py_CLEAR(read->delimiter);
+    Py_CLEAR(read->callback);
+    Py_CLEAR(read->errback);
+}
+
+static int
+Dispatcher_traverse(Dispatcher *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+    DispatcherRead *read;
+    Py_VISIT(self->buffer);
+    Py_VISIT(self->state);
+    for (i = 0; i < self->n_reads; ++i) {
+        read = &self->reads[(self->reads_start + i) % self->reads_length];
+        Py_VISIT(read->delimiter);
+        Py_VISIT(read->callback);
+        Py_VISIT(read->errback);
+    }
+    return 0;
+}
+
+static int
+Dispatcher_clear(Dispatcher *self)
+{
+    DispatcherRead read;
+    Py_CLEAR(self->buffer);
+    Py_CLEAR(self->state);
+    while (self->n_reads) {
+        read = Dispatcher_shift_read(self);
+        DispatcherRead_clear(&read);
+    }
+    return 0;
+}
+
+static void
+Dispatcher_dealloc(Dispatcher *self)
+{
+    PyObject_GC_UnTrack(self);
+    Dispatcher_clear(self);
+    PyMem_Free(self->reads);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* The mode and state start out as whatever the class (or a subclass) sets
+ * them to as class attributes. */
+static PyObject *
+Dispatcher_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Dispatcher *self;
+    PyObject *value;
+
+    if (!(self = (Dispatcher *)type->tp_alloc(type, 0)))
+        return NULL;
+    self->buffer = NULL;
+    self->mode = MODE_RAW;
+    self->closed = 0;
+    self->state = NULL;
+    self->state_size = 0;
+    self->reads = NULL;
+    self->reads_start = self->n_reads = self->reads_length = 0;
+
+    if ((value = PyObject_GetAttr((PyObject *)type, str_mode))) {
+        if (Dispatcher_set_mode(self, value) == -1)
+            goto error;
+        Py_DECREF(value);
+    } else if (PyErr_ExceptionMatches(PyExc_AttributeError))
+        PyErr_Clear();
+    else
+        goto error;
+    if ((value = PyObject_GetAttr((PyObject *)type, str_current_state))) {
+        if (Dispatcher_set_state(self, value) == -1)
+            goto error;
+        Py_DECREF(value);
+    } else if (PyErr_ExceptionMatches(PyExc_AttributeError))
+        PyErr_Clear();
+    else
+        goto error;
+    return (PyObject *)self;
+
+  error:
+    Py_XDECREF(value);
+    Py_DECREF(self);
+    return NULL;
+}
+
+static int
+Dispatcher_init(Dispatcher *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"delimiter", NULL};
+    PyObject *delim_obj = NULL, *buffer;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &delim_obj))
+        return -1;
+    if (!(buffer = PyObject_CallFunctionObjArgs((PyObject *)&BufferQueueType,
+            delim_obj, NULL)))
+        return -1;
+    Py_XDECREF(self->buffer);
+    self->buffer = (BufferQueue *)buffer;
+    return 0;
+}
+
+/* mode and current_state are looked up here first, ahead of any class
+ * attributes that give their defaults. */
+static PyObject *
+Dispatcher_getattro(Dispatcher *self, PyObject *name)
+{
+    if (qbuf_name_is(name, str_mode))
+        return PyInt_FromLong(self->mode);
+    if (qbuf_name_is(name, str_current_state)) {
+        if (!self->state)
+            Py_RETURN_NONE;
+        Py_INCREF(self->state);
+        return self->state;
+    }
+    return PyObject_GenericGetAttr((PyObject *)self, name);
+}
+
+static int
+Dispatcher_setattro(Dispatcher *self, PyObject *name, PyObject *value)
+{
+    int is_mode = qbuf_name_is(name, str_mode);
+    if (is_mode || qbuf_name_is(name, str_current_state)) {
+        if (!value) {
+            PyErr_SetString(PyExc_AttributeError, "can't delete attribute");
+            return -1;
+        }
+        return is_mode? Dispatcher_set_mode(self, value)
+            : Dispatcher_set_state(self, value);
+    }
+    return PyObject_GenericSetAttr((PyObject *)self, name, value);
+}
+
+/* Hand a payload to whoever is waiting for it: the first pending read if
+ * there is one, or otherwise the hook for the mode. */
+static int
+Dispatcher_deliver(Dispatcher *self, int mode, PyObject *payload)
+{
+    DispatcherRead read;
+    PyObject *result, *state;
+    int truth;
+    if (self->n_reads) {
+        read = Dispatcher_shift_read(self);
+        result = PyObject_CallFunctionObjArgs(read.callback, payload, NULL);
+        DispatcherRead_clear(&read);
+    } else if (mode == MODE_RAW) {
+        result = PyObject_CallMethodObjArgs((PyObject *)self,
+            str_rawDataReceived, payload, NULL);
+    } else if (mode == MODE_DELIMITED) {
+        result = PyObject_CallMethodObjArgs((PyObject *)self,
+            str_lineReceived, payload, NULL);
+    } else {
+        /* The callable could replace the state while it runs. */
+        state = self->state;
+        Py_INCREF(state);
+        result = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(state, 0),
+            payload, NULL);
+        Py_DECREF(state);
+        if (!result)
+            return -1;
+        if ((truth = PyObject_IsTrue(result)) == 1)
+            truth = Dispatcher_set_state(self, result);
+        Py_DECREF(result);
+        return (truth == -1)? -1 : 0;
+    }
+    if (!result)
+        return -1;
+    Py_DECREF(result);
+    return 0;
+}
+
+PyDoc_STRVAR(Dispatcher_doc_feed,
+"feed(data) -> None\n\
+\n\
+Push some data into the buffer, then hand out as much of what is\n\
+buffered as possible: to pending reads first, in the order they\n\
+were added, and then according to the mode. This stops once the\n\
+buffer is empty, there isn't enough in it for what comes next, or\n\
+the dispatcher is closed.\n\
+");
+
+static PyObject *
+Dispatcher_dofeed(Dispatcher *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"data", NULL};
+    PyObject *in_data, *payload, *matched, *ret = NULL;
+    BufferQueue *buffer;
+    Py_ssize_t size;
+    int mode, result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:feed", kwlist, &in_data))
+        return NULL;
+    if (self->closed)
+        Py_RETURN_NONE;
+    if (!self->buffer) {
+        PyErr_SetString(PyExc_ValueError, "Dispatcher.__init__ wasn't called");
+        return NULL;
+    }
+    /* Held in case a callback calls __init__ again. */
+    buffer = self->buffer;
+    Py_INCREF(buffer);
+    if (BufferQueue_push(buffer, in_data) == -1)
+        goto cleanup;
+
+    while (buffer->tot_length && !self->closed) {
+        mode = self->n_reads? self->reads[self->reads_start].mode : self->mode;
+        if (mode == MODE_RAW) {
+            if (!(payload = BufferQueue_pop_released(buffer,
+                    buffer->tot_length, 0)))
+                goto cleanup;
+        } else if (mode == MODE_DELIMITED) {
+            result = BufferQueue_popline(buffer, &payload, self->n_reads?
+                self->reads[self->reads_start].delimiter : NULL, &matched);
+            if (result == -1)
+                goto cleanup;
+            else if (result == 0)
+                break;
+            Py_DECREF(matched);
+        } else {
+            if (self->n_reads)
+                size = self->reads[self->reads_start].size;
+            else {
+                if (!self->state) {
+                    if (!(payload = PyObject_CallMethodObjArgs(
+                            (PyObject *)self, str_getInitialState, NULL)))
+                        goto cleanup;
+                    result = (payload == Py_None)? -2
+                        : Dispatcher_set_state(self, payload);
+                    Py_DECREF(payload);
+                    if (result == -2)
+                        PyErr_SetString(PyExc_TypeError,
+                            "getInitialState returned None");
+                    if (result < 0)
+                        goto cleanup;
+                    /* getInitialState might have queued a read. */
+                    continue;
+                }
+                size = self->state_size;
+            }
+            if (size > buffer->tot_length)
+                break;
+            if (!(payload = BufferQueue_pop_released(buffer, size, 0)))
+                goto cleanup;
+        }
+        result = Dispatcher_deliver(self, mode, payload);
+        Py_DECREF(payload);
+        if (result == -1)
+            goto cleanup;
+    }
+    Py_INCREF(Py_None);
+    ret = Py_None;
+
+  cleanup:
+    Py_DECREF(buffer);
+    return ret;
+}
+
+PyDoc_STRVAR(Dispatcher_doc_add_read,
+"add_read(callback, [mode], [extra], [errback]) -> None\n\
+\n\
+Queue up a read, which takes priority over the mode for the next\n\
+data to come in. For MODE_RAW (the default), callback is called with\n\
+the next data received; for MODE_STATEFUL, with the next extra\n\
+bytes; and for MODE_DELIMITED, with the next line, ended by extra if\n\
+it isn't None or by the buffer's delimiter otherwise. If the reads\n\
+are failed with fail_reads, errback is called instead.\n\
+");
+
+static PyObject *
+Dispatcher_doadd_read(Dispatcher *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"callback", "mode", "extra", "errback", NULL};
+    PyObject *extra = Py_None, *errback = Py_None;
+    DispatcherRead read;
+    read.mode = MODE_RAW;
+    read.size = 0;
+    read.delimiter = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iOO:add_read", kwlist,
+            &read.callback, &read.mode, &extra, &errback))
+        return NULL;
+    if (read.mode == MODE_STATEFUL) {
+        if ((read.size = PyNumber_AsSsize_t(extra, PyExc_OverflowError)) == -1
+                && PyErr_Occurred())
+            return NULL;
+        if (read.size < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                "tried to read a negative number of bytes");
+            return NULL;
+        }
+    } else if (read.mode == MODE_DELIMITED) {
+        if (extra != Py_None && !PyBytes_Check(extra)) {
+            PyErr_SetString(PyExc_TypeError,
+                "delimiter must be bytes or None");
+            return NULL;
+        }
+        if (extra != Py_None && PyBytes_GET_SIZE(extra))
+            read.delimiter = extra;
+    } else if (read.mode != MODE_RAW) {
+        PyErr_SetString(PyExc_ValueError, "unknown buffering mode");
+        return NULL;
+    }
+    read.errback = (errback == Py_None)? NULL : errback;
+    Py_XINCREF(read.delimiter);
+    Py_INCREF(read.callback);
+    Py_XINCREF(read.errback);
+    if (Dispatcher_push_read(self, read) == -1) {
+        DispatcherRead_clear(&read);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Dispatcher_doc_fail_reads,
+"fail_reads(reason) -> None\n\
+\n\
+Drop all of the pending reads, calling the errback of each one that\n\
+has one with reason.\n\
+");
+
+static PyObject *
+Dispatcher_dofail_reads(Dispatcher *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"reason", NULL};
+    PyObject *reason, *result;
+    DispatcherRead *reads = self->reads;
+    Py_ssize_t i, start = self->reads_start, n_reads = self->n_reads;
+    Py_ssize_t length = self->reads_length;
+    int failed = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:fail_reads", kwlist,
+            &reason))
+        return NULL;
+
+    /* Errbacks can add new reads, so start a fresh ring for them. */
+    self->reads = NULL;
+    self->reads_start = self->n_reads = self->reads_length = 0;
+    for (i = 0; i < n_reads; ++i) {
+        DispatcherRead *read = &reads[(start + i) % length];
+        if (read->errback && !failed) {
+            if ((result = PyObject_CallFunctionObjArgs(read->errback, reason,
+                    NULL)))
+                Py_DECREF(result);
+            else
+                failed = 1;
+        }
+        DispatcherRead_clear(read);
+    }
+    PyMem_Free(reads);
+    if (failed)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(Dispatcher_doc_close,
+"close() -> None\n\
+\n\
+Clear the buffer and stop dispatching; any data fed in afterwards is\n\
+ignored. Pending reads are left for fail_reads.\n\
+");
+
+static PyObject *
+Dispatcher_doclose(Dispatcher *self)
+{
+    self->closed = 1;
+    if (self->buffer)
+        Py_XDECREF(BufferQueue_doclear(self->buffer));
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Dispatcher_getbuffer(Dispatcher *self, void *closure)
+{
+    if (!self->buffer)
+        Py_RETURN_NONE;
+    Py_INCREF(self->buffer);
+    return (PyObject *)self->buffer;
+}
+
+static PyObject *
+Dispatcher_getclosed(Dispatcher *self, void *closure)
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyObject *
+Dispatcher_getpending(Dispatcher *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->n_reads);
+}
+
+static PyMethodDef Dispatcher_methods[] = {
+    {"feed", (PyCFunction)Dispatcher_dofeed,
+        METH_VARARGS | METH_KEYWORDS, Dispatcher_doc_feed},
+    {"add_read", (PyCFunction)Dispatcher_doadd_read,
+        METH_VARARGS | METH_KEYWORDS, Dispatcher_doc_add_read},
+    {"fail_reads", (PyCFunction)Dispatcher_dofail_reads,
+        METH_VARARGS | METH_KEYWORDS, Dispatcher_doc_fail_reads},
+    {"close", (PyCFunction)Dispatcher_doclose,
+        METH_NOARGS, Dispatcher_doc_close},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Dispatcher_getset[] = {
+    {"buffer",
+     (getter)Dispatcher_getbuffer, NULL,
+     "the BufferQueue that data fed in is buffered in",
+     NULL},
+    {"closed",
+     (getter)Dispatcher_getclosed, NULL,
+     "whether close() has been called",
+     NULL},
+    {"pending_reads",
+     (getter)Dispatcher_getpending, NULL,
+     "how many reads added with add_read are still waiting",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(Dispatcher_doc,
+"Dispatcher([delimiter])\n\
+\n\
+Buffer incoming data and hand it out as it becomes complete, the way\n\
+twisted_support.MultiBufferer does; it is that class's base. The\n\
+delimiter is used for the underlying BufferQueue.\n\
+\n\
+The mode attribute picks what happens to buffered data. In MODE_RAW,\n\
+self.rawDataReceived is called with all of it. In MODE_DELIMITED,\n\
+self.lineReceived is called with each complete line, without its\n\
+delimiter. In MODE_STATEFUL, current_state is a (callable, n_bytes)\n\
+tuple, and the callable is called with every n_bytes bytes; if it\n\
+returns a true value, that becomes the new state. When\n\
+current_state is None, self.getInitialState() is called for it.\n\
+The mode and current_state start out as the class attributes of\n\
+those names, if there are any.\n\
+");
+
+static PyTypeObject DispatcherType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.Dispatcher",          /*tp_name*/
+    sizeof(Dispatcher),         /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)Dispatcher_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    0,                          /*tp_repr*/
+    0,                          /*tp_as_number*/
+    0,                          /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    (getattrofunc)Dispatcher_getattro, /*tp_getattro*/
+    (setattrofunc)Dispatcher_setattro, /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    Dispatcher_doc,             /* tp_doc */
+    (traverseproc)Dispatcher_traverse, /* tp_traverse */
+    (inquiry)Dispatcher_clear,  /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    Dispatcher_methods,         /* tp_methods */
+    0,                          /* tp_members */
+    Dispatcher_getset,          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    (initproc)Dispatcher_init,  /* tp_init */
+    0,                          /* tp_alloc */
+    (newfunc)Dispatcher_new,    /* tp_new */
+};
+
+/* The header at the front of a SharedRing's memory. head is written only
+ * by the producer and tail only by the consumer, each on its own cache line
+ * along with the flag its writer sets before sleeping on a wakeup fd. Both
+ * count bytes from the start and never wrap; capacity is a power of two,
+ * so a count's place in the ring is count & (capacity - 1). */
+typedef struct {
+    PY_UINT64_T magic;
+    PY_UINT64_T capacity;
+    char pad0[SHARED_RING_LINE - 16];
+    PY_UINT64_T head;
+    PY_UINT64_T producer_waiting;
+    char pad1[SHARED_RING_LINE - 16];
+    PY_UINT64_T tail;
+    PY_UINT64_T consumer_waiting;
+    char pad2[SHARED_RING_LINE - 16];
+} SharedRingHeader;
+
+/* A single-producer, single-consumer byte ring in memory which may be
+ * shared with another process. head_seen and tail_seen are the last values
+ * read of the other side's index, which are only read again when they
+ * show too little room. The scan fields let popline carry on searching for
+ * scan_delim from scan_pos bytes past the consumer's index, as long as
+ * that's still scan_tail. header is NULL once the ring is released, which
+ * can't happen while n_waiters threads are waiting on it. */
+typedef struct {
+    PyObject_HEAD
+    Py_buffer view;
+    SharedRingHeader *header;
+    char *data;
+    Py_ssize_t capacity;
+    PY_UINT64_T head_seen;
+    PY_UINT64_T tail_seen;
+    PyObject *delim_obj;
+    PyObject *scan_delim;
+    PY_UINT64_T scan_tail;
+    Py_ssize_t scan_pos;
+    int data_fd;
+    int space_fd;
+    int n_waiters;
+} SharedRing;
+
+static int
+SharedRing_check(SharedRing *self)
+{
+    if (!self->header) {
+        PyErr_SetString(PyExc_ValueError, "operation on a released SharedRing");
+        return -1;
+    }
+    return 0;
+}
+
+/* How many bytes there are to pop. The producer's index is only read again
+ * if what was last seen of it shows fewer than need. */
+static Py_ssize_t
+SharedRing_available(SharedRing *self, Py_ssize_t need)
+{
+    PY_UINT64_T tail = qbuf_atomic_load(&self->header->tail);
+    if ((Py_ssize_t)(self->head_seen - tail) < need)
+        self->head_seen = qbuf_atomic_load(&self->header->head);
+    return (Py_ssize_t)(self->head_seen - tail);
+}
+
+/* How many bytes there is room to push, likewise. */
+static Py_ssize_t
+SharedRing_free(SharedRing *self, Py_ssize_t need)
+{
+    PY_UINT64_T head = qbuf_atomic_load(&self->header->head);
+    if (self->capacity - (Py_ssize_t)(head - self->tail_seen) < need)
+        self->tail_seen = qbuf_atomic_load(&self->header->tail);
+    return self->capacity - (Py_ssize_t)(head - self->tail_seen);
+}
+
+static int
+SharedRing_ready(SharedRing *self, int producer, Py_ssize_t need)
+{
+    if (producer)
+        return SharedRing_free(self, need) >= need;
+    return SharedRing_available(self, need) >= need;
+}
+
+/* Turn a timeout argument into a deadline for SharedRing_wait: 0 for no
+ * waiting, -1 for none at all, and otherwise a time from qbuf_monotonic.
+ * timeout_obj may be NULL for default_timeout. */
+static int
+SharedRing_deadline(PyObject *timeout_obj, double default_timeout,
+        double *deadline)
+{
+    double timeout = default_timeout;
+    if (timeout_obj == Py_None)
+        timeout = -1;
+    else if (timeout_obj) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1 && PyErr_Occurred())
+            return -1;
+        if (timeout < 0) {
+            PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+            return -1;
+        }
+        if (timeout > MAX_WAIT_TIMEOUT)
+            timeout = -1;
+    }
+    if (timeout > 0)
+        *deadline = qbuf_monotonic() + timeout;
+    else
+        *deadline = timeout;
+    return 0;
+}
+
+/* Block until there are need bytes to pop or, if producer is set, room for
+ * need bytes to be pushed, or until the deadline passes. The GIL is
+ * released while waiting. With a wakeup fd, the waiting side sets its flag
+ * and then checks once more before sleeping on the fd; the other side
+ * moves its index and then checks the flag, so one of them sees the
+ * other. Returns 0 once the ring is ready, 1 on timing out, and -1 if a
+ * signal handler raised. */
+static int
+SharedRing_wait(SharedRing *self, int producer, Py_ssize_t need,
+        double deadline)
+{
+    PY_UINT64_T *waiting = producer?
+        &self->header->producer_waiting : &self->header->consumer_waiting;
+    int fd = producer? self->space_fd : self->data_fd, ready, ms, result;
+    long sleep_us = SHARED_RING_MIN_SLEEP, us;
+    double left = -1;
+    ++self->n_waiters;
+    for (;;) {
+        if (SharedRing_ready(self, producer, need)) {
+            result = 0;
+            break;
+        }
+        if (deadline >= 0 && (left = deadline - qbuf_monotonic()) <= 0) {
+            result = 1;
+            break;
+        }
+        if (fd != -1) {
+            ms = WAIT_SLICE;
+            if (left >= 0 && left * 1000 < ms)
+                ms = (int)(left * 1000) + 1;
+            qbuf_atomic_store(waiting, 1);
+            qbuf_atomic_fence();
+            if (!(ready = SharedRing_ready(self, producer, need))) {
+                Py_BEGIN_ALLOW_THREADS
+                qbuf_event_wait(fd, ms);
+                Py_END_ALLOW_THREADS
+            }
+            qbuf_atomic_store(waiting, 0);
+            if (ready) {
+                result = 0;
+                break;
+            }
+        } else {
+            us = sleep_us;
+            if (left >= 0 && left * 1e6 < us)
+                us = (long)(left * 1e6) + 1;
+            Py_BEGIN_ALLOW_THREADS
+            qbuf_sleep_us(us);
+            Py_END_ALLOW_THREADS
+            if (sleep_us < SHARED_RING_MAX_SLEEP)
+                sleep_us *= 2;
+        }
+        if (PyErr_CheckSignals()) {
+            result = -1;
+            break;
+        }
+    }
+    --self->n_waiters;
+    return result;
+}
+
+/* Move the producer's index on past length pushed bytes, waking the
+ * consumer if it's waiting for them. */
+static void
+SharedRing_produced(SharedRing *self, Py_ssize_t length)
+{
+    SharedRingHeader *header = self->header;
+    qbuf_atomic_store(&header->head, qbuf_atomic_load(&header->head) + length);
+    if (self->data_fd != -1) {
+        qbuf_atomic_fence();
+        if (qbuf_atomic_load(&header->consumer_waiting))
+            qbuf_event_signal(self->data_fd);
+    }
+}
+
+/* Move the consumer's index on past length popped bytes, waking the
+ * producer if it's waiting for room. */
+static void
+SharedRing_consumed(SharedRing *self, Py_ssize_t length)
+{
+    SharedRingHeader *header = self->header;
+    qbuf_atomic_store(&header->tail, qbuf_atomic_load(&header->tail) + length);
+    if (self->space_fd != -1) {
+        qbuf_atomic_fence();
+        if (qbuf_atomic_load(&header->producer_waiting))
+            qbuf_event_signal(self->space_fd);
+    }
+}
+
+/* Copy length bytes into the ring at the producer's index, which must
+ * have room for them, without publishing them yet. */
+static void
+SharedRing_copy_in(SharedRing *self, const char *src, Py_ssize_t length)
+{
+    Py_ssize_t start = (Py_ssize_t)(qbuf_atomic_load(&self->header->head)
+        & (self->capacity - 1));
+    Py_ssize_t first = self->capacity - start;
+    if (first > length)
+        first = length;
+    memcpy(self->data + start, src, first);
+    memcpy(self->data, src + first, length - first);
+}
+
+/* Copy the first length bytes available to pop into dest, leaving them in
+ * the ring. */
+static void
+SharedRing_copy_out(SharedRing *self, char *dest, Py_ssize_t length)
+{
+    Py_ssize_t start = (Py_ssize_t)(qbuf_atomic_load(&self->header->tail)
+        & (self->capacity - 1));
+    Py_ssize_t first = self->capacity - start;
+    if (first > length)
+        first = length;
+    memcpy(dest, self->data + start, first);
+    memcpy(dest + first, self->data, length - first);
+}
+
+/* Pop length bytes, which must be available, then drop the drop bytes
+ * after them. */
+static PyObject *
+SharedRing_pop(SharedRing *self, Py_ssize_t length, Py_ssize_t drop)
+{
+    PyObject *ret;
+    if (!(ret = PyBytes_FromStringAndSize(NULL, length)))
+        return NULL;
+    SharedRing_copy_out(self, PyBytes_AS_STRING(ret), length);
+    SharedRing_consumed(self, length + drop);
+    return ret;
+}
+
+static int
+SharedRing_match_at(SharedRing *self, PY_UINT64_T pos, const char *needle,
+        Py_ssize_t n)
+{
+    Py_ssize_t i;
+    for (i = 0; i < n; ++i)
+        if (self->data[(pos + i) & (self->capacity - 1)] != needle[i])
+            return 0;
+    return 1;
+}
+
+/* Find delim within the first avail bytes available to pop, carrying on
+ * from where the last search for it stopped. The bytes from the consumer's
+ * index make up at most two stretches of the ring, before and after its
+ * end; each is searched in place, and then any match straddling the end is
+ * looked for. Returns the offset of the match, or -1. */
+static Py_ssize_t
+SharedRing_find(SharedRing *self, PyObject *delim, Py_ssize_t avail)
+{
+    const char *needle = PyBytes_AS_STRING(delim), *found;
+    Py_ssize_t n = PyBytes_GET_SIZE(delim), pos, start, size, i;
+    Py_ssize_t skip[256];
+    int have_skip = 0;
+    PY_UINT64_T tail = qbuf_atomic_load(&self->header->tail);
+    if (self->scan_delim != delim || self->scan_tail != tail) {
+        Py_INCREF(delim);
+        Py_XDECREF(self->scan_delim);
+        self->scan_delim = delim;
+        self->scan_tail = tail;
+        self->scan_pos = 0;
+    }
+
+    for (pos = self->scan_pos; pos + n <= avail; pos += size) {
+        start = (Py_ssize_t)((tail + pos) & (self->capacity - 1));
+        size = self->capacity - start;
+        if (size > avail - pos)
+            size = avail - pos;
+        if ((found = qbuf_search(self->data + start, size, needle, n, skip,
+                &have_skip)))
+            return self->scan_pos = pos + (found - (self->data + start));
+        if (pos + size == avail)
+            break;
+        for (i = (size >= n)? size - n + 1 : 0; i < size; ++i)
+            if (pos + i + n <= avail
+                    && SharedRing_match_at(self, tail + pos + i, needle, n))
+                return self->scan_pos = pos + i;
+    }
+    self->scan_pos = (avail >= n)? avail - n + 1 : 0;
+    return -1;
+}
+
+/* Pop the next line ended by delim_obj (or the ring's delimiter, if that's
+ * NULL) into *ret, returning 1, or return 0 if there isn't a complete one.
+ * A ring filled up without a delimiter in it can never hold a complete
+ * line, so that raises FrameTooLong. */
+static int
+SharedRing_popline(SharedRing *self, PyObject **ret, PyObject *delim_obj)
+{
+    Py_ssize_t avail, line_size;
+    if (!delim_obj)
+        delim_obj = self->delim_obj;
+    if (!delim_obj || !PyBytes_GET_SIZE(delim_obj)) {
+        PyErr_SetString(PyExc_ValueError, "no delimiter");
+        return -1;
+    }
+    avail = SharedRing_available(self, PY_SSIZE_T_MAX);
+    if ((line_size = SharedRing_find(self, delim_obj, avail)) == -1) {
+        if (avail == self->capacity) {
+            PyErr_Format(qbuf_frame_too_long, "no delimiter in a full ring "
+                "of " FMT_PY_SSIZE_T " bytes", self->capacity);
+            return -1;
+        }
+        return 0;
+    }
+    if (!(*ret = SharedRing_pop(self, line_size, PyBytes_GET_SIZE(delim_obj))))
         return -1;
-    Py_DECREF(delim);
-    *ret = (PyStringObject *)line;
     return 1;
 }
 
 static void
-BufferQueue_clear_buffer(BufferQueue *self)
+SharedRing_release(SharedRing *self)
 {
-    Py_ssize_t count, index = self->start_idx;
-    for (count = 0; count < self->n_items; ++count) {
-        Py_DECREF(self->buffer[index]);
-        if (++index == self->buffer_length)
-            index = 0;
+    if (self->header) {
+        PyBuffer_Release(&self->view);
+        self->header = NULL;
+        self->data = NULL;
     }
 }
 
 static void
-BufferQueue_dealloc(BufferQueue *self)
+SharedRing_dealloc(SharedRing *self)
 {
-    BufferQueue_clear_buffer(self);
-    PyMem_Free(self->buffer);
+    SharedRing_release(self);
     Py_CLEAR(self->delim_obj);
-    self->ob_type->tp_free((PyObject *)self);
+    Py_CLEAR(self->scan_delim);
+    Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 static PyObject *
-BufferQueue_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+SharedRing_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    BufferQueue *self;
+    SharedRing *self;
 
-    if ((self = (BufferQueue *)type->tp_alloc(type, 0))) {
-        self->buffer = NULL;
-        self->start_idx = self->end_idx = 0;
-        self->delim_obj = NULL;
-        self->n_items = self->tot_length = self->cur_offset = 0;
+    if ((self = (SharedRing *)type->tp_alloc(type, 0))) {
+        self->header = NULL;
+        self->data = NULL;
+        self->capacity = 0;
+        self->head_seen = self->tail_seen = 0;
+        self->delim_obj = self->scan_delim = NULL;
+        self->scan_tail = 0;
+        self->scan_pos = 0;
+        self->data_fd = self->space_fd = -1;
+        self->n_waiters = 0;
     }
 
     return (PyObject *)self;
 }
 
-static int BufferQueue_setdelim(BufferQueue *, PyObject *, void *);
+static int SharedRing_setdelim(SharedRing *, PyObject *, void *);
 
 static int
-BufferQueue_init(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_init(SharedRing *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"delimiter", NULL};
+    static char *kwlist[] = {
+        "buffer", "delimiter", "create", "data_fd", "space_fd", NULL};
     PyObject *delim_tmp = Py_None;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &delim_tmp))
-        return -1;
-
-    if (BufferQueue_setdelim(self, delim_tmp, NULL) == -1)
-        return -1;
-
-    self->buffer_length = INITIAL_BUFFER_SIZE;
-    if (!(self->buffer = PyMem_New(PyStringObject *, self->buffer_length))) {
-        Py_XDECREF(self->delim_obj);
-        PyErr_SetString(PyExc_MemoryError, "malloc of buffer failed");
+    SharedRingHeader *header;
+    Py_buffer view;
+    Py_ssize_t capacity, room;
+    int create = 0, data_fd = -1, space_fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|Oiii:SharedRing", kwlist,
+            &view, &delim_tmp, &create, &data_fd, &space_fd))
         return -1;
+    if (data_fd < -1 || space_fd < -1) {
+        PyErr_SetString(PyExc_ValueError, "wakeup fds must be -1 or valid");
+        goto error;
+    }
+    if (!QBUF_HAVE_EVENTS && (data_fd != -1 || space_fd != -1)) {
+        PyErr_SetString(PyExc_ValueError,
+            "wakeup fds aren't supported on this platform");
+        goto error;
+    }
+    if ((size_t)view.buf % sizeof(PY_UINT64_T)) {
+        PyErr_SetString(PyExc_ValueError, "buffer isn't 8-byte aligned");
+        goto error;
+    }
+    if ((room = view.len - (Py_ssize_t)sizeof(SharedRingHeader)) < 1) {
+        PyErr_SetString(PyExc_ValueError, "buffer is too small for a ring");
+        goto error;
+    }
+    header = (SharedRingHeader *)view.buf;
+    if (create) {
+        for (capacity = 1; capacity <= room / 2; capacity *= 2)
+            ;
+        memset(header, 0, sizeof(*header));
+        header->capacity = capacity;
+        qbuf_atomic_store(&header->magic, SHARED_RING_MAGIC);
+    } else {
+        if (qbuf_atomic_load(&header->magic) != SHARED_RING_MAGIC) {
+            PyErr_SetString(PyExc_ValueError,
+                "buffer doesn't hold a ring; pass create=True to make one");
+            goto error;
+        }
+        capacity = (Py_ssize_t)header->capacity;
+        if (capacity < 1 || capacity > room || (capacity & (capacity - 1))) {
+            PyErr_SetString(PyExc_ValueError, "ring header is corrupt");
+            goto error;
+        }
     }
+    if (SharedRing_setdelim(self, delim_tmp, NULL) == -1)
+        goto error;
 
+    SharedRing_release(self);
+    self->view = view;
+    self->header = header;
+    self->data = (char *)view.buf + sizeof(SharedRingHeader);
+    self->capacity = capacity;
+    self->head_seen = self->tail_seen = qbuf_atomic_load(&header->tail);
+    self->data_fd = data_fd;
+    self->space_fd = space_fd;
     return 0;
+
+  error:
+    PyBuffer_Release(&view);
+    return -1;
 }
 
 static PyObject *
-BufferQueue_getdelim(BufferQueue *self, void *closure)
+SharedRing_getdelim(SharedRing *self, void *closure)
 {
     if (!self->delim_obj)
-        return PyString_FromString("");
-    else {
-        Py_INCREF(self->delim_obj);
-        return self->delim_obj;
-    }
+        return PyBytes_FromString("");
+    Py_INCREF(self->delim_obj);
+    return self->delim_obj;
 }
 
 static int
-BufferQueue_setdelim(BufferQueue *self, PyObject *value, void *closure)
+SharedRing_setdelim(SharedRing *self, PyObject *value, void *closure)
 {
-    if (!PyString_Check(value) && value != Py_None) {
-        PyErr_SetString(PyExc_TypeError, "delimiter must be a string or None");
+    if (!value || (!PyBytes_Check(value) && value != Py_None)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
         return -1;
     }
-    Py_XDECREF(self->delim_obj);
-    if (value == Py_None || !PyString_GET_SIZE(value)) {
-        self->delim_obj = NULL;
-        return 0;
+    Py_CLEAR(self->delim_obj);
+    if (value != Py_None && PyBytes_GET_SIZE(value)) {
+        self->delim_obj = value;
+        Py_INCREF(self->delim_obj);
     }
-    self->delim_obj = value;
-    Py_INCREF(self->delim_obj);
     return 0;
 }
 
-static PyGetSetDef BufferQueue_getset[] = {
-    {"delimiter",
-     (getter)BufferQueue_getdelim, (setter)BufferQueue_setdelim,
-     "delimiter string",
-     NULL},
-    {NULL}  /* Sentinel */
-};
-
-PyDoc_STRVAR(BufferQueue_doc_push,
-"push(string) -> None\n\
-\n\
-Push a string into the buffer.\n\
-");
+static PyObject *
+SharedRing_getcapacity(SharedRing *self, void *closure)
+{
+    return PyInt_FromSsize_t(self->capacity);
+}
 
 static PyObject *
-BufferQueue_dopush(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_getreleased(SharedRing *self, void *closure)
 {
-    static char *kwlist[] = {"string", NULL};
-    PyStringObject *in_string;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "S:push", kwlist,
-            &in_string))
-        return NULL;
-    if (BufferQueue_push(self, in_string) == -1)
-        return NULL;
-    if (PyString_GET_SIZE(in_string))
-        Py_INCREF(in_string);
-    Py_RETURN_NONE;
+    return PyBool_FromLong(!self->header);
 }
 
-PyDoc_STRVAR(BufferQueue_doc_push_many,
-"push_many(iterable) -> None\n\
+PyDoc_STRVAR(SharedRing_doc_push,
+"push(data, [timeout]) -> None\n\
 \n\
-Push each string in the provided iterable into the buffer.\n\
+Copy some bytes into the ring. If there isn't room for them yet, wait\n\
+for the consumer to make some: for up to timeout seconds if one is\n\
+given, and otherwise indefinitely. Raises BufferOverflow on timing\n\
+out, and ValueError if the data is larger than the whole ring.\n\
 ");
 
 static PyObject *
-BufferQueue_dopush_many(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_dopush(SharedRing *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"iterable", NULL};
-    PyObject *iter = NULL, *item = NULL, *ret = NULL;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:push_many", kwlist,
-            &iter))
+    static char *kwlist[] = {"data", "timeout", NULL};
+    PyObject *timeout_obj = NULL, *ret = NULL;
+    Py_buffer data;
+    double deadline;
+    int result;
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|O:push", kwlist,
+#else
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s*|O:push", kwlist,
+#endif
+            &data, &timeout_obj))
+        return NULL;
+    if (SharedRing_check(self) == -1
+            || SharedRing_deadline(timeout_obj, -1, &deadline) == -1)
         goto cleanup;
-    if (!(iter = PyObject_GetIter(iter)))
+    if (data.len > self->capacity) {
+        PyErr_Format(PyExc_ValueError, "tried to push " FMT_PY_SSIZE_T
+            " bytes into a ring of " FMT_PY_SSIZE_T " bytes",
+            data.len, self->capacity);
         goto cleanup;
-
-    while ((item = PyIter_Next(iter))) {
-        if (!PyString_Check(item)) {
-            PyErr_Format(PyExc_TypeError, "push_many() requires an iterable "
-                "of strings (got %.50s instead)", item->ob_type->tp_name);
+    }
+    if (!SharedRing_ready(self, 1, data.len)) {
+        if (!deadline || (result = SharedRing_wait(self, 1, data.len,
+                deadline)) == 1) {
+            PyErr_Format(qbuf_overflow, "buffer overflow: " FMT_PY_SSIZE_T
+                " bytes free, tried to push " FMT_PY_SSIZE_T " bytes",
+                SharedRing_free(self, data.len), data.len);
             goto cleanup;
-        }
-        if (BufferQueue_push(self, (PyStringObject *)item) == -1)
+        } else if (result == -1)
             goto cleanup;
     }
-    item = NULL;
-
-    if (PyErr_Occurred())
-        goto cleanup;
-
+    SharedRing_copy_in(self, data.buf, data.len);
+    SharedRing_produced(self, data.len);
     ret = Py_None;
     Py_INCREF(ret);
 
-cleanup:
-    Py_XDECREF(iter);
-    Py_XDECREF(item);
+  cleanup:
+    PyBuffer_Release(&data);
     return ret;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_pop,
-"pop([length]) -> str\n\
+PyDoc_STRVAR(SharedRing_doc_pop,
+"pop([length], [timeout]) -> bytes\n\
 \n\
-Pop some bytes out of the buffer. If no argument is provided, pop\n\
-the entire buffer out. Raises a BufferUnderflow exception if the\n\
-buffer would underflow.\n\
+Pop some bytes out of the ring. If no length is provided, pop out\n\
+everything in it. Raises a BufferUnderflow exception if the ring\n\
+would underflow.\n\
+\n\
+If a timeout in seconds is given, or None to wait indefinitely, pop\n\
+waits for the producer to push enough data (or any at all, if no\n\
+length was given) before giving up with BufferUnderflow.\n\
 ");
 
 static PyObject *
-BufferQueue_dopop(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_dopop(SharedRing *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"length", NULL};
-    Py_ssize_t out_string_size = self->tot_length;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|" ARG_PY_SSIZE_T ":pop",
-            kwlist, &out_string_size))
+    static char *kwlist[] = {"length", "timeout", NULL};
+    PyObject *length_obj = Py_None, *timeout_obj = NULL;
+    Py_ssize_t length = -1, avail;
+    double deadline;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:pop", kwlist,
+            &length_obj, &timeout_obj))
         return NULL;
-    if (out_string_size < 0) {
-        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
-            "bytes from buffer");
+    if (SharedRing_check(self) == -1)
         return NULL;
-    } else if (out_string_size > self->tot_length) {
+    if (length_obj != Py_None) {
+        length = PyNumber_AsSsize_t(length_obj, PyExc_OverflowError);
+        if (length == -1 && PyErr_Occurred())
+            return NULL;
+        if (length < 0) {
+            PyErr_SetString(PyExc_ValueError, "tried to pop a negative "
+                "number of bytes from buffer");
+            return NULL;
+        }
+    }
+    if (SharedRing_deadline(timeout_obj, 0, &deadline) == -1)
+        return NULL;
+
+    if (deadline && length <= self->capacity && SharedRing_wait(self, 0,
+            (length == -1)? 1 : length, deadline) == -1)
+        return NULL;
+    avail = SharedRing_available(self, (length == -1)? PY_SSIZE_T_MAX : length);
+    if (length == -1) {
+        if (deadline && !avail) {
+            PyErr_SetString(qbuf_underflow,
+                "buffer underflow: nothing was pushed before the timeout");
+            return NULL;
+        }
+        length = avail;
+    }
+    else if (length > avail) {
         PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
             FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T " bytes",
-            self->tot_length, out_string_size);
+            avail, length);
         return NULL;
     }
-    return BufferQueue_pop(self, out_string_size, 0);
+    return SharedRing_pop(self, length, 0);
 }
 
-PyDoc_STRVAR(BufferQueue_doc_pop_atmost,
-"pop_atmost(length) -> str\n\
+PyDoc_STRVAR(SharedRing_doc_pop_struct,
+"pop_struct(format, [timeout]) -> tuple\n\
 \n\
-Pop at most some number of bytes from the buffer. The returned\n\
-string will have a length anywhere between 0 and the length\n\
-provided.\n\
+Pop some bytes from the ring and unpack them using the 'struct'\n\
+module, returning the resulting tuple. The format string passed is\n\
+the same as the 'struct' module format. Waits for the bytes like pop.\n\
 ");
 
 static PyObject *
-BufferQueue_dopop_atmost(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_dopop_struct(SharedRing *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"length", NULL};
-    Py_ssize_t out_string_size;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, ARG_PY_SSIZE_T ":pop_atmost",
-            kwlist, &out_string_size))
+    static char *kwlist[] = {"format", "timeout", NULL};
+    unsigned char data[FAST_STRUCT_MAX_FIELDS * 8];
+    PyObject *format, *timeout_obj = NULL, *tmp, *ret = NULL;
+    StructCacheEntry *entry;
+    Py_ssize_t avail;
+    double deadline;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:pop_struct",
+            kwlist, &format, &timeout_obj))
         return NULL;
-    if (out_string_size < 0) {
-        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
-            "bytes from buffer");
+    if (SharedRing_check(self) == -1
+            || SharedRing_deadline(timeout_obj, 0, &deadline) == -1)
+        return NULL;
+    if (!(entry = qbuf_struct_lookup(format)))
         return NULL;
+
+    if (deadline && entry->size <= self->capacity
+            && SharedRing_wait(self, 0, entry->size, deadline) == -1)
+        goto cleanup;
+    if ((avail = SharedRing_available(self, entry->size)) < entry->size)
+        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
+            FMT_PY_SSIZE_T " bytes; this struct format requires "
+            FMT_PY_SSIZE_T " bytes", avail, entry->size);
+    else if (entry->n_fields) {
+        SharedRing_copy_out(self, (char *)data, entry->size);
+        SharedRing_consumed(self, entry->size);
+        ret = StructCacheEntry_decode(entry, data);
+    } else if ((tmp = SharedRing_pop(self, entry->size, 0))) {
+        ret = PyObject_CallMethod(entry->struct_obj, "unpack", "O", tmp);
+        Py_DECREF(tmp);
     }
-    if (out_string_size > self->tot_length)
-        out_string_size = self->tot_length;
-    return BufferQueue_pop(self, out_string_size, 0);
+
+  cleanup:
+    Py_DECREF(entry);
+    return ret;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_pop_view,
-"pop_view([length]) -> buffer\n\
+PyDoc_STRVAR(SharedRing_doc_popline,
+"popline([delimiter], [timeout]) -> bytes\n\
 \n\
-Pop some bytes from the buffer and return it as a python 'buffer'\n\
-object. If possible, no new strings will be constructed and the\n\
-buffer returned will just be a view of one of the strings pushed\n\
-into the buffer.\n\
+Pop one line of data from the ring, without the delimiter that ends\n\
+it: the provided one, or the ring's own if none was provided. If\n\
+there's no complete line, a ValueError is raised, unless a timeout in\n\
+seconds (or None to wait indefinitely) is given to wait for one to be\n\
+pushed first. If the ring fills up without a delimiter in it,\n\
+FrameTooLong is raised, since the line could never fit.\n\
 ");
 
 static PyObject *
-BufferQueue_dopop_view(BufferQueue *self, PyObject *args, PyObject *kwds)
+SharedRing_dopopline(SharedRing *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"length", NULL};
-    Py_ssize_t out_string_size = self->tot_length;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds,
-            "|" ARG_PY_SSIZE_T ":pop_view", kwlist, &out_string_size))
+    static char *kwlist[] = {"delimiter", "timeout", NULL};
+    PyObject *delim_obj = Py_None, *timeout_obj = NULL, *ret;
+    Py_ssize_t avail;
+    double deadline;
+    int result;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:popline", kwlist,
+            &delim_obj, &timeout_obj))
         return NULL;
-    if (out_string_size < 0) {
-        PyErr_SetString(PyExc_ValueError, "tried to pop a negative number of "
-            "bytes from buffer");
+    if (delim_obj != Py_None && !PyBytes_Check(delim_obj)) {
+        PyErr_SetString(PyExc_TypeError, "delimiter must be bytes or None");
         return NULL;
-    } else if (out_string_size > self->tot_length) {
-        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
-            FMT_PY_SSIZE_T " bytes, tried to pop " FMT_PY_SSIZE_T " bytes",
-            self->tot_length, out_string_size);
+    }
+    if (SharedRing_check(self) == -1
+            || SharedRing_deadline(timeout_obj, 0, &deadline) == -1)
+        return NULL;
+
+    for (;;) {
+        result = SharedRing_popline(self, &ret,
+            (delim_obj == Py_None)? NULL : delim_obj);
+        if (result == -1)
+            return NULL;
+        else if (result == 1)
+            return ret;
+        avail = SharedRing_available(self, PY_SSIZE_T_MAX);
+        if (!deadline || (result = SharedRing_wait(self, 0, avail + 1,
+                deadline)) == 1) {
+            PyErr_SetString(PyExc_ValueError, "delimiter not found");
+            return NULL;
+        } else if (result == -1)
+            return NULL;
+    }
+}
+
+PyDoc_STRVAR(SharedRing_doc_release,
+"release() -> None\n\
+\n\
+Stop using the memory the ring was made with, releasing the buffer\n\
+export, so that e.g. a SharedMemory holding it can be closed. Using\n\
+the ring afterwards raises a ValueError. Raises BufferError if another\n\
+thread is waiting on the ring.\n\
+");
+
+static PyObject *
+SharedRing_dorelease(SharedRing *self)
+{
+    if (self->n_waiters) {
+        PyErr_SetString(PyExc_BufferError,
+            "can't release a SharedRing while it's being waited on");
         return NULL;
     }
-    return BufferQueue_pop(self, out_string_size, 1);
+    SharedRing_release(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SharedRing_repr(SharedRing *self)
+{
+    if (!self->header)
+        return PyNativeString_FromFormat("<SharedRing (released)>");
+    return PyNativeString_FromFormat("<SharedRing of " FMT_PY_SSIZE_T
+        " bytes with " FMT_PY_SSIZE_T " to pop>", self->capacity,
+        SharedRing_available(self, PY_SSIZE_T_MAX));
+}
+
+static Py_ssize_t
+SharedRing_length(SharedRing *self)
+{
+    if (SharedRing_check(self) == -1)
+        return -1;
+    return SharedRing_available(self, PY_SSIZE_T_MAX);
+}
+
+static PyMethodDef SharedRing_methods[] = {
+    {"push", (PyCFunction)SharedRing_dopush,
+        METH_VARARGS | METH_KEYWORDS, SharedRing_doc_push},
+    {"pop", (PyCFunction)SharedRing_dopop,
+        METH_VARARGS | METH_KEYWORDS, SharedRing_doc_pop},
+    {"pop_struct", (PyCFunction)SharedRing_dopop_struct,
+        METH_VARARGS | METH_KEYWORDS, SharedRing_doc_pop_struct},
+    {"popline", (PyCFunction)SharedRing_dopopline,
+        METH_VARARGS | METH_KEYWORDS, SharedRing_doc_popline},
+    {"release", (PyCFunction)SharedRing_dorelease,
+        METH_NOARGS, SharedRing_doc_release},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef SharedRing_getset[] = {
+    {"delimiter",
+     (getter)SharedRing_getdelim, (setter)SharedRing_setdelim,
+     "the delimiter popline uses by default; only the popping side's "
+     "matters",
+     NULL},
+    {"capacity",
+     (getter)SharedRing_getcapacity, NULL,
+     "how many bytes the ring holds",
+     NULL},
+    {"released",
+     (getter)SharedRing_getreleased, NULL,
+     "whether release() has been called",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods SharedRing_as_sequence = {
+    (lenfunc)SharedRing_length, /* sq_length */
+};
+
+PyDoc_STRVAR(SharedRing_doc,
+"SharedRing(buffer, [delimiter], [create], [data_fd], [space_fd])\n\
+\n\
+A byte ring laid out in a writable buffer, such as the memory of a\n\
+multiprocessing.shared_memory.SharedMemory or an mmap, through which\n\
+one process pushes data and another pops it, with the same methods as\n\
+a BufferQueue. Each process makes its own SharedRing over the shared\n\
+memory; create=True sets up a new, empty ring in it, which takes the\n\
+largest power-of-two number of bytes that fits after a header of\n\
+header_size bytes. There must be only one pushing and one popping\n\
+side at a time. No locks are taken: each side moves its own index\n\
+forward once it has copied data in or out.\n\
+\n\
+A side that has to wait sleeps briefly between checks, unless it's\n\
+given eventfds (e.g. from os.eventfd) to be woken up through: data_fd\n\
+for when data is pushed, and space_fd for when room is made. Both\n\
+sides must be given the same fds, which aren't closed by the ring.\n\
+multiprocessing_support.SharedRingHandle sets all of this up.\n\
+");
+
+static PyTypeObject SharedRingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.SharedRing",          /*tp_name*/
+    sizeof(SharedRing),         /*tp_basicsize*/
+    0,                          /*tp_itemsize*/
+    (destructor)SharedRing_dealloc, /*tp_dealloc*/
+    0,                          /*tp_print*/
+    0,                          /*tp_getattr*/
+    0,                          /*tp_setattr*/
+    0,                          /*tp_compare*/
+    (reprfunc)SharedRing_repr,  /*tp_repr*/
+    0,                          /*tp_as_number*/
+    &SharedRing_as_sequence,    /*tp_as_sequence*/
+    0,                          /*tp_as_mapping*/
+    0,                          /*tp_hash */
+    0,                          /*tp_call*/
+    0,                          /*tp_str*/
+    0,                          /*tp_getattro*/
+    0,                          /*tp_setattro*/
+    0,                          /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+    SharedRing_doc,             /* tp_doc */
+    0,                          /* tp_traverse */
+    0,                          /* tp_clear */
+    0,                          /* tp_richcompare */
+    0,                          /* tp_weaklistoffset */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    SharedRing_methods,         /* tp_methods */
+    0,                          /* tp_members */
+    SharedRing_getset,          /* tp_getset */
+    0,                          /* tp_base */
+    0,                          /* tp_dict */
+    0,                          /* tp_descr_get */
+    0,                          /* tp_descr_set */
+    0,                          /* tp_dictoffset */
+    (initproc)SharedRing_init,  /* tp_init */
+    0,                          /* tp_alloc */
+    (newfunc)SharedRing_new,    /* tp_new */
+};
+
+#ifdef QBUF_HAVE_EPOLL
+
+/* A BufferQueue registered with a Poller, and the most to read into it at
+ * once. */
+typedef struct {
+    BufferQueue *queue;
+    Py_ssize_t max_bytes;
+} PollerEntry;
+
+/* A read set up by Poller_dopoll, to be done with the GIL released, into
+ * memory claimed from slab. */
+typedef struct {
+    int fd;
+    BufferQueue *queue;
+    BufferSlab *slab;
+    char *dest;
+    Py_ssize_t max_bytes;
+    Py_ssize_t n_read;
+    int err;
+} PollerRead;
+
+/* Registered queues are kept in entries, indexed by fd, which grows to
+ * fit the largest one registered. epfd is -1 once the poller is closed. */
+typedef struct {
+    PyObject_HEAD
+    int epfd;
+    PollerEntry *entries;
+    int entries_length;
+    Py_ssize_t n_registered;
+} Poller;
+
+static int
+Poller_check(Poller *self)
+{
+    if (self->epfd == -1) {
+        PyErr_SetString(PyExc_ValueError, "operation on a closed Poller");
+        return -1;
+    }
+    return 0;
+}
+
+/* Forget the queue registered for fd, which must have one. */
+static void
+Poller_remove(Poller *self, int fd)
+{
+    struct epoll_event event;
+    /* Closing the fd takes it out of the epoll set already, so there's
+     * nothing to be done if this fails. */
+    epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, &event);
+    Py_CLEAR(self->entries[fd].queue);
+    --self->n_registered;
+}
+
+static int
+Poller_traverse(Poller *self, visitproc visit, void *arg)
+{
+    int fd;
+    for (fd = 0; fd < self->entries_length; ++fd)
+        Py_VISIT(self->entries[fd].queue);
+    return 0;
+}
+
+static int
+Poller_clear(Poller *self)
+{
+    int fd;
+    for (fd = 0; fd < self->entries_length; ++fd)
+        Py_CLEAR(self->entries[fd].queue);
+    self->n_registered = 0;
+    return 0;
+}
+
+static void
+Poller_dealloc(Poller *self)
+{
+    PyObject_GC_UnTrack(self);
+    Poller_clear(self);
+    PyMem_Free(self->entries);
+    if (self->epfd != -1)
+        close(self->epfd);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+Poller_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Poller *self;
+
+    if ((self = (Poller *)type->tp_alloc(type, 0))) {
+        self->entries = NULL;
+        self->entries_length = 0;
+        self->n_registered = 0;
+        if ((self->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+
+    return (PyObject *)self;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_pop_struct,
-"pop_struct(format) -> tuple\n\
+PyDoc_STRVAR(Poller_doc_register,
+"register(fd, buffer, [max_bytes]) -> None\n\
 \n\
-Pop some bytes from the buffer and unpack them using the 'struct'\n\
-module, returning the resulting tuple. The format string passed is\n\
-the same as the 'struct' module format.\n\
+Have poll read from a file descriptor, or an object with a fileno()\n\
+method such as a socket, into a BufferQueue, at most max_bytes\n\
+(default 4096) at a time. The descriptor should be non-blocking.\n\
+Registering a descriptor again replaces its buffer and max_bytes.\n\
 ");
 
 static PyObject *
-BufferQueue_dopop_struct(BufferQueue *self, PyObject *args, PyObject *kwds)
+Poller_doregister(Poller *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"format", NULL};
-    PyObject *format, *struct_obj = NULL, *tmp = NULL, *ret = NULL;
-    Py_ssize_t fmt_length;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:pop_struct",
-            kwlist, &format))
-        goto cleanup;
-    if (!(struct_obj = PyObject_CallFunction(_struct_obj, "O", format)))
-        goto cleanup;
-    if (!(tmp = PyObject_GetAttrString(struct_obj, "size")))
-        goto cleanup;
-    if ((fmt_length = PyNumber_AsSsize_t(tmp, PyExc_OverflowError)) == -1
-            && PyErr_Occurred())
-        goto cleanup;
-    Py_CLEAR(tmp);
-    if (fmt_length > self->tot_length) {
-        PyErr_Format(qbuf_underflow, "buffer underflow: currently at "
-            FMT_PY_SSIZE_T " bytes; this struct format requires "
-            FMT_PY_SSIZE_T " bytes",
-            self->tot_length, fmt_length);
-        goto cleanup;
-    } else if (fmt_length < 0) {
-        PyErr_Format(PyExc_ValueError,
-            "got a negative length from struct.calcsize");
-        goto cleanup;
+    static char *kwlist[] = {"fd", "buffer", "max_bytes", NULL};
+    PyObject *fd_obj, *queue;
+    PollerEntry *entries;
+    Py_ssize_t max_bytes = SLAB_MIN_SIZE;
+    struct epoll_event event;
+    int fd, length;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds,
+            "OO!|" ARG_PY_SSIZE_T ":register", kwlist,
+            &fd_obj, &BufferQueueType, &queue, &max_bytes))
+        return NULL;
+    if (Poller_check(self) == -1)
+        return NULL;
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
+        return NULL;
+    if (max_bytes <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes must be positive");
+        return NULL;
     }
-    if (!(tmp = BufferQueue_pop(self, fmt_length, 1)))
-        goto cleanup;
-    if (!(ret = PyObject_CallMethod(struct_obj, "unpack_from", "O", tmp)))
-        goto cleanup;
 
-cleanup:
-    Py_XDECREF(struct_obj);
-    Py_XDECREF(tmp);
-    return ret;
+    if (fd >= self->entries_length) {
+        for (length = self->entries_length? self->entries_length : 64;
+                length <= fd; length *= 2)
+            ;
+        entries = self->entries;
+        if (!PyMem_Resize(entries, PollerEntry, length))
+            return PyErr_NoMemory();
+        memset(entries + self->entries_length, 0,
+            (length - self->entries_length) * sizeof(PollerEntry));
+        self->entries = entries;
+        self->entries_length = length;
+    }
+    if (!self->entries[fd].queue) {
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        event.data.fd = fd;
+        if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+            return PyErr_SetFromErrno(PyExc_OSError);
+        ++self->n_registered;
+    }
+    Py_INCREF(queue);
+    Py_XDECREF(self->entries[fd].queue);
+    self->entries[fd].queue = (BufferQueue *)queue;
+    self->entries[fd].max_bytes = max_bytes;
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_popline,
-"popline([delimiter]) -> str\n\
+PyDoc_STRVAR(Poller_doc_unregister,
+"unregister(fd) -> None\n\
 \n\
-Pop one line of data from the buffer. This scans the buffer for\n\
-the next occurrence of the provided delimiter, or the buffer's\n\
-delimiter if none was provided, and then returns everything up\n\
-to and including the delimiter. If the delimiter was not found\n\
-or there was no delimiter set, a ValueError is raised. The \n\
-delimiter is not included in the string returned.\n\
+Stop reading from a file descriptor. Raises KeyError if it isn't\n\
+registered.\n\
 ");
 
 static PyObject *
-BufferQueue_dopopline(BufferQueue *self, PyObject *args, PyObject *kwds)
+Poller_dounregister(Poller *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"delimiter", NULL};
-    PyObject *delim_obj = Py_None;
-    PyStringObject *ret;
-    int result;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:popline", kwlist,
-            &delim_obj))
+    static char *kwlist[] = {"fd", NULL};
+    PyObject *fd_obj;
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:unregister", kwlist,
+            &fd_obj))
         return NULL;
-    if (delim_obj != Py_None && !PyString_Check(delim_obj))
+    if (Poller_check(self) == -1)
         return NULL;
-    result = BufferQueue_popline(self, &ret,
-        (delim_obj == Py_None)? NULL : (PyStringObject *)delim_obj);
-    if (result == -1)
+    if ((fd = PyObject_AsFileDescriptor(fd_obj)) == -1)
         return NULL;
-    else if (result == 0) {
-        PyErr_SetString(PyExc_ValueError, "delimiter not found");
+    if (fd >= self->entries_length || !self->entries[fd].queue) {
+        PyErr_SetObject(PyExc_KeyError, fd_obj);
         return NULL;
     }
-    return (PyObject *)ret;
+    Poller_remove(self, fd);
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_poplines,
-"poplines([delimiter]) -> list\n\
+/* Report how a read went as a (queue, lines) tuple appended to ret: lines
+ * is None once the descriptor is done with, and otherwise the complete
+ * lines in the queue, or [] if it has no delimiter. Reads which found no
+ * new line aren't reported. */
+static int
+Poller_report(Poller *self, PollerRead *op, PyObject *ret)
+{
+    BufferQueue *queue = op->queue;
+    PyObject *lines, *item, *args;
+    int result;
+    if (op->n_read < 0 && QBUF_WOULDBLOCK(op->err))
+        return 0;
+    if (op->n_read <= 0) {
+        if (op->fd < self->entries_length
+                && self->entries[op->fd].queue == queue)
+            Poller_remove(self, op->fd);
+        lines = Py_None;
+        Py_INCREF(lines);
+    } else if (!queue->delim_set && !queue->delim_obj)
+        lines = PyList_New(0);
+    else {
+        if (!(args = PyTuple_New(0)))
+            return -1;
+        lines = BufferQueue_dopoplines(queue, args, NULL);
+        Py_DECREF(args);
+        if (lines && !PyList_GET_SIZE(lines)) {
+            Py_DECREF(lines);
+            return 0;
+        }
+    }
+    if (!lines)
+        return -1;
+    if (!(item = PyTuple_Pack(2, (PyObject *)queue, lines))) {
+        Py_DECREF(lines);
+        return -1;
+    }
+    Py_DECREF(lines);
+    result = PyList_Append(ret, item);
+    Py_DECREF(item);
+    return result;
+}
+
+PyDoc_STRVAR(Poller_doc_poll,
+"poll([timeout], [max_events]) -> list\n\
 \n\
-Pop as many lines off of the buffer as is possible. This will\n\
-collect and return a list of all of the lines that were in the\n\
-buffer. If there was no delimiter set and no delimiter was \n\
-provided, a ValueError is raised. The delimiter is not included\n\
-in the strings returned.\n\
+Wait up to timeout seconds (or indefinitely, if it's None or not\n\
+given) for registered descriptors to become readable, then read from\n\
+each into its buffer and pop out all of the complete lines. The\n\
+waiting and all of the reads happen in one go with the GIL released.\n\
+At most max_events (default 1024) descriptors are read from per call.\n\
+\n\
+Returns a list of (buffer, lines) tuples for the buffers which got\n\
+new lines, or, if they have no delimiter, any data; lines is then\n\
+empty, and the data is left in the buffer. If the other end closed\n\
+a descriptor or reading from it failed, it's unregistered and lines\n\
+is None.\n\
 ");
 
 static PyObject *
-BufferQueue_dopoplines(BufferQueue *self, PyObject *args, PyObject *kwds)
+Poller_dopoll(Poller *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"delimiter", NULL};
-    PyObject *ret, *delim_obj = Py_None;
-    PyStringObject *ret_str;
-    int result;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:popline", kwlist,
-            &delim_obj))
+    static char *kwlist[] = {"timeout", "max_events", NULL};
+    PyObject *timeout_obj = Py_None, *ret = NULL;
+    struct epoll_event *events = NULL;
+    PollerRead *reads = NULL, *op;
+    PollerEntry *entry;
+    BufferQueue *queue;
+    double timeout;
+    int max_events = POLLER_MAX_EVENTS, ms = -1, n_events, n_reads = 0, i;
+    int n_finished = 0, err = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Oi:poll", kwlist,
+            &timeout_obj, &max_events))
         return NULL;
-    if (delim_obj != Py_None && !PyString_Check(delim_obj))
+    if (Poller_check(self) == -1)
         return NULL;
-    ret = PyList_New(0);
-    if (ret == NULL)
+    if (max_events <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_events must be positive");
         return NULL;
-    if (delim_obj == Py_None)
-        delim_obj = NULL;
-    while ((result = BufferQueue_popline(
-            self, &ret_str, (PyStringObject *)delim_obj)) == 1) {
-        PyList_Append(ret, (PyObject *)ret_str);
-        Py_DECREF(ret_str);
     }
-    if (result == -1) {
-        Py_DECREF(ret);
-        return NULL;
+    if (timeout_obj != Py_None) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if (timeout == -1 && PyErr_Occurred())
+            return NULL;
+        if (timeout < 0) {
+            PyErr_SetString(PyExc_ValueError, "timeout must be non-negative");
+            return NULL;
+        }
+        if (timeout * 1000 < INT_MAX)
+            ms = (int)(timeout * 1000 + 0.999);
+    }
+    if (!(events = PyMem_New(struct epoll_event, max_events))
+            || !(reads = PyMem_New(PollerRead, max_events))) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    n_events = epoll_wait(self->epfd, events, max_events, ms);
+    if (n_events == -1)
+        err = errno;
+    Py_END_ALLOW_THREADS
+    if (n_events == -1) {
+        if (err != EINTR)
+            QBUF_SET_ERROR(err);
+        else if (!PyErr_CheckSignals())
+            ret = PyList_New(0);
+        goto cleanup;
+    }
+
+    /* Claim memory for a read into each queue, as recv_from does. A queue
+     * busy with another read (perhaps one registered for another fd) is
+     * left for next time. */
+    for (i = 0; i < n_events; ++i) {
+        op = reads + n_reads;
+        op->fd = events[i].data.fd;
+        if (op->fd >= self->entries_length)
+            continue;
+        entry = self->entries + op->fd;
+        if (!(queue = entry->queue) || queue->recv_busy)
+            continue;
+        op->max_bytes = entry->max_bytes;
+        op->err = 0;
+        if (!(op->dest = BufferQueue_claim_read(queue, &op->max_bytes,
+                &op->slab)))
+            goto finish;
+        op->queue = queue;
+        Py_INCREF(queue);
+        queue->recv_busy = 1;
+        ++n_reads;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < n_reads; ++i) {
+        op = reads + i;
+        do
+            op->n_read = qbuf_read(op->fd, op->dest, op->max_bytes);
+        while (op->n_read < 0 && (op->err = errno) == EINTR);
+    }
+    Py_END_ALLOW_THREADS
+
+    while (n_finished < n_reads) {
+        op = reads + n_finished++;
+        op->queue->recv_busy = 0;
+        if (BufferQueue_finish_read(op->queue, op->slab, op->dest,
+                op->max_bytes, op->n_read) == -1)
+            goto finish;
+    }
+    if (!(ret = PyList_New(0)))
+        goto finish;
+    for (i = 0; i < n_reads; ++i)
+        if (Poller_report(self, reads + i, ret) == -1) {
+            Py_CLEAR(ret);
+            break;
+        }
+
+  finish:
+    /* Reads not yet finished with when something failed are dropped, and
+     * their memory given back. */
+    for (i = n_finished; i < n_reads; ++i)
+        BufferQueue_finish_read(reads[i].queue, reads[i].slab,
+            reads[i].dest, reads[i].max_bytes, 0);
+    for (i = 0; i < n_reads; ++i) {
+        reads[i].queue->recv_busy = 0;
+        Py_DECREF(reads[i].queue);
     }
+  cleanup:
+    PyMem_Free(events);
+    PyMem_Free(reads);
     return ret;
 }
 
-PyDoc_STRVAR(BufferQueue_doc_clear,
-"clear() -> None\n\
+PyDoc_STRVAR(Poller_doc_fileno,
+"fileno() -> int\n\
 \n\
-Clear the buffer.\n\
+Return the epoll file descriptor, which is readable whenever poll\n\
+has something to read.\n\
 ");
 
 static PyObject *
-BufferQueue_doclear(BufferQueue *self)
+Poller_dofileno(Poller *self)
 {
-    BufferQueue_clear_buffer(self);
-    self->start_idx = self->end_idx = self->n_items = 0;
-    self->tot_length = self->cur_offset = 0;
-    Py_RETURN_NONE;
+    if (Poller_check(self) == -1)
+        return NULL;
+    return PyInt_FromLong(self->epfd);
 }
 
-static PyMethodDef BufferQueue_methods[] = {
-    {"push", (PyCFunction)BufferQueue_dopush,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push},
-    {"push_many", (PyCFunction)BufferQueue_dopush_many,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_push_many},
-    {"pop", (PyCFunction)BufferQueue_dopop,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop},
-    {"pop_atmost", (PyCFunction)BufferQueue_dopop_atmost,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_atmost},
-    {"pop_view", (PyCFunction)BufferQueue_dopop_view,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_view},
-    {"pop_struct", (PyCFunction)BufferQueue_dopop_struct,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_pop_struct},
-    {"popline", (PyCFunction)BufferQueue_dopopline,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_popline},
-    {"poplines", (PyCFunction)BufferQueue_dopoplines,
-        METH_VARARGS | METH_KEYWORDS, BufferQueue_doc_poplines},
-    {"clear", (PyCFunction)BufferQueue_doclear,
-        METH_NOARGS, BufferQueue_doc_clear},
-    {NULL}  /* Sentinel */
-};
-
-static PyObject *
-BufferQueue_repr(BufferQueue *self)
-{
-    return PyString_FromFormat(
-        "<BufferQueue of " FMT_PY_SSIZE_T " bytes>", self->tot_length);
-}
+PyDoc_STRVAR(Poller_doc_close,
+"close() -> None\n\
+\n\
+Unregister everything and close the epoll file descriptor.\n\
+");
 
 static PyObject *
-BufferQueue_iter(BufferQueue *self)
+Poller_doclose(Poller *self)
 {
-    Py_INCREF(self);
-    return (PyObject *)self;
+    Poller_clear(self);
+    if (self->epfd != -1) {
+        close(self->epfd);
+        self->epfd = -1;
+    }
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-BufferQueue_iternext(BufferQueue *self)
+Poller_getclosed(Poller *self, void *closure)
 {
-    Py_ssize_t out_string_size;
-    if (!self->delim_obj) {
-        PyErr_SetString(PyExc_ValueError, "no delimiter");
-        return NULL;
-    }
-
-    if ((out_string_size = BufferQueue_find_delim(self,
-            (PyStringObject *)self->delim_obj)) == -1) {
-        PyErr_SetNone(PyExc_StopIteration);
-        return NULL;
-    }
-    return BufferQueue_pop(self,
-        out_string_size + PyString_GET_SIZE(self->delim_obj), 0);
+    return PyBool_FromLong(self->epfd == -1);
 }
 
 static Py_ssize_t
-BufferQueue_length(BufferQueue *self)
+Poller_length(Poller *self)
 {
-    return self->tot_length;
+    return self->n_registered;
 }
 
-static PySequenceMethods BufferQueue_as_sequence = {
-    (lenfunc)BufferQueue_length,
+static PyMethodDef Poller_methods[] = {
+    {"register", (PyCFunction)Poller_doregister,
+        METH_VARARGS | METH_KEYWORDS, Poller_doc_register},
+    {"unregister", (PyCFunction)Poller_dounregister,
+        METH_VARARGS | METH_KEYWORDS, Poller_doc_unregister},
+    {"poll", (PyCFunction)Poller_dopoll,
+        METH_VARARGS | METH_KEYWORDS, Poller_doc_poll},
+    {"fileno", (PyCFunction)Poller_dofileno,
+        METH_NOARGS, Poller_doc_fileno},
+    {"close", (PyCFunction)Poller_doclose,
+        METH_NOARGS, Poller_doc_close},
+    {NULL}  /* Sentinel */
 };
 
-static PyTypeObject BufferQueueType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                          /*ob_size*/
-    "qbuf.BufferQueue",         /*tp_name*/
-    sizeof(BufferQueue),        /*tp_basicsize*/
+static PyGetSetDef Poller_getset[] = {
+    {"closed",
+     (getter)Poller_getclosed, NULL,
+     "whether close() has been called",
+     NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods Poller_as_sequence = {
+    (lenfunc)Poller_length,     /* sq_length */
+};
+
+PyDoc_STRVAR(Poller_doc,
+"Poller()\n\
+\n\
+Read from many file descriptors into their own BufferQueues at once,\n\
+waiting on them with epoll. Instead of calling recv_from and\n\
+poplines for each ready socket, one poll call does all of it without\n\
+the GIL, and returns the lines popped from each buffer together.\n\
+");
+
+static PyTypeObject PollerType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "qbuf.Poller",              /*tp_name*/
+    sizeof(Poller),             /*tp_basicsize*/
     0,                          /*tp_itemsize*/
-    (destructor)BufferQueue_dealloc, /*tp_dealloc*/
+    (destructor)Poller_dealloc, /*tp_dealloc*/
     0,                          /*tp_print*/
     0,                          /*tp_getattr*/
     0,                          /*tp_setattr*/
     0,                          /*tp_compare*/
-    (reprfunc)BufferQueue_repr, /*tp_repr*/
+    0,                          /*tp_repr*/
     0,                          /*tp_as_number*/
-    &BufferQueue_as_sequence,   /*tp_as_sequence*/
+    &Poller_as_sequence,        /*tp_as_sequence*/
     0,                          /*tp_as_mapping*/
     0,                          /*tp_hash */
     0,                          /*tp_call*/
-    (reprfunc)BufferQueue_repr, /*tp_str*/
+    0,                          /*tp_str*/
     0,                          /*tp_getattro*/
     0,                          /*tp_setattro*/
     0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-    BufferQueue_doc,            /* tp_doc */
-    0,                          /* tp_traverse */
-    0,                          /* tp_clear */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
+    Poller_doc,                 /* tp_doc */
+    (traverseproc)Poller_traverse, /* tp_traverse */
+    (inquiry)Poller_clear,      /* tp_clear */
     0,                          /* tp_richcompare */
     0,                          /* tp_weaklistoffset */
-    (getiterfunc)BufferQueue_iter, /* tp_iter */
-    (iternextfunc)BufferQueue_iternext, /* tp_iternext */
-    BufferQueue_methods,        /* tp_methods */
+    0,                          /* tp_iter */
+    0,                          /* tp_iternext */
+    Poller_methods,             /* tp_methods */
     0,                          /* tp_members */
-    BufferQueue_getset,         /* tp_getset */
+    Poller_getset,              /* tp_getset */
     0,                          /* tp_base */
     0,                          /* tp_dict */
     0,                          /* tp_descr_get */
     0,                          /* tp_descr_set */
     0,                          /* tp_dictoffset */
-    (initproc)BufferQueue_init, /* tp_init */
+    0,                          /* tp_init */
     0,                          /* tp_alloc */
-    (newfunc)BufferQueue_new,   /* tp_new */
+    (newfunc)Poller_new,        /* tp_new */
 };
 
+#endif
+
 static PyMethodDef qbuf_methods[] = {
     {NULL}  /* Sentinel */
 };
 
-PyMODINIT_FUNC
-init_qbuf(void)
-{
-    PyObject *m, *_struct = NULL;
+PyDoc_STRVAR(qbuf_doc,
+"C implementations of things in the qbuf package.");
 
-    if (!(m = Py_InitModule3("_qbuf", qbuf_methods,
-            "C implementations of things in the qbuf package.")))
-        goto cleanup;
+static int
+qbuf_exec(PyObject *m)
+{
+    PyObject *_struct, *header_size;
+    int result;
 
+    if (PyType_Ready(&BufferSlabType) < 0)
+        return -1;
+    if (PyType_Ready(&BufferReservationType) < 0)
+        return -1;
+    if (PyType_Ready(&StructCacheEntryType) < 0)
+        return -1;
+    if (PyType_Ready(&BufferCursorType) < 0)
+        return -1;
     if (PyType_Ready(&BufferQueueType) < 0)
-        goto cleanup;
+        return -1;
     Py_INCREF(&BufferQueueType);
-    PyModule_AddObject(m, "BufferQueue", (PyObject *)&BufferQueueType);
+    if (PyModule_AddObject(m, "BufferQueue", (PyObject *)&BufferQueueType)) {
+        Py_DECREF(&BufferQueueType);
+        return -1;
+    }
+
+    if (!str_lineReceived) {
+        if (!(str_mode = PyNativeString_InternFromString("mode"))
+                || !(str_current_state = PyNativeString_InternFromString(
+                    "current_state"))
+                || !(str_getInitialState = PyNativeString_InternFromString(
+                    "getInitialState"))
+                || !(str_rawDataReceived = PyNativeString_InternFromString(
+                    "rawDataReceived"))
+                || !(str_lineReceived = PyNativeString_InternFromString(
+                    "lineReceived")))
+            return -1;
+    }
+    if (PyType_Ready(&DispatcherType) < 0)
+        return -1;
+    Py_INCREF(&DispatcherType);
+    if (PyModule_AddObject(m, "Dispatcher", (PyObject *)&DispatcherType)) {
+        Py_DECREF(&DispatcherType);
+        return -1;
+    }
+    if (PyModule_AddIntConstant(m, "MODE_RAW", MODE_RAW)
+            || PyModule_AddIntConstant(m, "MODE_DELIMITED", MODE_DELIMITED)
+            || PyModule_AddIntConstant(m, "MODE_STATEFUL", MODE_STATEFUL))
+        return -1;
+
+    if (PyType_Ready(&SharedRingType) < 0)
+        return -1;
+    if (!(header_size = PyInt_FromSsize_t(sizeof(SharedRingHeader))))
+        return -1;
+    result = PyDict_SetItemString(SharedRingType.tp_dict, "header_size",
+        header_size);
+    Py_DECREF(header_size);
+    if (result == -1)
+        return -1;
+    Py_INCREF(&SharedRingType);
+    if (PyModule_AddObject(m, "SharedRing", (PyObject *)&SharedRingType)) {
+        Py_DECREF(&SharedRingType);
+        return -1;
+    }
+#ifdef QBUF_HAVE_EPOLL
+    if (PyType_Ready(&PollerType) < 0)
+        return -1;
+    Py_INCREF(&PollerType);
+    if (PyModule_AddObject(m, "Poller", (PyObject *)&PollerType)) {
+        Py_DECREF(&PollerType);
+        return -1;
+    }
+#endif
 
-    if (!(qbuf_underflow = PyErr_NewException(
+    if (!qbuf_underflow && !(qbuf_underflow = PyErr_NewException(
             "qbuf.BufferUnderflow", NULL, NULL)))
-        goto cleanup;
+        return -1;
     Py_INCREF(qbuf_underflow);
-    PyModule_AddObject(m, "BufferUnderflow", qbuf_underflow);
+    if (PyModule_AddObject(m, "BufferUnderflow", qbuf_underflow)) {
+        Py_DECREF(qbuf_underflow);
+        return -1;
+    }
 
-    if (!(_struct = PyImport_ImportModule("struct")))
-        goto cleanup;
-    if (!(_struct_obj = PyObject_GetAttrString(_struct, "Struct")))
-        goto cleanup;
+    if (!qbuf_frame_too_long && !(qbuf_frame_too_long = PyErr_NewException(
+            "qbuf.FrameTooLong", PyExc_ValueError, NULL)))
+        return -1;
+    Py_INCREF(qbuf_frame_too_long);
+    if (PyModule_AddObject(m, "FrameTooLong", qbuf_frame_too_long)) {
+        Py_DECREF(qbuf_frame_too_long);
+        return -1;
+    }
 
-cleanup:
-    Py_XDECREF(_struct);
+    if (!qbuf_overflow && !(qbuf_overflow = PyErr_NewException(
+            "qbuf.BufferOverflow", NULL, NULL)))
+        return -1;
+    Py_INCREF(qbuf_overflow);
+    if (PyModule_AddObject(m, "BufferOverflow", qbuf_overflow)) {
+        Py_DECREF(qbuf_overflow);
+        return -1;
+    }
+
+    if (!_struct_obj) {
+        if (!(_struct = PyImport_ImportModule("struct")))
+            return -1;
+        _struct_obj = PyObject_GetAttrString(_struct, "Struct");
+        Py_DECREF(_struct);
+        if (!_struct_obj)
+            return -1;
+    }
+    if (!struct_cache && !(struct_cache = PyDict_New()))
+        return -1;
+    return 0;
+}
+
+#if PY_MAJOR_VERSION >= 3
+
+#if PY_VERSION_HEX >= 0x03050000
+static PyModuleDef_Slot qbuf_slots[] = {
+    {Py_mod_exec, (void *)qbuf_exec},
+    {0, NULL}  /* Sentinel */
+};
+#else
+#  define qbuf_slots NULL
+#endif
+
+static struct PyModuleDef qbuf_module = {
+    PyModuleDef_HEAD_INIT,
+    "_qbuf",                    /* m_name */
+    qbuf_doc,                   /* m_doc */
+    0,                          /* m_size */
+    qbuf_methods,               /* m_methods */
+    qbuf_slots,                 /* m_slots */
+    NULL,                       /* m_traverse */
+    NULL,                       /* m_clear */
+    NULL,                       /* m_free */
+};
+
+PyMODINIT_FUNC
+PyInit__qbuf(void)
+{
+#if PY_VERSION_HEX >= 0x03050000
+    return PyModuleDef_Init(&qbuf_module);
+#else
+    PyObject *m;
+    if ((m = PyModule_Create(&qbuf_module)) && qbuf_exec(m) == -1)
+        Py_CLEAR(m);
+    return m;
+#endif
+}
+
+#else
+
+PyMODINIT_FUNC
+init_qbuf(void)
+{
+    PyObject *m;
+
+    if (!(m = Py_InitModule3("_qbuf", qbuf_methods, qbuf_doc)))
+        return;
+    qbuf_exec(m);
 }
+
+#endif
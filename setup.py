@@ -1,11 +1,7 @@
-import sys
-
 from setuptools import setup, Extension
 
 
-ext_modules = []
-if sys.version_info < (3,):
-    ext_modules.append(Extension('qbuf._qbuf', ['qbufmodule.c']))
+ext_modules = [Extension('qbuf._qbuf', ['qbufmodule.c'])]
 
 
 setup(
@@ -28,6 +24,7 @@ setup(
         'Operating System :: OS Independent',
         'Programming Language :: C',
         'Programming Language :: Python :: 2',
+        'Programming Language :: Python :: 3',
         'Topic :: Utilities',
     ],
 )